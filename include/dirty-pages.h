@@ -0,0 +1,51 @@
+#ifndef DIRTY_PAGES_H
+#define DIRTY_PAGES_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* File-backed filters keep one flag per 1 << DIRTY_SHIFT bytes of their
+ * mapping, set after every store to those bytes, so that a flush only has to
+ * write back what changed since the last one.
+ */
+#define DIRTY_SHIFT 12
+
+static inline uint64_t dirty_nflags(uint64_t len)
+{
+    return (len + (1ULL << DIRTY_SHIFT) - 1) >> DIRTY_SHIFT;
+}
+
+/* Flag the bytes from begin to end, both included. The release store keeps
+ * the flag from becoming visible before the data it covers. */
+static inline void dirty_mark(volatile uint8_t *dirty,
+                              uint64_t begin,
+                              uint64_t end)
+{
+    for (uint64_t i = begin >> DIRTY_SHIFT; i <= end >> DIRTY_SHIFT; ++i)
+        __atomic_store_n(&dirty[i], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes the flagged parts of the len bytes mapped at base back to their
+ * file and clears the flags. Adjacent flags are merged into one range, and
+ * the ranges are synced by up to nthreads threads at once.
+ *
+ * Stores that race with the flush either make it to disk now or leave their
+ * flag set for the next one.
+ *
+ * Returns the number of bytes written back, or -1 if a range couldn't be
+ * synced; its flags are then set again.
+ */
+int64_t dirty_msync(void *base,
+                    uint64_t len,
+                    volatile uint8_t *dirty,
+                    int nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
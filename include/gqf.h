@@ -154,6 +154,84 @@ int cqf_insert(CQF *qf,
                uint64_t count,
                uint8_t flags);
 
+/* Increment the counters of n key/value pairs, by counts[i] each (or by 1
+ * if counts is NULL; values may be NULL for 0).  The batch is hashed and
+ * sorted, equal pairs are added up, and the pairs are merged into each
+ * cluster of the CQF in one pass, taking the locks of each region once.
+ * Return value:
+ *    == 0: all the pairs were inserted.
+ *    == QF_NO_SPACE: the CQF has reached capacity.
+ *    == QF_COULDNT_LOCK: TRY_ONCE_LOCK has failed to acquire the locks of
+ *                        some regions, whose pairs were not inserted.
+ */
+int cqf_insert_batch(CQF *qf,
+                     const uint64_t *keys,
+                     const uint64_t *values,
+                     const uint64_t *counts,
+                     uint64_t n,
+                     uint8_t flags);
+
+/* Replace the contents of qf with n hashes, as cqf_insert() stores keys
+ * with QF_KEY_IS_HASH, with values[i] (0 if values is NULL) and counts[i]
+ * (1 if counts is NULL).  The pairs must be in ascending order of hash,
+ * then value; equal pairs are added up.  The table is written left to
+ * right in one pass, without shifting.
+ * Return value:
+ *    == 0: success.
+ *    == QF_INVALID: the pairs are out of order, or a hash is out of range.
+ *    == QF_NO_SPACE: the pairs don't fit into the CQF.
+ * On failure qf is left empty.
+ */
+int cqf_build_from_sorted(CQF *qf,
+                          const uint64_t *hashes,
+                          const uint64_t *values,
+                          const uint64_t *counts,
+                          uint64_t n);
+
+/* Insert buffers, for many threads inserting into one CQF.
+
+         Each thread collects its inserts in a buffer of its own, which is
+         written into the CQF in sorted batches, taking the locks of each
+         region of the CQF once for all the keys in it.  Once the buffer is
+         half full, every insert tries to write it out with TRY_ONCE_LOCK,
+         and the regions whose locks are busy stay in the buffer.  A full
+         buffer is written out with WAIT_FOR_LOCK.
+
+         Queries only see what has been written out; flush the buffer with
+         WAIT_FOR_LOCK to write out everything.  A buffer must not be shared
+         between threads. */
+typedef struct quotient_filter_insert_buffer quotient_filter_insert_buffer;
+typedef quotient_filter_insert_buffer cqf_insert_buffer;
+
+/* Initialize a buffer of up to size inserts into qf.
+   Returns false if out of memory. */
+bool cqf_insert_buffer_init(CQF *qf, cqf_insert_buffer *buf, uint64_t size);
+
+/* Add count instances of this key/value pair to the buffer.  The locking
+ * mode of flags is used for writing the buffer out: with QF_NO_LOCK it is
+ * written out once half full, without any locks.
+ * Return value:
+ *    == 0: the insert was buffered.
+ *    == QF_NO_SPACE: the buffer is full and the CQF has reached capacity.
+ */
+int cqf_buffered_insert(cqf_insert_buffer *buf,
+                        uint64_t key,
+                        uint64_t value,
+                        uint64_t count,
+                        uint8_t flags);
+
+/* Write the buffered inserts into the CQF.  With QF_TRY_ONCE_LOCK, the
+ * ones in regions whose locks are busy are left in the buffer.
+ * Return value:
+ *    >= 0: number of distinct key/value pairs left in the buffer.
+ *    == QF_NO_SPACE: the CQF has reached capacity; what didn't fit is
+ *                    left in the buffer.
+ */
+int64_t cqf_insert_buffer_flush(cqf_insert_buffer *buf, uint8_t flags);
+
+/* Free the buffer, dropping anything that hasn't been flushed. */
+void cqf_insert_buffer_destroy(cqf_insert_buffer *buf);
+
 /* Set the counter for this key/value pair to count.
  Return value: Same as cqf_insert.
  Returns 0 if new count is equal to old count.
@@ -217,6 +295,26 @@ uint64_t cqf_count_key_value(const CQF *qf,
                              uint64_t value,
                              uint8_t flags);
 
+/* Batch versions of cqf_query and cqf_count_key_value: store the
+         results for keys[i] in values[i] and counts[i].  values may be NULL
+         for cqf_count_key_value_batch, meaning 0 for every key.  The home
+         blocks and then the start of the runs of upcoming keys are
+         prefetched while earlier keys are resolved, so that the cache
+         misses of CQF_PREFETCH_WIDTH (default 16, set at build time)
+         lookups overlap instead of being paid one after the other.  */
+void cqf_query_batch(const CQF *qf,
+                     const uint64_t *keys,
+                     uint64_t *values,
+                     uint64_t *counts,
+                     uint64_t n,
+                     uint8_t flags);
+void cqf_count_key_value_batch(const CQF *qf,
+                               const uint64_t *keys,
+                               const uint64_t *values,
+                               uint64_t *counts,
+                               uint64_t n,
+                               uint8_t flags);
+
 /* Returns a unique index corresponding to the key in the CQF.  Note
          that this can change if further modifications are made to the
          CQF.
@@ -0,0 +1,233 @@
+/*
+ * Interleaved CQF lookups with C++20 coroutines.
+ *
+ * Lookups run in coroutines that prefetch each block they are about to
+ * read, the home block, then where the run starts, then every further
+ * block the run reaches into, and suspend until they are resumed.  A
+ * lookup_engine keeps width lookups in flight and resumes them round
+ * robin, so the cache misses of one lookup overlap the work of the others.
+ * Unlike the fixed stages of cqf_count_key_value_batch(), a lookup that
+ * walks a long run or cluster just suspends more often and doesn't hold
+ * up the rest of the batch.
+ *
+ * The engine reads the CQF it is given in place; it must not be modified
+ * while a batch runs.
+ */
+
+#ifndef _GQF_CORO_HPP_
+#define _GQF_CORO_HPP_
+
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <vector>
+
+#include "gqf.h"
+#include "gqf_int.h"
+
+namespace gqf_coro {
+
+static inline uint64_t mask(uint64_t nbits)
+{
+    return nbits == 64 ? ~0ULL : (1ULL << nbits) - 1;
+}
+
+static inline const void *slot_address(const CQF *qf, uint64_t index)
+{
+    const uint8_t *slots =
+        (const uint8_t *) get_block(qf, index / QF_SLOTS_PER_BLOCK)->slots;
+    return slots +
+           (index % QF_SLOTS_PER_BLOCK) * qf->metadata->bits_per_slot / 8;
+}
+
+/* A coroutine that starts suspended and runs until it is done. */
+class task {
+public:
+    struct promise_type {
+        task get_return_object()
+        {
+            return task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> h) : h_(h) {}
+    task(task &&other) noexcept : h_(other.h_) { other.h_ = nullptr; }
+    task(const task &) = delete;
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    bool done() const { return h_.done(); }
+    void resume() const { h_.resume(); }
+
+private:
+    std::coroutine_handle<promise_type> h_;
+};
+
+/* Prefetch up to two addresses and give the other lookups a turn. */
+struct prefetch {
+    const void *a;
+    const void *b = nullptr;
+
+    bool await_ready() const noexcept
+    {
+        __builtin_prefetch(a);
+        if (b)
+            __builtin_prefetch(b);
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<>) const noexcept {}
+    void await_resume() const noexcept {}
+};
+
+/* Where to look for one key: the counter in bucket whose remainder,
+ * shifted right by shift, is remainder.  When value isn't NULL the value
+ * bits of the last counter looked at are stored there, as cqf_query()
+ * does. */
+struct target {
+    uint64_t bucket;
+    uint64_t remainder;
+    uint64_t shift;
+    uint64_t *value;
+};
+
+/*
+ * A lane of the engine: it claims lookup i from next, finds target(i)
+ * and stores its count in counts[i], over and over until no lookups are
+ * left.  Keeping a few lanes alive for the whole batch, rather than one
+ * coroutine per lookup, spares allocating a frame for every lookup.
+ */
+template <typename Target>
+static task lane(const CQF *qf,
+                 uint64_t &next,
+                 uint64_t n,
+                 uint64_t *counts,
+                 Target target)
+{
+    while (next < n) {
+        uint64_t i = next++;
+        struct target t = target(i);
+        uint64_t count = 0;
+
+        uint64_t blockidx =
+            t.bucket == 0 ? 0 : (t.bucket - 1) / QF_SLOTS_PER_BLOCK;
+        const qfblock *home = get_block(qf, t.bucket / QF_SLOTS_PER_BLOCK);
+        const qfblock *prev = get_block(qf, blockidx);
+        co_await prefetch{home, prev == home ? nullptr : prev};
+
+        if (cqf_is_occupied(qf, t.bucket)) {
+            /* The block offset tells roughly where the run starts */
+            uint64_t index = QF_SLOTS_PER_BLOCK * blockidx + prev->offset;
+            if (index < t.bucket)
+                index = t.bucket;
+            if (index < qf->metadata->xnslots)
+                co_await prefetch{get_block(qf, index / QF_SLOTS_PER_BLOCK),
+                                  slot_address(qf, index)};
+            uint64_t prefetched = index / QF_SLOTS_PER_BLOCK;
+
+            /* Walk the run, prefetching each further block it reaches */
+            index = cqf_run_start(qf, t.bucket);
+            for (;;) {
+                if (index / QF_SLOTS_PER_BLOCK != prefetched) {
+                    prefetched = index / QF_SLOTS_PER_BLOCK;
+                    co_await prefetch{get_block(qf, prefetched),
+                                      slot_address(qf, index)};
+                }
+                uint64_t current_remainder, current_count;
+                uint64_t end = cqf_decode_counter(
+                    qf, index, &current_remainder, &current_count);
+                if (t.value)
+                    *t.value = current_remainder & mask(t.shift);
+                if (current_remainder >> t.shift == t.remainder) {
+                    count = current_count;
+                    break;
+                }
+                if (cqf_is_runend(qf, end))
+                    break;
+                index = end + 1;
+            }
+        }
+        counts[i] = count;
+    }
+}
+
+class lookup_engine {
+public:
+    /* Run up to width lookups at once on qf, which isn't copied. */
+    explicit lookup_engine(const CQF *qf, unsigned width = 32)
+        : qf_(qf), width_(width ? width : 1)
+    {
+    }
+
+    /* Same as cqf_count_key_value_batch(). */
+    void count_key_value(const uint64_t *keys,
+                         const uint64_t *values,
+                         uint64_t *counts,
+                         uint64_t n,
+                         uint8_t flags) const
+    {
+        const CQF *qf = qf_;
+        run(n, counts, [=](uint64_t i) {
+            const qfmetadata *m = qf->metadata;
+            uint64_t hash =
+                (cqf_hash_key(qf, keys[i], flags) << m->value_bits) |
+                ((values ? values[i] : 0) & mask(m->value_bits));
+            return target{hash >> m->bits_per_slot,
+                          hash & mask(m->bits_per_slot), 0, nullptr};
+        });
+    }
+
+    /* Same as cqf_query_batch(). */
+    void query(const uint64_t *keys,
+               uint64_t *values,
+               uint64_t *counts,
+               uint64_t n,
+               uint8_t flags) const
+    {
+        const CQF *qf = qf_;
+        run(n, counts, [=](uint64_t i) {
+            const qfmetadata *m = qf->metadata;
+            uint64_t hash = cqf_hash_key(qf, keys[i], flags);
+            return target{hash >> m->key_remainder_bits,
+                          hash & mask(m->key_remainder_bits), m->value_bits,
+                          &values[i]};
+        });
+    }
+
+private:
+    /* Resume the lanes round robin until all lookups are done. */
+    template <typename Target>
+    void run(uint64_t n, uint64_t *counts, Target target) const
+    {
+        uint64_t next = 0;
+        std::vector<task> lanes;
+        lanes.reserve(width_);
+        for (unsigned l = 0; l < width_ && l < n; l++)
+            lanes.push_back(lane(qf_, next, n, counts, target));
+
+        bool running = true;
+        while (running) {
+            running = false;
+            for (task &t : lanes) {
+                if (t.done())
+                    continue;
+                t.resume();
+                running = true;
+            }
+        }
+    }
+
+    const CQF *qf_;
+    unsigned width_;
+};
+
+}  // namespace gqf_coro
+
+#endif /* _GQF_CORO_HPP_ */
@@ -32,16 +32,33 @@ bool cqf_initfile(CQF *qf,
 #define QF_USEFILE_READ_ONLY (0x01)
 #define QF_USEFILE_READ_WRITE (0x02)
 
-/* mmap existing cqf in "filename" into "qf". */
+/* mmap existing cqf in "filename" into "qf".  Returns 0 if a resize of
+ * the file was cut short. */
 uint64_t cqf_usefile(CQF *qf, const char *filename, int flag);
 
-/* Resize the QF to the specified number of slots.  Uses mmap to
- * initialize the new file, and calls munmap() on the old memory.
+/* Resize the QF to the specified number of slots.  Growing happens in the
+ * same file, in three sequential passes: a dry run over the old table
+ * counts how many counters the builder has to wait for, and a queue that
+ * holds them is allocated up front; then the file is extended and remapped
+ * with mremap(), the old table is moved to its end, and the new one is
+ * built in order from the start, reading ahead into the queue.  No second
+ * table is needed.  Until the new one is on disk, the file is marked so
+ * that cqf_usefile() refuses it.  Shrinking copies into a new file that
+ * replaces the old one.
  * Return value:
  *    >= 0: number of keys copied during resizing.
+ *    == -1: growing the file, allocating the resize queue or marking the
+ *           file failed, before anything was changed.
  * */
 int64_t cqf_resize_file(CQF *qf, uint64_t nslots);
 
+/* Write the parts of the file that changed since the last flush back to
+ * disk, split over up to nthreads threads, and return how many bytes that
+ * was, or -1 on failure.  Inserts and removes flag the pages they store to,
+ * so this costs in proportion to what changed rather than to the size of
+ * the CQF.  Changes that race with a flush are left for the next one. */
+int64_t cqf_flush_incremental(CQF *qf, int nthreads);
+
 bool cqf_closefile(CQF *qf);
 
 bool cqf_deletefile(CQF *qf);
@@ -22,13 +22,19 @@ extern "C" {
 
 #define MAGIC_NUMBER 1018874902021329732
 
+/* In the reserved field of a file while cqf_resize_file() grows it in place.
+ * The table is half built until the field is cleared again. */
+#define CQF_RESIZING 1
+
 /* Can be
    0 (choose size at run-time),
    8, 16, 32, or 64 (for optimized versions),
    or other integer <= 56 (for compile-time-optimized bit-shifting-based
    versions)
 */
+#ifndef QF_BITS_PER_SLOT
 #define QF_BITS_PER_SLOT 0
+#endif
 
 /* Must be >= 6.  6 seems fastest. */
 #define QF_BLOCK_OFFSET_BITS (6)
@@ -58,9 +64,6 @@ typedef struct __attribute__((__packed__)) qfblock {
 #endif
 } qfblock;
 
-struct __attribute__((__packed__)) qfblock;
-typedef struct qfblock qfblock;
-
 typedef struct file_info {
     int fd;
     char *filepath;
@@ -86,6 +89,7 @@ typedef struct quotient_filter_runtime_data {
     volatile int metadata_lock;
     volatile int *locks;
     wait_time_data *wait_times;
+    volatile uint8_t *dirty; /* changed pages of a file, see dirty-pages.h */
 } quotient_filter_runtime_data;
 
 typedef quotient_filter_runtime_data qfruntime;
@@ -152,6 +156,73 @@ typedef struct quotient_filter_iterator {
     cluster_data *c_info;
 } quotient_filter_iterator;
 
+/* A hash, key << value_bits | value, and how often it was inserted. */
+typedef struct {
+    uint64_t hash;
+    uint64_t count;
+} cqf_hash_count;
+
+typedef struct quotient_filter_insert_buffer {
+    CQF *qf;
+    cqf_hash_count *items; /* in the order they were inserted */
+    uint64_t nitems;
+    uint64_t size;
+    uint64_t next_flush; /* try to flush once nitems gets here */
+} quotient_filter_insert_buffer;
+
+/* Lays out an empty CQF left to right from hashes in ascending order, with
+ * no shifting. Appending the same hash again adds to its count. */
+typedef struct {
+    uint64_t next;   /* first slot that has not been written yet */
+    uint64_t bucket; /* home slot of the open run */
+    bool run_open;
+    uint64_t hash; /* hash waiting to be written, with its count */
+    uint64_t count;
+    bool pending;
+    int64_t nelts, ndistinct_elts, noccupied_slots;
+} cqf_builder;
+
+/* Reset qf and start building it with b. */
+void cqf_builder_init(CQF *qf, cqf_builder *b);
+
+/* Append count instances of hash, which is key << value_bits | value.
+ * Return value:
+ *    == 0: success.
+ *    == QF_INVALID: hash is smaller than the one before, or out of range.
+ *    == QF_NO_SPACE: the runs don't fit into the CQF.
+ */
+int cqf_builder_append(CQF *qf, cqf_builder *b, uint64_t hash, uint64_t count);
+
+/* Write what is left and update the counters of qf.
+ * Return value: Same as cqf_builder_append.
+ */
+int cqf_builder_finish(CQF *qf, cqf_builder *b);
+
+/* The steps of a lookup, for code outside gqf.c that schedules lookups
+ * itself, such as the coroutine engine in gqf_coro.hpp. */
+
+/* The hash cqf_insert() stores for key, before the value bits. */
+uint64_t cqf_hash_key(const CQF *qf, uint64_t key, uint8_t flags);
+
+/* Whether slot index is the home slot of a run. */
+bool cqf_is_occupied(const CQF *qf, uint64_t index);
+
+/* Whether slot index ends a run. */
+bool cqf_is_runend(const CQF *qf, uint64_t index);
+
+/* First slot of the run of bucket, which must be occupied. */
+uint64_t cqf_run_start(const CQF *qf, uint64_t bucket);
+
+/* Decode the counter starting at slot index into its remainder and count.
+ * Returns the last slot of the counter. */
+uint64_t cqf_decode_counter(const CQF *qf,
+                            uint64_t index,
+                            uint64_t *remainder,
+                            uint64_t *count);
+
+/* The number of slots the counter of count copies of remainder takes. */
+uint64_t cqf_counter_size(const CQF *qf, uint64_t remainder, uint64_t count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,74 @@
+#ifndef QUOTIENT_FILTER_BLOCKED_H
+#define QUOTIENT_FILTER_BLOCKED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Block-organized variant of quotient_filter.
+ *
+ * Slots are grouped in blocks of 64. Each block keeps an `occupieds' and a
+ * `runends' bitmap plus the offset of the first slot in the block that is
+ * not used by runs of earlier blocks, so the run for a quotient is located
+ * with one rank/select instead of a slot-by-slot walk of the cluster.
+ * Remainders are bit-packed right after the metadata of their block.
+ *
+ * The table is not circular: runs that spill past the last home slot are
+ * stored in a small overflow area at the end of the table.
+ */
+typedef struct {
+    uint8_t qbits, rbits;
+    uint64_t entries;
+    uint64_t index_mask, rmask;
+    uint64_t nslots, xnslots, nblocks;
+    uint64_t max_size;
+    uint64_t *blocks;
+} blocked_quotient_filter;
+
+/**
+ * Initializes a blocked quotient filter with capacity 2^q.
+ * Increasing r improves the filter's accuracy but uses more space.
+ *
+ * Returns false if q == 0, r == 0, q+r > 64, or on ENOMEM.
+ */
+bool bqf_init(blocked_quotient_filter *qf, uint32_t q, uint32_t r);
+
+/**
+ * Inserts a hash into the QF.
+ * Only the lowest q+r bits are actually inserted into the QF table.
+ *
+ * Returns false if the QF is full.
+ */
+bool bqf_insert(blocked_quotient_filter *qf, uint64_t hash);
+
+/**
+ * Returns true if the QF may contain the hash. Returns false otherwise.
+ */
+bool bqf_may_contain(blocked_quotient_filter *qf, uint64_t hash);
+
+/**
+ * Removes a hash from the QF.
+ * The same caution as for qf_remove() applies.
+ *
+ * Returns false if the hash uses more than q+r bits.
+ */
+bool bqf_remove(blocked_quotient_filter *qf, uint64_t hash);
+
+/**
+ * Resets the QF table. This function does not deallocate any memory.
+ */
+void bqf_clear(blocked_quotient_filter *qf);
+
+/**
+ * Finds the size (in bytes) of a blocked QF table.
+ * Caution: sizeof(blocked_quotient_filter) is not included.
+ */
+size_t bqf_table_size(uint32_t q, uint32_t r);
+
+/**
+ * Deallocates the QF table.
+ */
+void bqf_destroy(blocked_quotient_filter *qf);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef QUOTIENT_FILTER_CONVERT_H
+#define QUOTIENT_FILTER_CONVERT_H
+
+#include "gqf.h"
+#include "quotient-filter.h"
+
+/**
+ * Initializes cqf with the fingerprints of qf, each with a count of 1.
+ * The CQF gets 2^q slots of r bits and no value bits, and uses
+ * QF_HASH_NONE, so a fingerprint f is found with
+ * cqf_count_key_value(cqf, f, 0, QF_KEY_IS_HASH).
+ *
+ * Both filters are walked in hash order and the CQF is written in a single
+ * sequential pass; nothing is re-hashed or shifted.
+ *
+ * Returns false if r < 2 or on ENOMEM.
+ */
+bool qf_to_cqf(CQF *cqf, quotient_filter *qf);
+
+/**
+ * Initializes qf with the hashes of cqf: q is log2 of the number of slots
+ * and r the bits per slot of the CQF, and a fingerprint is
+ * key << value_bits | value. Counts are dropped. The fingerprints are the
+ * hashes the CQF computed, so look them up in the same hash mode and seed.
+ *
+ * Like qf_to_cqf(), this is a single sequential pass.
+ *
+ * Returns false if the CQF doesn't fit into a quotient_filter (r > 61), if
+ * it holds more distinct hashes than 2^q, or on ENOMEM.
+ */
+bool cqf_to_qf(quotient_filter *qf, const CQF *cqf);
+
+#endif /* QUOTIENT_FILTER_CONVERT_H */
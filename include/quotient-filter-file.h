@@ -7,7 +7,8 @@
  * Initializes a quotient filter with capacity 2^q in disk.
  * Increasing r improves the filter's accuracy but uses more space.
  *
- * Returns false if q == 0, r == 0, q+r > 64, or file allocation failed.
+ * Returns false if q == 0, r == 0, q+r > 64, r > 61, or file allocation
+ * failed.
  */
 bool qf_initfile(quotient_filter *qf,
                  uint32_t q,
@@ -15,20 +16,125 @@ bool qf_initfile(quotient_filter *qf,
                  const char *filename);
 
 
+#ifndef QF_USEFILE_READ_ONLY
+#define QF_USEFILE_READ_ONLY (0x01)
+#define QF_USEFILE_READ_WRITE (0x02)
+#endif
+
 /**
- * Read a quotient filter in disk.
+ * Opens a quotient filter that was created with qf_initfile(), mapping its
+ * table read-only or read-write in place, so nothing is read or rebuilt up
+ * front. The file starts with a header holding q, r and the number of
+ * entries. If it wasn't closed with qf_closefile() the entries are counted
+ * in one pass over the table.
+ *
+ * Writing to a QF opened with QF_USEFILE_READ_ONLY faults.
  *
- * Returns false file open failed.
+ * Returns false when the file can't be opened or is not a QF file.
  */
-bool qf_usefile(quotient_filter *qf, const char *filename);
+bool qf_usefile(quotient_filter *qf, const char *filename, int flag);
 
 
 /**
- * Update quotient filter from memory to disk.
+ * Update quotient filter from memory to disk, record the number of entries
+ * in the header, and unmap the file. A QF in WAL mode is checkpointed and
+ * its log removed.
  *
  * Returns false when free failed.
  */
 bool qf_closefile(quotient_filter *qf);
 
 
+/**
+ * Writes the pages of the table that changed since the last flush back to
+ * the file, so that a crash after it returns loses none of the changes
+ * made before it was called. Stores to the table flag the page they land
+ * on, and only runs of flagged pages are synced, split over up to nthreads
+ * threads; qf_closefile() does the same with one. A QF in WAL mode commits
+ * its log instead.
+ *
+ * May run concurrently with qf_insert() and qf_remove() in concurrent
+ * mode; changes that race with it are left for the next flush.
+ *
+ * Returns the number of bytes written back, or -1 on failure.
+ */
+int64_t qf_flush_incremental(quotient_filter *qf, int nthreads);
+
+
+/**
+ * Doubles the number of slots like qf_expand(), but in place: the file is
+ * grown and remapped, the old table is moved to its end with one sequential
+ * pass, and the new table is built from the start of the file in another,
+ * so neither a second file nor a second table in memory is needed.
+ *
+ * Without WAL mode a crash midway leaves a file that qf_usefile() refuses
+ * to open; in WAL mode the new table is written with a checkpoint.
+ *
+ * Returns false if r < 2 or the file can't be grown.
+ */
+bool qf_expandfile(quotient_filter *qf);
+
+
+/* Log size past which qf_wal_commit() checkpoints on its own. */
+#ifndef QF_WAL_CHECKPOINT_BYTES
+#define QF_WAL_CHECKPOINT_BYTES (64ULL << 20)
+#endif
+
+/**
+ * Write-ahead logging for a QF opened for writing. Making each change
+ * durable through the mapping means syncing every page it dirtied; in WAL
+ * mode the table is mapped privately instead, and changes made through
+ * qf_wal_insert() and qf_wal_remove() are appended to an operation log in
+ * "<filename>.wal". They are durable once qf_wal_commit() returns, which
+ * happens on its own every group changes (never, if group is 0), so many
+ * changes share one sync of a few pages of log.
+ *
+ * The file itself only changes at checkpoints, which write the pages that
+ * changed back into it and empty the log. The pages are first copied to a
+ * journal in "<filename>.ckpt", from which qf_usefile() finishes a
+ * checkpoint cut short by a crash. It also replays a log that is left
+ * over, on a private copy of the table if the file is read-only; a QF
+ * opened for writing stays in WAL mode.
+ *
+ * Changes made with qf_insert() and the like are not logged and are lost
+ * in a crash before the next checkpoint. None of these are thread-safe.
+ *
+ * Returns false if the file is read-only or the log can't be created.
+ * Calling it on a QF in WAL mode only changes group.
+ */
+bool qf_wal_enable(quotient_filter *qf, uint64_t group);
+
+/**
+ * Inserts a hash like qf_insert(), and logs it.
+ *
+ * Returns false if the QF is full or the log can't be written.
+ */
+bool qf_wal_insert(quotient_filter *qf, uint64_t hash);
+
+/**
+ * Removes a hash like qf_remove(), and logs it. Hashes that aren't in the
+ * QF are not logged.
+ *
+ * Returns false if the hash isn't in the QF or the log can't be written.
+ */
+bool qf_wal_remove(quotient_filter *qf, uint64_t hash);
+
+/**
+ * Makes all logged changes durable with one write and sync of the log, and
+ * checkpoints once the log grows past QF_WAL_CHECKPOINT_BYTES.
+ *
+ * Returns false if the log can't be written.
+ */
+bool qf_wal_commit(quotient_filter *qf);
+
+/**
+ * Writes the pages of the table that changed since the last checkpoint to
+ * "<filename>.ckpt" and then back into the file, and empties the log.
+ *
+ * Returns false if they can't be written; the log then still holds every
+ * change.
+ */
+bool qf_checkpoint(quotient_filter *qf);
+
+
 #endif
\ No newline at end of file
@@ -0,0 +1,48 @@
+#ifndef QUOTIENT_FILTER_INT_H
+#define QUOTIENT_FILTER_INT_H
+
+/* Internals of quotient_filter shared with the other modules of this
+ * library. Not part of the public interface. */
+
+#include "quotient-filter.h"
+
+struct __qf_iterator {
+    uint64_t index;
+    uint64_t quotient;
+    uint64_t visited;
+};
+
+/* State of a left-to-right construction of a QF from fingerprints given in
+ * ascending (quotient, remainder) order. Since nothing is ever placed before
+ * a slot that is already written, no element has to be shifted.
+ */
+typedef struct {
+    uint64_t next; /* first slot that has not been written yet */
+    uint64_t quot; /* fingerprint appended last */
+    uint64_t rem;
+    bool started;
+    bool wrapped; /* the last cluster reached the end of the table */
+} qf_builder;
+
+void qf_builder_init(qf_builder *b);
+
+/* Append hash to qf, which must have been empty when b was initialized.
+ * Repeated fingerprints are dropped.
+ *
+ * Returns false if the QF is full.
+ */
+bool qf_builder_append(quotient_filter *qf, qf_builder *b, uint64_t hash);
+
+/* Like qf_expand(), but in the memory of qf->table, which must have room for
+ * a table of q+1, r-1 and start with the current one. The old table is moved
+ * to the end of that space and the new one is built from the start, always
+ * reading ahead of the slots it writes, so the only extra memory is for
+ * fingerprints that were read early. Those are counted by a first pass
+ * over the table, so that all memory is allocated before anything is
+ * overwritten. qf->dirty must be NULL.
+ *
+ * Returns false, and changes nothing, if r < 2 or out of memory.
+ */
+bool qf_expand_in_place(quotient_filter *qf);
+
+#endif /* QUOTIENT_FILTER_INT_H */
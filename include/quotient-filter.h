@@ -5,13 +5,19 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct qf_file;
+
 typedef struct {
     uint8_t qbits, rbits;
     uint8_t elem_bits;
-    uint32_t entries;
+    uint64_t entries;
     uint64_t index_mask, rmask, elem_mask;
     uint64_t max_size;
     uint64_t *table;
+    volatile int *locks;
+    uint64_t nlocks;
+    struct qf_file *file; /* backing file, see quotient-filter-file.h */
+    volatile uint8_t *dirty; /* changed pages of a file, see dirty-pages.h */
 } quotient_filter;
 typedef struct __qf_iterator qf_iterator;
 
@@ -19,10 +25,28 @@ typedef struct __qf_iterator qf_iterator;
  * Initializes a quotient filter with capacity 2^q.
  * Increasing r improves the filter's accuracy but uses more space.
  *
- * Returns false if q == 0, r == 0, q+r > 64, or on ENOMEM.
+ * The table is mapped anonymously, so its memory is only committed as slots
+ * get used, and large tables are backed by transparent hugepages.
+ *
+ * Returns false if q == 0, r == 0, q+r > 64, r > 61, or on ENOMEM.
  */
 bool qf_init(quotient_filter *qf, uint32_t q, uint32_t r);
 
+/**
+ * Switches the QF in or out of concurrent mode. In concurrent mode
+ * qf_insert(), qf_remove(), qf_remove_batch(), qf_may_contain() and
+ * qf_may_contain_batch() may be called from several threads at once. The
+ * table is split in regions of QF_SLOTS_PER_LOCK slots with a spin lock
+ * each, and an operation holds the locks of its home region and of both
+ * neighbours, so threads working on different parts of the table don't wait
+ * for each other. This assumes that no cluster is longer than a region.
+ *
+ * All other functions must not run concurrently with anything else.
+ *
+ * Returns false on ENOMEM.
+ */
+bool qf_set_concurrent(quotient_filter *qf, bool enable);
+
 /**
  * Inserts a hash into the QF.
  * Only the lowest q+r bits are actually inserted into the QF table.
@@ -31,11 +55,33 @@ bool qf_init(quotient_filter *qf, uint32_t q, uint32_t r);
  */
 bool qf_insert(quotient_filter *qf, uint64_t hash);
 
+/**
+ * Inserts n hashes sorted in ascending order of their lowest q+r bits, i.e.
+ * by (quotient, remainder). An empty QF is laid out in a single left-to-right
+ * pass without shifting; otherwise the hashes are inserted one by one.
+ *
+ * Returns false if the hashes are not sorted (nothing is inserted then), or
+ * if the QF becomes full.
+ */
+bool qf_insert_sorted(quotient_filter *qf, const uint64_t *hashes, size_t n);
+
 /**
  * Returns true if the QF may contain the hash. Returns false otherwise.
  */
 bool qf_may_contain(quotient_filter *qf, uint64_t hash);
 
+/**
+ * Looks up n hashes at once and stores qf_may_contain(qf, hashes[i]) in
+ * results[i]. The home slots of upcoming hashes are prefetched while earlier
+ * runs are scanned, so that the cache misses of a batch overlap.
+ *
+ * Returns the number of hashes the QF may contain.
+ */
+size_t qf_may_contain_batch(quotient_filter *qf,
+                            const uint64_t *hashes,
+                            size_t n,
+                            bool *results);
+
 /**
  * Removes a hash from the QF.
  *
@@ -51,6 +97,20 @@ bool qf_may_contain(quotient_filter *qf, uint64_t hash);
  */
 bool qf_remove(quotient_filter *qf, uint64_t hash);
 
+/**
+ * Removes n hashes from the QF, like calling qf_remove() for each, with the
+ * same caution. The hashes are sorted first and every cluster that holds
+ * some of them is rewritten once, in a single pass, instead of sliding its
+ * tail forward once per removed entry. Hashes that use more than q+r bits
+ * are skipped.
+ *
+ * In concurrent mode, or if the sort buffer can't be allocated, the hashes
+ * are removed one by one.
+ *
+ * Returns the number of fingerprints that were removed.
+ */
+size_t qf_remove_batch(quotient_filter *qf, const uint64_t *hashes, size_t n);
+
 /**
  * Resets the QF table. This function does not deallocate any memory.
  */
@@ -78,7 +138,8 @@ void qfi_start(quotient_filter *qf, qf_iterator *i);
 bool qfi_done(quotient_filter *qf, qf_iterator *i);
 
 /**
- * Returns the next (q+r)-bit fingerprint in the QF.
+ * Returns the next (q+r)-bit fingerprint in the QF. Fingerprints come out in
+ * ascending order.
  * Limitation: Can not call this routine if qfi_done() == true.
  */
 uint64_t qfi_next(quotient_filter *qf, qf_iterator *i);
@@ -88,7 +149,12 @@ bool qf_is_subsetof(quotient_filter *lhs, quotient_filter *rhs);
 
 /*
  * Initializes qf_out and copies over all elements from qf1 and qf2.
- * Caution: qf_out holds twice as many entries as either qf1 or qf2.
+ * qf_out gets one more quotient bit than the larger input, so that it holds
+ * both of them.
+ *
+ * When qf1 and qf2 keep fingerprints of the same size (q+r), so does qf_out,
+ * and it is written in a single sequential pass over both inputs.
+ * Otherwise the fingerprints are re-inserted into a QF with the larger r.
  *
  * Returns false on ENOMEM.
  */
@@ -96,6 +162,110 @@ bool qf_merge(quotient_filter *qf_out,
               quotient_filter *qf1,
               quotient_filter *qf2);
 
+/**
+ * Initializes qf_out with the fingerprints found in both qf1 and qf2.
+ *
+ * When qf1 and qf2 keep fingerprints of the same size (q+r), qf_out keeps
+ * that size with the smaller q of the two, and is written in a single
+ * sequential pass over both inputs. Otherwise qf_out gets the size of the
+ * input with the longer fingerprints, which is walked while probing the
+ * other one.
+ *
+ * Returns false on ENOMEM.
+ */
+bool qf_intersect(quotient_filter *qf_out,
+                  quotient_filter *qf1,
+                  quotient_filter *qf2);
+
+/**
+ * Initializes qf_out, with the q and r of qf1, with the fingerprints of qf1
+ * that are not in qf2. A false positive of qf2 drops a fingerprint that
+ * should have stayed.
+ *
+ * When qf1 and qf2 keep fingerprints of the same size (q+r), qf_out is
+ * written in a single sequential pass over both inputs. If qf2 has shorter
+ * fingerprints, qf1 is walked while probing qf2; if it has longer ones,
+ * they are first cut down to the size of qf1 in a temporary QF.
+ *
+ * Returns false on ENOMEM, or if the cut down qf2 doesn't fit in 2^q slots.
+ */
+bool qf_difference(quotient_filter *qf_out,
+                   quotient_filter *qf1,
+                   quotient_filter *qf2);
+
+/**
+ * Doubles the capacity of the QF by moving the highest remainder bit into
+ * the quotient, i.e. q+1 and r-1. The fingerprints stay the same, so lookups
+ * are as accurate as before, but at the same load the bigger QF has twice
+ * the false positive rate. The new table is written in a single sequential
+ * pass and replaces the old one.
+ *
+ * Only for QFs created with qf_init().
+ *
+ * Returns false, leaving the QF untouched, if r < 2 or on ENOMEM.
+ */
+bool qf_expand(quotient_filter *qf);
+
 bool qf_is_consistent(quotient_filter *qf);
 
+typedef struct {
+    uint64_t entries;    /* fingerprints found in the table */
+    uint64_t clusters;
+    uint64_t runs;
+    uint64_t errors;     /* number of broken invariants */
+    uint64_t error_slot; /* lowest slot with an error, max_size for entries */
+    const char *error;   /* what is wrong at error_slot */
+} qf_verify_report;
+
+/**
+ * Checks the structure of the QF table: the metadata bits of every slot,
+ * that each run sits in the cluster of its occupied home slot with its
+ * remainders in ascending order and the shifted bit set exactly when it's
+ * not at home, and that the entry count matches the table.
+ *
+ * The table is split among nthreads threads, each of them checking the
+ * clusters that start in its part; fewer than one thread counts as one.
+ * The QF must not change meanwhile. Fills in report, unless it is NULL.
+ *
+ * Returns true if the QF is consistent, false if not or on ENOMEM.
+ */
+bool qf_verify(quotient_filter *qf, int nthreads, qf_verify_report *report);
+
+/* Histogram buckets of qf_stats_report: bucket 0 counts zeros, and bucket
+ * i > 0 counts the values in [2^(i-1), 2^i). */
+#define QF_STATS_BUCKETS 65
+
+typedef struct {
+    uint64_t entries;
+    uint64_t clusters;
+    uint64_t runs;
+    double load_factor; /* entries / 2^q */
+    uint64_t cluster_length[QF_STATS_BUCKETS]; /* slots per cluster */
+    uint64_t run_length[QF_STATS_BUCKETS];     /* entries per run */
+    uint64_t shift[QF_STATS_BUCKETS]; /* slots from home to each entry */
+    uint64_t max_cluster_length;
+    uint64_t max_run_length;
+    uint64_t max_shift;
+    double mean_shift;
+    /* Slots qf_may_contain() visits on average, for a hash that is in the
+     * QF (hit) and for a random one that is not (miss): the home slot, the
+     * walk back to the start of the cluster and the walk forward to the
+     * fingerprint or the end of its run. Expected values assume a uniform
+     * hash at this load factor. */
+    double expected_hit_probes;
+    double observed_hit_probes;
+    double expected_miss_probes;
+    double observed_miss_probes;
+} qf_stats_report;
+
+/**
+ * Collects the shape of the QF in a single sequential pass over the table:
+ * histograms of the cluster lengths, run lengths and shift distances, the
+ * load factor, and the lookup cost that shape implies next to the one a
+ * uniform hash would give.
+ *
+ * The QF must not change meanwhile.
+ */
+void qf_stats(quotient_filter *qf, qf_stats_report *stats);
+
 #endif
@@ -0,0 +1,100 @@
+#include "quotient-filter.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+const uint32_t Q = 22;
+const uint32_t R = 13;
+const int THREADS_MAX = 8;
+
+typedef struct {
+    quotient_filter *qf;
+    const uint64_t *hashes;
+    uint64_t n;
+} worker_args;
+
+static void *insert_worker(void *arg)
+{
+    worker_args *args = arg;
+    for (uint64_t i = 0; i < args->n; ++i)
+        assert(qf_insert(args->qf, args->hashes[i]));
+    return NULL;
+}
+
+static void *lookup_worker(void *arg)
+{
+    worker_args *args = arg;
+    for (uint64_t i = 0; i < args->n; ++i)
+        assert(qf_may_contain(args->qf, args->hashes[i]));
+    return NULL;
+}
+
+static void *remove_worker(void *arg)
+{
+    worker_args *args = arg;
+    for (uint64_t i = 0; i < args->n; ++i)
+        assert(qf_remove(args->qf, args->hashes[i]));
+    return NULL;
+}
+
+/* Split hashes evenly over nthreads running worker, return the wall time. */
+static uint64_t run(quotient_filter *qf,
+                    void *(*worker)(void *),
+                    const uint64_t *hashes,
+                    uint64_t n,
+                    int nthreads)
+{
+    pthread_t threads[THREADS_MAX];
+    worker_args args[THREADS_MAX];
+    struct timeval tv1, tv2;
+
+    gettimeofday(&tv1, NULL);
+    for (int t = 0; t < nthreads; ++t) {
+        uint64_t begin = n * t / nthreads, end = n * (t + 1) / nthreads;
+        args[t] = (worker_args){qf, hashes + begin, end - begin};
+        pthread_create(&threads[t], NULL, worker, &args[t]);
+    }
+    for (int t = 0; t < nthreads; ++t)
+        pthread_join(threads[t], NULL);
+    gettimeofday(&tv2, NULL);
+    return (tv2.tv_sec - tv1.tv_sec) * 1000000 + tv2.tv_usec - tv1.tv_usec;
+}
+
+static void qf_concurrent_bench()
+{
+    quotient_filter qf;
+    uint64_t n = 3 * (1ULL << Q) / 4;
+    uint64_t *hashes = malloc(n * sizeof(uint64_t));
+    uint64_t mask = (1ULL << (Q + R)) - 1;
+
+    for (uint64_t i = 0; i < n; ++i)
+        hashes[i] = (((uint64_t) rand() << 31) | rand()) & mask;
+
+    printf("Testing %lu inserts, lookups and removes (q=%u, r=%u)\n", n, Q, R);
+    for (int nthreads = 1; nthreads <= THREADS_MAX; nthreads *= 2) {
+        assert(qf_init(&qf, Q, R));
+        assert(qf_set_concurrent(&qf, true));
+
+        uint64_t insert = run(&qf, insert_worker, hashes, n, nthreads);
+        uint64_t lookup = run(&qf, lookup_worker, hashes, n, nthreads);
+        uint64_t remove = run(&qf, remove_worker, hashes, n, nthreads);
+        assert(qf.entries == 0);
+        printf("%d threads: insert %.2f, lookup %.2f, remove %.2f Mops/s\n",
+               nthreads, (double) n / insert, (double) n / lookup,
+               (double) n / remove);
+        fflush(stdout);
+        qf_destroy(&qf);
+    }
+    free(hashes);
+}
+
+int main()
+{
+    srand(0);
+    qf_concurrent_bench();
+
+    return 0;
+}
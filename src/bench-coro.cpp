@@ -0,0 +1,128 @@
+#include "gqf.h"
+#include "gqf_coro.hpp"
+#include "gqf_int.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+const uint32_t Q = 24;
+const uint64_t NLOOKUPS = 1 << 22;
+const unsigned WIDTHS[] = {8, 16, 32, 64};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rand64()
+{
+    return ((uint64_t) rand() << 62) ^ ((uint64_t) rand() << 31) ^ rand();
+}
+
+static void check(const std::vector<uint64_t> &counts,
+                  const std::vector<uint64_t> &expected,
+                  const char *what)
+{
+    if (counts != expected) {
+        fprintf(stderr, "%s lookups differ from the C ones.\n", what);
+        abort();
+    }
+}
+
+/* Time n lookups of keys/values in qf with the plain loop, the batch
+ * pipeline and the coroutine engine at several widths. */
+static void lookup_bench(const CQF *qf,
+                         const std::vector<uint64_t> &keys,
+                         const std::vector<uint64_t> &values)
+{
+    uint64_t n = keys.size();
+    std::vector<uint64_t> expected(n), counts(n);
+
+    double t = now();
+    for (uint64_t i = 0; i < n; i++)
+        expected[i] =
+            cqf_count_key_value(qf, keys[i], values[i], QF_KEY_IS_HASH);
+    printf("  loop          %6.2f Mops/s\n", n / (now() - t) / 1e6);
+
+    t = now();
+    cqf_count_key_value_batch(qf, keys.data(), values.data(), counts.data(), n,
+                              QF_KEY_IS_HASH);
+    printf("  batch         %6.2f Mops/s\n", n / (now() - t) / 1e6);
+    check(counts, expected, "Batch");
+
+    for (unsigned width : WIDTHS) {
+        gqf_coro::lookup_engine engine(qf, width);
+        std::fill(counts.begin(), counts.end(), 0);
+        t = now();
+        engine.count_key_value(keys.data(), values.data(), counts.data(), n,
+                               QF_KEY_IS_HASH);
+        printf("  coroutines %2u %6.2f Mops/s\n", width,
+               n / (now() - t) / 1e6);
+        check(counts, expected, "Coroutine");
+    }
+
+    /* cqf_query() finds the first counter of a key, whatever its value */
+    std::vector<uint64_t> found(n), expected_found(n);
+    cqf_query_batch(qf, keys.data(), expected_found.data(), expected.data(), n,
+                    QF_KEY_IS_HASH);
+    gqf_coro::lookup_engine(qf).query(keys.data(), found.data(), counts.data(),
+                                      n, QF_KEY_IS_HASH);
+    check(counts, expected, "Coroutine key");
+    check(found, expected_found, "Coroutine key");
+    fflush(stdout);
+}
+
+/* Fill a CQF with 2^q slots to 90% with keys, each inserted with nvalues
+ * values, then look up random pairs that are in it. nvalues > 1 makes for
+ * long runs. */
+static void coro_bench(uint32_t q, uint64_t value_bits, uint64_t nvalues)
+{
+    CQF qf;
+    uint64_t nslots = 1ULL << q;
+    uint64_t nkeys = 9 * nslots / 10 / nvalues;
+    if (!cqf_malloc(&qf, nslots, q + 8, value_bits, QF_HASH_NONE, 0)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    cqf_reset(&qf);
+
+    std::vector<uint64_t> keys(nkeys * nvalues), values(nkeys * nvalues);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        uint64_t key = rand64() & ((1ULL << (q + 8)) - 1);
+        for (uint64_t v = 0; v < nvalues; v++) {
+            keys[i * nvalues + v] = key;
+            values[i * nvalues + v] = v;
+        }
+    }
+    if (cqf_insert_batch(&qf, keys.data(), values.data(), NULL, keys.size(),
+                         QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+        fprintf(stderr, "CQF is full.\n");
+        abort();
+    }
+
+    std::vector<uint64_t> lookup_keys(NLOOKUPS), lookup_values(NLOOKUPS);
+    for (uint64_t i = 0; i < NLOOKUPS; i++) {
+        uint64_t j = rand64() % keys.size();
+        lookup_keys[i] = keys[j];
+        lookup_values[i] = values[j];
+    }
+    printf("Testing %lu lookups, q=%u, %lu values per key\n", NLOOKUPS, q,
+           nvalues);
+    lookup_bench(&qf, lookup_keys, lookup_values);
+    cqf_free(&qf);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t q = argc > 1 ? atoi(argv[1]) : Q;
+    srand(0);
+    coro_bench(q, 0, 1);
+    coro_bench(q, 4, 16);
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include "quotient-filter.h"
+#include "quotient-filter-blocked.h"
 
 #include <assert.h>
 #include <math.h>
@@ -39,6 +40,26 @@ static void qf_bench()
     sec = tv2.tv_sec - tv1.tv_sec;
     printf(" done (%lu seconds).\n", sec);
     fflush(stdout);
+
+    /* Test random lookups, single and batched */
+    uint64_t *hashes = malloc(nlookups * sizeof(uint64_t));
+    bool *found = malloc(nlookups * sizeof(bool));
+    for (uint32_t i = 0; i < nlookups; ++i)
+        hashes[i] = (uint64_t) rand();
+    gettimeofday(&tv1, NULL);
+    for (uint32_t i = 0; i < nlookups; ++i)
+        found[i] = qf_may_contain(&qf, hashes[i]);
+    gettimeofday(&tv2, NULL);
+    printf("Testing %u lookups: %lu usec\n", nlookups,
+           (tv2.tv_sec - tv1.tv_sec) * 1000000 + tv2.tv_usec - tv1.tv_usec);
+    gettimeofday(&tv1, NULL);
+    qf_may_contain_batch(&qf, hashes, nlookups, found);
+    gettimeofday(&tv2, NULL);
+    printf("Testing %u batched lookups: %lu usec\n", nlookups,
+           (tv2.tv_sec - tv1.tv_sec) * 1000000 + tv2.tv_usec - tv1.tv_usec);
+    fflush(stdout);
+    free(hashes);
+    free(found);
     qf_destroy(&qf);
 
     /* Create a large cluster. Test random lookups. */
@@ -70,10 +91,71 @@ static void qf_bench()
     qf_destroy(&qf);
 }
 
+static void bqf_bench()
+{
+    blocked_quotient_filter qf;
+    const uint32_t q_large = 28;
+    const uint32_t q_small = 16;
+    const uint32_t nlookups = 1000000;
+    struct timeval tv1, tv2;
+    uint64_t sec;
+
+    /* Test random inserts + lookups */
+    uint32_t ninserts = (3 * (1 << q_large) / 4);
+    printf("Testing BQF with %u random inserts and %u lookups", ninserts,
+           nlookups);
+    fflush(stdout);
+    bqf_init(&qf, q_large, 1);
+    gettimeofday(&tv1, NULL);
+    while (qf.entries < ninserts) {
+        assert(bqf_insert(&qf, (uint64_t) rand()));
+        if (qf.entries % 10000000 == 0) {
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    for (uint32_t i = 0; i < nlookups; ++i)
+        bqf_may_contain(&qf, (uint64_t) rand());
+    gettimeofday(&tv2, NULL);
+    sec = tv2.tv_sec - tv1.tv_sec;
+    printf(" done (%lu seconds).\n", sec);
+    fflush(stdout);
+    bqf_destroy(&qf);
+
+    /* Create a large cluster. Test random lookups. */
+    bqf_init(&qf, q_small, 1);
+    printf("Testing BQF with %u contiguous inserts and %u lookups",
+           1 << q_small, nlookups);
+    fflush(stdout);
+    gettimeofday(&tv1, NULL);
+    for (uint64_t quot = 0; quot < (1 << (q_small - 1)); ++quot) {
+        uint64_t hash = quot << 1;
+        assert(bqf_insert(&qf, hash));
+        assert(bqf_insert(&qf, hash | 1));
+        if (quot % 2000 == 0) {
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    for (uint32_t i = 0; i < nlookups; ++i) {
+        bqf_may_contain(&qf, (uint64_t) rand());
+        if (i % 50000 == 0) {
+            printf(".");
+            fflush(stdout);
+        }
+    }
+    gettimeofday(&tv2, NULL);
+    sec = tv2.tv_sec - tv1.tv_sec;
+    printf(" done (%lu seconds).\n", sec);
+    fflush(stdout);
+    bqf_destroy(&qf);
+}
+
 int main()
 {
     srand(0);
     qf_bench();
+    bqf_bench();
 
     return 0;
 }
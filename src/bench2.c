@@ -146,6 +146,9 @@ int main(int argc, char **argv)
     }
 
     // CQF insert / lookup
+    uint64_t nlookups = 0.05 * nslots + 1;
+    uint64_t *lookups = calloc(nlookups, sizeof(uint64_t));
+    uint64_t *counts = calloc(nlookups, sizeof(uint64_t));
     probe = 0.05 * nslots;
     load_factor = 0;
     clock_gettime(CLOCK_MONOTONIC, &start_time);
@@ -178,11 +181,13 @@ int main(int argc, char **argv)
 
             // do & calculate lookup perf (million/thousand operation per
             // second)
-            clock_gettime(CLOCK_MONOTONIC, &start_time);
             uint64_t j;
-            for (j = 0; j <= 0.05 * nslots; j++) {
-                int count = cqf_count_key_value(
-                    &cqf, keys[rand() % (uint64_t) probe], 0, QF_KEY_IS_HASH);
+            for (j = 0; j < nlookups; j++)
+                lookups[j] = keys[rand() % (uint64_t) probe];
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            for (j = 0; j < nlookups; j++) {
+                int count =
+                    cqf_count_key_value(&cqf, lookups[j], 0, QF_KEY_IS_HASH);
                 if (!count) {
                     fprintf(stderr,
                             "CQF fail to lookup key : %lx, index. %lu\n",
@@ -198,6 +203,25 @@ int main(int argc, char **argv)
             printf("CQF lookup %.2lf%s times per second at %d%% load factor\n",
                    oper_sec, (mode == MEM) ? "M" : "k", load_factor);
 
+            // the same lookups, batched
+            clock_gettime(CLOCK_MONOTONIC, &start_time);
+            cqf_count_key_value_batch(&cqf, lookups, NULL, counts, nlookups,
+                                      QF_KEY_IS_HASH);
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            for (j = 0; j < nlookups; j++) {
+                if (!counts[j]) {
+                    fprintf(stderr, "CQF fail to batch lookup key : %lx\n",
+                            lookups[j]);
+                    abort();
+                }
+            }
+            nanosec = diff_in_nsec(start_time, end_time);
+            oper_sec = (mode == MEM) ? (0.05 * nslots) / (nanosec / 1000)
+                                     : (0.05 * nslots) / (nanosec / 1e6);
+            printf("CQF batched lookup %.2lf%s times per second at %d%% load "
+                   "factor\n",
+                   oper_sec, (mode == MEM) ? "M" : "k", load_factor);
+
             probe = MIN(probe + 0.05 * nslots, nkeys - 1);
             clock_gettime(CLOCK_MONOTONIC, &start_time);
         }
@@ -211,4 +235,6 @@ int main(int argc, char **argv)
     fclose(qfile);
     fclose(cqfile);
     free(keys);
+    free(lookups);
+    free(counts);
 }
\ No newline at end of file
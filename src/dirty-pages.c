@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dirty-pages.h"
+
+/* Threads beyond this many don't make msync any faster. */
+#define DIRTY_MAX_THREADS 64
+
+struct dirty_job {
+    char *base;
+    uint64_t len;
+    volatile uint8_t *dirty;
+    uint64_t begin, end; /* flags this thread looks at */
+    int64_t bytes;       /* written back, -1 on failure */
+};
+
+/* Sync the pages of flags [begin, end) and count them in job. */
+static void sync_range(struct dirty_job *job, uint64_t begin, uint64_t end)
+{
+    uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    uint64_t from = (begin << DIRTY_SHIFT) & ~page_mask;
+    uint64_t to = end << DIRTY_SHIFT;
+    if (to > job->len)
+        to = job->len;
+
+    if (msync(job->base + from, to - from, MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk");
+        for (uint64_t f = begin; f < end; ++f)
+            __atomic_store_n(&job->dirty[f], 1, __ATOMIC_RELAXED);
+        job->bytes = -1;
+    } else if (job->bytes >= 0) {
+        job->bytes += to - from;
+    }
+}
+
+static void *sync_flags(void *arg)
+{
+    struct dirty_job *job = arg;
+    uint64_t run = job->begin; /* start of the current run of flags */
+
+    for (uint64_t f = job->begin; f < job->end; ++f) {
+        /* Clearing a flag before its range is synced means that a store
+         * after this point sets it again, instead of being taken for
+         * flushed. */
+        if (job->dirty[f] &&
+            __atomic_exchange_n(&job->dirty[f], 0, __ATOMIC_ACQUIRE))
+            continue;
+        if (run < f)
+            sync_range(job, run, f);
+        run = f + 1;
+    }
+    if (run < job->end)
+        sync_range(job, run, job->end);
+    return NULL;
+}
+
+int64_t dirty_msync(void *base,
+                    uint64_t len,
+                    volatile uint8_t *dirty,
+                    int nthreads)
+{
+    uint64_t nflags = dirty_nflags(len);
+    struct dirty_job jobs[DIRTY_MAX_THREADS];
+    pthread_t threads[DIRTY_MAX_THREADS];
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > DIRTY_MAX_THREADS)
+        nthreads = DIRTY_MAX_THREADS;
+    if ((uint64_t) nthreads > nflags)
+        nthreads = nflags ? nflags : 1;
+
+    /* Each thread takes an even share of the flags and syncs the runs of
+     * set ones it finds there. */
+    for (int t = 0; t < nthreads; ++t)
+        jobs[t] = (struct dirty_job){base, len, dirty, nflags * t / nthreads,
+                                     nflags * (t + 1) / nthreads, 0};
+    int started = 1;
+    while (started < nthreads &&
+           pthread_create(&threads[started], NULL, sync_flags,
+                          &jobs[started]) == 0)
+        started++;
+    /* Shares that couldn't get a thread of their own are done here. */
+    for (int t = started; t < nthreads; ++t)
+        sync_flags(&jobs[t]);
+    sync_flags(&jobs[0]);
+
+    int64_t bytes = 0;
+    for (int t = 0; t < nthreads; ++t) {
+        if (t > 0 && t < started)
+            pthread_join(threads[t], NULL);
+        if (jobs[t].bytes < 0 || bytes < 0)
+            bytes = -1;
+        else
+            bytes += jobs[t].bytes;
+    }
+    return bytes;
+}
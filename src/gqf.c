@@ -23,10 +23,18 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "dirty-pages.h"
 #include "gqf.h"
 #include "gqf_int.h"
 #include "hashutil.h"
 
+/* Runs of 8, 16 and 32-bit slots are checked with AVX2 on CPUs that have it.
+ * Define QF_NO_SIMD to always walk them one counter at a time. */
+#if defined(__x86_64__) && !defined(QF_NO_SIMD)
+#include <immintrin.h>
+#define CQF_SIMD 1
+#endif
+
 /******************************************************************
  * Code for managing the metadata bits and slots w/o interpreting *
  * the content of the slots.
@@ -36,6 +44,12 @@
 #define BITMASK(nbits) ((nbits) == 64 ? 0xffffffffffffffff : MAX_VALUE(nbits))
 #define NUM_SLOTS_TO_LOCK (1ULL << 16)
 #define CLUSTER_SIZE (1ULL << 14)
+/* Batches sparser than one key in this many slots are shifted in key by key. */
+#define MERGE_DENSITY 4
+/* Number of lookups the batch queries keep in flight. */
+#ifndef CQF_PREFETCH_WIDTH
+#define CQF_PREFETCH_WIDTH 16
+#endif
 #define METADATA_WORD(qf, field, slot_index)            \
     (get_block((qf), (slot_index) / QF_SLOTS_PER_BLOCK) \
          ->field[((slot_index) % QF_SLOTS_PER_BLOCK) / 64])
@@ -595,6 +609,21 @@ static inline void set_slot(const CQF *qf, uint64_t index, uint64_t value)
 
 #endif
 
+/* Flag the blocks holding slots first to last as changed, for a CQF whose
+ * file is flushed incrementally. Call it after the stores. */
+static inline void mark_dirty(const CQF *qf, uint64_t first, uint64_t last)
+{
+    if (!qf->runtimedata->dirty)
+        return;
+    uint64_t last_block = last / QF_SLOTS_PER_BLOCK;
+    if (last_block >= qf->metadata->nblocks)
+        last_block = qf->metadata->nblocks - 1;
+    const char *base = (const char *) qf->metadata;
+    dirty_mark(qf->runtimedata->dirty,
+               (const char *) get_block(qf, first / QF_SLOTS_PER_BLOCK) - base,
+               (const char *) get_block(qf, last_block + 1) - base - 1);
+}
+
 static inline uint64_t run_end(const CQF *qf, uint64_t hash_bucket_index);
 
 static inline uint64_t block_offset(const CQF *qf, uint64_t blockidx)
@@ -694,9 +723,12 @@ static inline int probably_is_empty(const CQF *qf, uint64_t slot_index)
            !is_runend(qf, slot_index);
 }
 
+/* The first empty slot from from on, or xnslots or more if there is none. */
 static inline uint64_t find_first_empty_slot(CQF *qf, uint64_t from)
 {
     do {
+        if (from >= qf->metadata->xnslots)
+            break;
         int t = offset_lower_bound(qf, from);
         assert(t >= 0);
         if (t == 0)
@@ -764,6 +796,12 @@ static inline void shift_remainders(CQF *qf,
     int bend = ((empty_index + 1) * qf->metadata->bits_per_slot) % 64;
     const int bstart = (start_index * qf->metadata->bits_per_slot) % 64;
 
+    /* Nothing of the empty slot spills into last_word, which may lie past
+     * the end of the table. */
+    if (bend == 0) {
+        last_word--;
+        bend = 64;
+    }
     while (last_word != first_word) {
         *REMAINDER_WORD(qf, last_word) = shift_into_b(
             *REMAINDER_WORD(qf, last_word - 1), *REMAINDER_WORD(qf, last_word),
@@ -876,6 +914,10 @@ static inline void shift_runends(CQF *qf,
     uint64_t last_word = (last + distance + 1) / 64;
     uint64_t bend = (last + distance + 1) % 64;
 
+    if (bend == 0) {
+        last_word--;
+        bend = 64;
+    }
     if (last_word != first_word) {
         METADATA_WORD(qf, runends, 64 * last_word) = shift_into_b(
             METADATA_WORD(qf, runends, 64 * (last_word - 1)),
@@ -979,6 +1021,9 @@ insert_replace_slots_and_shift_remainders_and_runends_and_offsets(
 
     for (i = 0; i < total_remainders; i++)
         set_slot(qf, overwrite_index + i, remainders[i]);
+    mark_dirty(qf, bucket_index,
+               ninserts > 0 ? empties[0]
+                            : overwrite_index + total_remainders - 1);
 
     modify_metadata(&qf->runtimedata->pc_noccupied_slots, ninserts);
 
@@ -1025,8 +1070,11 @@ remove_replace_slots_and_shift_remainders_and_runends_and_offsets(
     uint64_t current_slot = overwrite_index + total_remainders;
     uint64_t current_distance = old_length - total_remainders;
     int ret_current_distance = current_distance;
+    uint64_t last_slot = current_slot + current_distance;
 
     while (current_distance > 0) {
+        if (current_slot + current_distance > last_slot)
+            last_slot = current_slot + current_distance;
         if (is_runend(qf, current_slot + current_distance - 1)) {
             do {
                 current_bucket++;
@@ -1091,7 +1139,10 @@ remove_replace_slots_and_shift_remainders_and_runends_and_offsets(
             }
             original_block++;
         }
+        if ((original_block + 1) * QF_SLOTS_PER_BLOCK > last_slot)
+            last_slot = (original_block + 1) * QF_SLOTS_PER_BLOCK;
     }
+    mark_dirty(qf, bucket_index, last_slot);
 
     int num_slots_freed = old_length - total_remainders;
     modify_metadata(&qf->runtimedata->pc_noccupied_slots, -num_slots_freed);
@@ -1278,6 +1329,7 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
         if (!cqf_lock(qf, hash_bucket_index, /*small*/ true, runtime_lock))
             return QF_COULDNT_LOCK;
     }
+    uint64_t last_slot = hash_bucket_index; /* last one changed */
     if (is_empty(qf, hash_bucket_index) /* might_be_empty(qf, hash_bucket_index) && runend_index == hash_bucket_index */) {
         METADATA_WORD(qf, runends, hash_bucket_index) |=
             1ULL << (hash_bucket_block_offset % 64);
@@ -1292,8 +1344,10 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
     } else {
         uint64_t runend_index = run_end(qf, hash_bucket_index);
         int operation = 0; /* Insert into empty bucket */
+        bool new_counter = false; /* counted once there is room for it */
         uint64_t insert_index = runend_index + 1;
         uint64_t new_value = hash_remainder;
+        last_slot = runend_index;
 
         /* printf("RUNSTART: %02lx RUNEND: %02lx\n", runstart_index,
          * runend_index);
@@ -1357,7 +1411,7 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
                 operation = 1;
                 insert_index = runstart_index;
                 new_value = hash_remainder;
-                modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
+                new_counter = true;
 
                 /* This is the first time we're inserting this remainder, but
                          there are larger remainders already in the run. */
@@ -1365,7 +1419,7 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
                 operation = 2; /* Inserting */
                 insert_index = runstart_index;
                 new_value = hash_remainder;
-                modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
+                new_counter = true;
 
                 /* Cases below here: we're incrementing the (simple or
                          extended) counter for this remainder. */
@@ -1457,7 +1511,7 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
                 }
             }
         } else {
-            modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
+            new_counter = true;
         }
 
         if (operation >= 0) {
@@ -1467,6 +1521,7 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
                 return QF_NO_SPACE;
             }
             shift_remainders(qf, insert_index, empty_slot_index);
+            last_slot = empty_slot_index;
 
             set_slot(qf, insert_index, new_value);
             ret_distance = insert_index - hash_bucket_index;
@@ -1505,10 +1560,13 @@ static inline int insert1(CQF *qf, __uint128_t hash, uint8_t runtime_lock)
             }
             modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
         }
+        if (new_counter)
+            modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
         modify_metadata(&qf->runtimedata->pc_nelts, 1);
         METADATA_WORD(qf, occupieds, hash_bucket_index) |=
             1ULL << (hash_bucket_block_offset % 64);
     }
+    mark_dirty(qf, hash_bucket_index, last_slot);
 
     if (GET_NO_LOCK(runtime_lock) != QF_NO_LOCK) {
         cqf_unlock(qf, hash_bucket_index, /*small*/ true);
@@ -1544,6 +1602,7 @@ static inline int insert(CQF *qf,
         set_slot(qf, hash_bucket_index, hash_remainder);
         METADATA_WORD(qf, occupieds, hash_bucket_index) |=
             1ULL << (hash_bucket_block_offset % 64);
+        mark_dirty(qf, hash_bucket_index, hash_bucket_index);
 
         modify_metadata(&qf->runtimedata->pc_ndistinct_elts, 1);
         modify_metadata(&qf->runtimedata->pc_noccupied_slots, 1);
@@ -1629,6 +1688,7 @@ static inline int insert(CQF *qf,
         }
         METADATA_WORD(qf, occupieds, hash_bucket_index) |=
             1ULL << (hash_bucket_block_offset % 64);
+        mark_dirty(qf, hash_bucket_index, hash_bucket_index);
 
         modify_metadata(&qf->runtimedata->pc_nelts, count);
     }
@@ -1842,6 +1902,7 @@ void *cqf_destroy(CQF *qf)
         free(qf->runtimedata->wait_times);
     if (qf->runtimedata->f_info.filepath != NULL)
         free(qf->runtimedata->f_info.filepath);
+    free((void *) qf->runtimedata->dirty);
     free(qf->runtimedata);
 
     return (void *) qf->metadata;
@@ -1903,6 +1964,10 @@ void cqf_copy(CQF *dest, const CQF *src)
 
 void cqf_reset(CQF *qf)
 {
+    /* Fold in the per-CPU counts first so none survive the reset */
+    pc_sync(&qf->runtimedata->pc_nelts);
+    pc_sync(&qf->runtimedata->pc_ndistinct_elts);
+    pc_sync(&qf->runtimedata->pc_noccupied_slots);
     qf->metadata->nelts = 0;
     qf->metadata->ndistinct_elts = 0;
     qf->metadata->noccupied_slots = 0;
@@ -1920,6 +1985,7 @@ void cqf_reset(CQF *qf)
                (sizeof(qfblock) +
                 QF_SLOTS_PER_BLOCK * qf->metadata->bits_per_slot / 8));
 #endif
+    mark_dirty(qf, 0, qf->metadata->xnslots - 1);
 }
 
 int64_t cqf_resize_malloc(CQF *qf, uint64_t nslots)
@@ -1932,7 +1998,9 @@ int64_t cqf_resize_malloc(CQF *qf, uint64_t nslots)
     if (qf->runtimedata->auto_resize)
         cqf_set_auto_resize(&new_qf, true);
 
-    // copy keys from qf into new_qf
+    // copy keys from qf into new_qf, in order
+    cqf_builder b;
+    cqf_builder_init(&new_qf, &b);
     QFi cqfi;
     cqf_iterator_from_position(qf, &cqfi, 0);
     int64_t ret_numkeys = 0;
@@ -1940,15 +2008,22 @@ int64_t cqf_resize_malloc(CQF *qf, uint64_t nslots)
         uint64_t key, value, count;
         cqfi_get_hash(&cqfi, &key, &value, &count);
         cqfi_next(&cqfi);
-        int ret =
-            cqf_insert(&new_qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+        int ret = cqf_builder_append(
+            &new_qf, &b, (key << qf->metadata->value_bits) | value, count);
         if (ret < 0) {
             fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n",
                     key);
+            cqf_free(&new_qf);
             return ret;
         }
         ret_numkeys++;
     } while (!cqfi_end(&cqfi));
+    int ret = cqf_builder_finish(&new_qf, &b);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to finish the new CQF.\n");
+        cqf_free(&new_qf);
+        return ret;
+    }
 
     cqf_free(qf);
     memcpy(qf, &new_qf, sizeof(CQF));
@@ -1975,21 +2050,27 @@ uint64_t cqf_resize(CQF *qf, uint64_t nslots, void *buffer, uint64_t buffer_len)
     if (qf->runtimedata->auto_resize)
         cqf_set_auto_resize(&new_qf, true);
 
-    // copy keys from qf into new_qf
+    // copy keys from qf into new_qf, in order
+    cqf_builder b;
+    cqf_builder_init(&new_qf, &b);
     QFi cqfi;
     cqf_iterator_from_position(qf, &cqfi, 0);
     do {
         uint64_t key, value, count;
         cqfi_get_hash(&cqfi, &key, &value, &count);
         cqfi_next(&cqfi);
-        int ret =
-            cqf_insert(&new_qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+        int ret = cqf_builder_append(
+            &new_qf, &b, (key << qf->metadata->value_bits) | value, count);
         if (ret < 0) {
             fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n",
                     key);
             abort();
         }
     } while (!cqfi_end(&cqfi));
+    if (cqf_builder_finish(&new_qf, &b) < 0) {
+        fprintf(stderr, "Failed to finish the new CQF.\n");
+        abort();
+    }
 
     cqf_free(qf);
     memcpy(qf, &new_qf, sizeof(CQF));
@@ -2072,6 +2153,532 @@ int cqf_insert(CQF *qf,
     return ret;
 }
 
+/* The hash cqf_insert() and friends store for key and value. */
+static inline uint64_t hash_key(const CQF *qf, uint64_t key, uint8_t flags)
+{
+    if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
+        if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
+            key = MurmurHash64A(((void *) &key), sizeof(key),
+                                qf->metadata->seed) %
+                  qf->metadata->range;
+        else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
+            key = hash_64(key, BITMASK(qf->metadata->key_bits));
+    }
+    return key;
+}
+
+static inline uint64_t hash_key_value(const CQF *qf,
+                                      uint64_t key,
+                                      uint64_t value,
+                                      uint8_t flags)
+{
+    return (hash_key(qf, key, flags) << qf->metadata->value_bits) |
+           (value & BITMASK(qf->metadata->value_bits));
+}
+
+static int cmp_hash_count(const void *a, const void *b)
+{
+    uint64_t x = ((const cqf_hash_count *) a)->hash;
+    uint64_t y = ((const cqf_hash_count *) b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+#define RADIX_BITS 11
+
+/* Sort items by hash, RADIX_BITS at a time from the lowest up to the highest
+ * bit set in any of them.  Falls back to qsort() for short arrays, or if
+ * there is no memory for the copy each pass goes through. */
+static void radix_sort_hash_counts(cqf_hash_count *items, uint64_t n)
+{
+    cqf_hash_count *tmp = NULL;
+    if (n >= 256)
+        tmp = (cqf_hash_count *) malloc(n * sizeof(*tmp));
+    if (tmp == NULL) {
+        qsort(items, n, sizeof(*items), cmp_hash_count);
+        return;
+    }
+
+    uint64_t bits = 0;
+    for (uint64_t i = 0; i < n; i++)
+        bits |= items[i].hash;
+    cqf_hash_count *from = items, *to = tmp;
+    for (int shift = 0; shift < 64 && bits >> shift; shift += RADIX_BITS) {
+        uint64_t start[(1 << RADIX_BITS) + 1] = {0};
+        uint64_t mask = BITMASK(RADIX_BITS);
+        for (uint64_t i = 0; i < n; i++)
+            start[((from[i].hash >> shift) & mask) + 1]++;
+        for (int d = 0; d < 1 << RADIX_BITS; d++)
+            start[d + 1] += start[d];
+        for (uint64_t i = 0; i < n; i++)
+            to[start[(from[i].hash >> shift) & mask]++] = from[i];
+        cqf_hash_count *t = from;
+        from = to;
+        to = t;
+    }
+    if (from != items)
+        memcpy(items, from, n * sizeof(*items));
+    free(tmp);
+}
+
+/* Sort items by hash and add up the counts of equal hashes.
+ * Returns the number of distinct hashes. */
+static uint64_t sort_hash_counts(cqf_hash_count *items, uint64_t n)
+{
+    if (n == 0)
+        return 0;
+    radix_sort_hash_counts(items, n);
+    uint64_t m = 0;
+    for (uint64_t i = 1; i < n; i++) {
+        if (items[i].hash == items[m].hash)
+            items[m].count += items[i].count;
+        else
+            items[++m] = items[i];
+    }
+    return m + 1;
+}
+
+static void builder_close_run(CQF *qf, cqf_builder *b, uint64_t next_bucket);
+static int builder_flush(CQF *qf, cqf_builder *b);
+
+/* A counter read back by a merge, and the slots it was in. */
+typedef struct {
+    uint64_t hash;
+    uint64_t count;
+    uint64_t start;
+    uint64_t end;
+    bool runend; /* end was the last slot of its run */
+} merge_counter;
+
+/* Reads the counters of a CQF in order ahead of a merge that rewrites them,
+ * and queues those not written back yet. */
+typedef struct {
+    uint64_t run;     /* bucket of the run being read */
+    uint64_t current; /* first slot of the next counter */
+    uint64_t limit;   /* runs of buckets from here on are out of reach */
+    bool done;
+    merge_counter *queue;
+    size_t head, len, cap;
+} merge_reader;
+
+/* The first occupied bucket in [bucket, limit), or limit. */
+static uint64_t next_occupied(const CQF *qf, uint64_t bucket, uint64_t limit)
+{
+    if (bucket >= limit)
+        return limit;
+    uint64_t block = bucket / QF_SLOTS_PER_BLOCK;
+    uint64_t word = get_block(qf, block)->occupieds[0] &
+                    ~BITMASK(bucket % QF_SLOTS_PER_BLOCK);
+    while (word == 0) {
+        if (++block * QF_SLOTS_PER_BLOCK >= limit)
+            return limit;
+        word = get_block(qf, block)->occupieds[0];
+    }
+    bucket = block * QF_SLOTS_PER_BLOCK + bitselect(word, 0);
+    return bucket < limit ? bucket : limit;
+}
+
+static void merge_push(merge_reader *r, const merge_counter *c)
+{
+    if (r->head + r->len == r->cap) {
+        if (r->head > 0 && r->head >= r->cap / 2) {
+            memmove(r->queue, r->queue + r->head, r->len * sizeof(*r->queue));
+            r->head = 0;
+        } else {
+            size_t cap = r->cap ? 2 * r->cap : 64;
+            merge_counter *queue = realloc(r->queue, cap * sizeof(*queue));
+            if (queue == NULL) {
+                perror("Couldn't allocate memory for the merge queue.");
+                exit(EXIT_FAILURE);
+            }
+            r->queue = queue;
+            r->cap = cap;
+        }
+    }
+    r->queue[r->head + r->len++] = *c;
+}
+
+static void merge_pop(merge_reader *r)
+{
+    r->head++;
+    if (--r->len == 0)
+        r->head = 0;
+}
+
+/* Start at the run of the first occupied bucket from bucket on, which
+ * begins at start or at its bucket. */
+static void merge_reader_start(const CQF *qf,
+                               merge_reader *r,
+                               uint64_t bucket,
+                               uint64_t start,
+                               uint64_t limit)
+{
+    r->head = r->len = 0;
+    r->limit = limit;
+    r->run = next_occupied(qf, bucket, limit);
+    r->current = start > r->run ? start : r->run;
+    r->done = r->run == limit;
+}
+
+/* Queue the next counter.  The runend bit of its last slot is cleared, as
+ * every slot the merge writes has to be. */
+static void merge_read(CQF *qf, merge_reader *r)
+{
+    merge_counter c;
+    uint64_t remainder;
+
+    c.start = r->current;
+    c.end = decode_counter(qf, r->current, &remainder, &c.count);
+    c.hash = (r->run << qf->metadata->bits_per_slot) | remainder;
+    c.runend = is_runend(qf, c.end);
+    if (c.runend) {
+        METADATA_WORD(qf, runends, c.end) &=
+            ~(1ULL << ((c.end % QF_SLOTS_PER_BLOCK) % 64));
+        r->run = next_occupied(qf, r->run + 1, r->limit);
+        r->current = c.end + 1 > r->run ? c.end + 1 : r->run;
+        r->done = r->run == r->limit;
+    } else {
+        r->current = c.end + 1;
+    }
+    merge_push(r, &c);
+}
+
+/*
+ * How many of the n items, from the first on, can be merged in from slot
+ * start on without moving anything past limit.  Merging a counter shifts
+ * the rest of the cluster right by at most the counter's length, as adding
+ * counts never grows a counter by more than the encoding of the count
+ * added, and each empty slot after it takes up one slot of shift.  Items
+ * from CLUSTER_SIZE slots past start on are left for another call.
+ * Returns 0 if the shift can't be taken up before limit, and otherwise
+ * stores in *reach the slot from which on nothing moves.
+ */
+static uint64_t merge_budget(CQF *qf,
+                             const cqf_hash_count *items,
+                             uint64_t n,
+                             uint64_t start,
+                             uint64_t limit,
+                             uint64_t *reach)
+{
+    uint64_t bits = qf->metadata->bits_per_slot;
+    uint64_t scan = start, shift = 0, k;
+
+    for (k = 0; k < n; k++) {
+        uint64_t bucket = items[k].hash >> bits;
+        while (shift > 0 && scan < bucket) {
+            scan = find_first_empty_slot(qf, scan);
+            if (scan >= bucket)
+                break;
+            shift--;
+            scan++;
+        }
+        if (k > 0 && bucket - start >= CLUSTER_SIZE)
+            break;
+        if (scan < bucket)
+            scan = bucket;
+        uint64_t slots[67];
+        shift += &slots[67] - encode_counter(qf, items[k].hash & BITMASK(bits),
+                                             items[k].count, &slots[67]);
+    }
+
+    while (shift > 0) {
+        if (scan < limit)
+            scan = find_first_empty_slot(qf, scan);
+        if (scan >= limit)
+            return 0;
+        shift--;
+        scan++;
+    }
+    *reach = scan;
+    return k;
+}
+
+/*
+ * Merge sorted, distinct items into the CQF.  Each stretch of clusters they
+ * fall into is rewritten once, from the run of the first item up to where
+ * the old layout carries on unchanged, so the rest of the cluster is never
+ * shifted more than once.  Nothing from limit on is read or written, so
+ * items within CLUSTER_SIZE of it go through insert().  So do all the items
+ * if they are sparser than MERGE_DENSITY, and items with no other in the
+ * next block, for which shifting the cluster is cheaper, and items that
+ * merge_budget() leaves no room for before limit.
+ * Returns the number of items inserted, less than n only on QF_NO_SPACE.
+ */
+static uint64_t merge_sorted_hash_counts(CQF *qf,
+                                         merge_reader *r,
+                                         const cqf_hash_count *items,
+                                         uint64_t n,
+                                         uint64_t limit)
+{
+    uint64_t bits = qf->metadata->bits_per_slot;
+    uint64_t tail = limit > CLUSTER_SIZE ? limit - CLUSTER_SIZE : 0;
+    int64_t nelts = 0, ndistinct_elts = 0, noccupied_slots = 0;
+    uint64_t i = 0, m = n, stop = 0, reach = limit;
+
+    while (m > 0 && items[m - 1].hash >> bits >= tail)
+        m--;
+    if (m > 0 && m * MERGE_DENSITY <
+                     (items[m - 1].hash >> bits) - (items[0].hash >> bits))
+        m = 0;
+
+    while (i < n) {
+        uint64_t bucket = items[i].hash >> bits;
+        uint64_t start = 0;
+        bool merge = false;
+        if (i + 1 < m &&
+            (items[i + 1].hash >> bits) - bucket <= QF_SLOTS_PER_BLOCK) {
+            start = bucket > 0 ? run_end(qf, bucket - 1) + 1 : 0;
+            if (start < bucket)
+                start = bucket;
+            /* Stretches that end early leave the rest of the budget. */
+            if (i >= stop)
+                stop = i + merge_budget(qf, items + i, m - i, start, limit,
+                                        &reach);
+            merge = i < stop;
+        }
+        if (!merge) {
+            int ret = items[i].count == 1
+                          ? insert1(qf, items[i].hash, QF_NO_LOCK)
+                          : insert(qf, items[i].hash, items[i].count,
+                                   QF_NO_LOCK);
+            if (ret == QF_NO_SPACE)
+                break;
+            i++;
+            continue;
+        }
+
+        cqf_builder b;
+        memset(&b, 0, sizeof(b));
+        b.next = start;
+        merge_reader_start(qf, r, bucket, start, reach);
+        for (;;) {
+            if (r->len == 0 && !r->done)
+                merge_read(qf, r);
+            merge_counter *old = r->len ? &r->queue[r->head] : NULL;
+            bool merge_old;
+
+            if (i < stop && (!old || items[i].hash <= old->hash)) {
+                b.hash = items[i].hash;
+                b.count = items[i++].count;
+                merge_old = old && old->hash == b.hash;
+            } else if (!old) {
+                break;
+            } else if (b.ndistinct_elts == 0) {
+                /* Before the first item, counters stay where they are. */
+                b.next = old->end + 1;
+                b.bucket = old->hash >> bits;
+                b.run_open = true;
+                merge_pop(r);
+                continue;
+            } else if (b.next <= old->start) {
+                /* From here on the cluster is where it was. */
+                if (old->runend)
+                    METADATA_WORD(qf, runends, old->end) |=
+                        1ULL << ((old->end % QF_SLOTS_PER_BLOCK) % 64);
+                if (b.run_open && b.bucket != old->hash >> bits)
+                    builder_close_run(qf, &b, old->hash >> bits);
+                b.run_open = false;
+                break;
+            } else {
+                b.hash = old->hash;
+                b.count = 0;
+                merge_old = true;
+            }
+            if (merge_old) {
+                b.count += old->count;
+                nelts -= old->count;
+                ndistinct_elts--;
+                noccupied_slots -= old->end - old->start + 1;
+                merge_pop(r);
+            }
+
+            /* Read what is in the slots about to be written first. */
+            uint64_t slots[67];
+            uint64_t *p = encode_counter(qf, b.hash & BITMASK(bits), b.count,
+                                         &slots[67]);
+            uint64_t len = &slots[67] - p;
+            bucket = b.hash >> bits;
+            start = (b.run_open && bucket == b.bucket) || b.next > bucket
+                        ? b.next
+                        : bucket;
+            assert(start + len <= limit);
+            while (!r->done && r->current < start + len)
+                merge_read(qf, r);
+            builder_flush(qf, &b);
+        }
+        if (b.run_open)
+            builder_close_run(qf, &b, UINT64_MAX);
+        r->head = r->len = 0;
+
+        nelts += b.nelts;
+        ndistinct_elts += b.ndistinct_elts;
+        noccupied_slots += b.noccupied_slots;
+    }
+
+    pc_add(&qf->runtimedata->pc_nelts, nelts);
+    pc_add(&qf->runtimedata->pc_ndistinct_elts, ndistinct_elts);
+    pc_add(&qf->runtimedata->pc_noccupied_slots, noccupied_slots);
+    return i;
+}
+
+/* Insert sorted, distinct items, taking the locks of each lock region once
+ * and merging in all the items that fall into it in one pass.  Items of
+ * regions whose locks were busy, and with QF_NO_SPACE every item from the
+ * one that didn't fit on, are moved to the front of items and their number
+ * stored in *left.
+ * Return value: 0, or QF_NO_SPACE.
+ */
+static int insert_sorted_hash_counts(CQF *qf,
+                                     cqf_hash_count *items,
+                                     uint64_t n,
+                                     uint64_t *left,
+                                     uint8_t flags)
+{
+    merge_reader reader = {0};
+    uint64_t i = 0;
+    *left = 0;
+    while (i < n) {
+        uint64_t bucket = items[i].hash >> qf->metadata->bits_per_slot;
+        uint64_t region = bucket / NUM_SLOTS_TO_LOCK;
+        uint64_t j = i + 1;
+        while (j < n && (items[j].hash >> qf->metadata->bits_per_slot) /
+                                NUM_SLOTS_TO_LOCK ==
+                            region)
+            j++;
+
+        // Same fullness check as cqf_insert(), once per region.
+        if (cqf_get_num_occupied_slots(qf) >= qf->metadata->nslots * 0.95) {
+            if (!qf->runtimedata->auto_resize ||
+                qf->runtimedata->container_resize(
+                    qf, qf->metadata->nslots * 2) < 0)
+                break;
+            continue; /* the regions have moved */
+        }
+
+        if (GET_NO_LOCK(flags) != QF_NO_LOCK &&
+            !cqf_lock(qf, bucket, /*small*/ false, flags)) {
+            memmove(&items[*left], &items[i], (j - i) * sizeof(*items));
+            *left += j - i;
+            i = j;
+            continue;
+        }
+        uint64_t limit = qf->metadata->xnslots;
+        if (GET_NO_LOCK(flags) != QF_NO_LOCK &&
+            (region + 2) * NUM_SLOTS_TO_LOCK < limit)
+            limit = (region + 2) * NUM_SLOTS_TO_LOCK;
+        i += merge_sorted_hash_counts(qf, &reader, items + i, j - i, limit);
+        if (GET_NO_LOCK(flags) != QF_NO_LOCK)
+            cqf_unlock(qf, bucket, /*small*/ false);
+
+        if (i < j) {
+            if (!qf->runtimedata->auto_resize ||
+                qf->runtimedata->container_resize(
+                    qf, qf->metadata->nslots * 2) < 0)
+                break;
+        }
+    }
+
+    free(reader.queue);
+    if (i < n) {
+        memmove(&items[*left], &items[i], (n - i) * sizeof(*items));
+        *left += n - i;
+        return QF_NO_SPACE;
+    }
+    return 0;
+}
+
+int cqf_insert_batch(CQF *qf,
+                     const uint64_t *keys,
+                     const uint64_t *values,
+                     const uint64_t *counts,
+                     uint64_t n,
+                     uint8_t flags)
+{
+    if (n == 0)
+        return 0;
+    cqf_hash_count *items = (cqf_hash_count *) malloc(n * sizeof(*items));
+    if (items == NULL) {
+        perror("Couldn't allocate memory for the batch.");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t m = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t count = counts ? counts[i] : 1;
+        if (count == 0)
+            continue;
+        items[m].hash = hash_key_value(qf, keys[i], values ? values[i] : 0,
+                                       flags);
+        items[m++].count = count;
+    }
+    m = sort_hash_counts(items, m);
+
+    uint64_t left;
+    int ret = insert_sorted_hash_counts(qf, items, m, &left, flags);
+    free(items);
+    if (ret == 0 && left > 0)
+        ret = QF_COULDNT_LOCK;
+    return ret;
+}
+
+bool cqf_insert_buffer_init(CQF *qf, cqf_insert_buffer *buf, uint64_t size)
+{
+    buf->qf = qf;
+    buf->size = size > 0 ? size : 1;
+    buf->nitems = 0;
+    buf->next_flush = buf->size / 2;
+    buf->items = (cqf_hash_count *) malloc(buf->size * sizeof(*buf->items));
+    return buf->items != NULL;
+}
+
+int64_t cqf_insert_buffer_flush(cqf_insert_buffer *buf, uint8_t flags)
+{
+    uint64_t n = sort_hash_counts(buf->items, buf->nitems);
+    int ret = insert_sorted_hash_counts(buf->qf, buf->items, n, &buf->nitems,
+                                        flags);
+    buf->next_flush = buf->nitems + (buf->size - buf->nitems) / 2;
+    if (ret < 0)
+        return ret;
+    return buf->nitems;
+}
+
+int cqf_buffered_insert(cqf_insert_buffer *buf,
+                        uint64_t key,
+                        uint64_t value,
+                        uint64_t count,
+                        uint8_t flags)
+{
+    uint8_t wait = GET_NO_LOCK(flags) ? QF_NO_LOCK : QF_WAIT_FOR_LOCK;
+    uint8_t try_once = GET_NO_LOCK(flags) ? QF_NO_LOCK : QF_TRY_ONCE_LOCK;
+
+    if (count == 0)
+        return 0;
+    /* Still full if the CQF had no space last time. */
+    if (buf->nitems == buf->size) {
+        int64_t ret = cqf_insert_buffer_flush(buf, wait);
+        if (ret < 0 && buf->nitems == buf->size)
+            return ret;
+    }
+
+    buf->items[buf->nitems].hash = hash_key_value(buf->qf, key, value, flags);
+    buf->items[buf->nitems].count = count;
+    buf->nitems++;
+
+    /* Past the mark, write out the regions that are free right now; a full
+     * buffer waits for the rest. */
+    if (buf->nitems == buf->size)
+        cqf_insert_buffer_flush(buf, wait);
+    else if (buf->nitems >= buf->next_flush)
+        cqf_insert_buffer_flush(buf, try_once);
+    return 0;
+}
+
+void cqf_insert_buffer_destroy(cqf_insert_buffer *buf)
+{
+    free(buf->items);
+    buf->items = NULL;
+    buf->nitems = 0;
+}
+
 int cqf_set_count(CQF *qf,
                   uint64_t key,
                   uint64_t value,
@@ -2136,35 +2743,93 @@ int cqf_delete_key_value(CQF *qf, uint64_t key, uint64_t value, uint8_t flags)
     return _remove(qf, hash, count, flags);
 }
 
-uint64_t cqf_count_key_value(const CQF *qf,
-                             uint64_t key,
-                             uint64_t value,
-                             uint8_t flags)
+/* Start of the run of the occupied bucket. */
+static inline uint64_t run_start(const CQF *qf, uint64_t bucket)
 {
-    if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-        if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-            key = MurmurHash64A(((void *) &key), sizeof(key),
-                                qf->metadata->seed) %
-                  qf->metadata->range;
-        else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-            key = hash_64(key, BITMASK(qf->metadata->key_bits));
+    uint64_t start = bucket == 0 ? 0 : run_end(qf, bucket - 1) + 1;
+    return start < bucket ? bucket : start;
+}
+
+#ifdef CQF_SIMD
+/* Whether any of the 8, 16 or 32-bit slots of the run starting at slot
+ * start holds remainder, comparing 32 bytes of slots at a time.  The slots
+ * of a block are contiguous and a multiple of 32 bytes long, so the run is
+ * scanned block by block up to its runend bit.  A hit may be a counter
+ * digit rather than a remainder, but a miss means no counter of the run
+ * has that remainder.
+ */
+__attribute__((target("avx2"))) static bool run_contains_avx2(
+    const CQF *qf,
+    uint64_t start,
+    uint64_t remainder)
+{
+    const uint64_t width = qf->metadata->bits_per_slot;
+    __m256i target;
+    switch (width) {
+    case 8:
+        target = _mm256_set1_epi8(remainder);
+        break;
+    case 16:
+        target = _mm256_set1_epi16(remainder);
+        break;
+    default:
+        target = _mm256_set1_epi32(remainder);
+    }
+
+    uint64_t block = start / QF_SLOTS_PER_BLOCK;
+    uint64_t first = start % QF_SLOTS_PER_BLOCK;
+    for (;; block++, first = 0) {
+        const qfblock *b = get_block(qf, block);
+        uint64_t ends = b->runends[0] & (~0ULL << first);
+        uint64_t last = ends ? (uint64_t) __builtin_ctzll(ends)
+                             : QF_SLOTS_PER_BLOCK - 1;
+        /* Bytes lo..hi-1 of the block's slots belong to the run */
+        uint64_t lo = first * width / 8, hi = (last + 1) * width / 8;
+        const uint8_t *slots = (const uint8_t *) b->slots;
+        for (uint64_t i = lo & ~31ULL; i < hi; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (slots + i));
+            uint32_t hits;
+            switch (width) {
+            case 8:
+                hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, target));
+                break;
+            case 16:
+                hits = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, target));
+                break;
+            default:
+                hits = _mm256_movemask_epi8(_mm256_cmpeq_epi32(v, target));
+            }
+            if (i < lo)
+                hits &= ~0U << (lo - i);
+            if (hi - i < 32)
+                hits &= (1U << (hi - i)) - 1;
+            if (hits)
+                return true;
+        }
+        if (ends)
+            return false;
     }
-    uint64_t hash = (key << qf->metadata->value_bits) |
-                    (value & BITMASK(qf->metadata->value_bits));
+}
+#endif
+
+static uint64_t count_hash(const CQF *qf, uint64_t hash)
+{
     uint64_t hash_remainder = hash & BITMASK(qf->metadata->bits_per_slot);
     int64_t hash_bucket_index = hash >> qf->metadata->bits_per_slot;
 
     if (!is_occupied(qf, hash_bucket_index))
         return 0;
 
-    int64_t runstart_index =
-        hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
-    if (runstart_index < hash_bucket_index)
-        runstart_index = hash_bucket_index;
+    int64_t runstart_index = run_start(qf, hash_bucket_index);
 
-    /* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index,
-     * runend_index);
-     */
+#ifdef CQF_SIMD
+    /* Only walk the counters when some slot of the run matches. */
+    uint64_t width = qf->metadata->bits_per_slot;
+    if ((width == 8 || width == 16 || width == 32) &&
+        __builtin_cpu_supports("avx2") &&
+        !run_contains_avx2(qf, runstart_index, hash_remainder))
+        return 0;
+#endif
 
     uint64_t current_remainder, current_count, current_end;
     do {
@@ -2178,19 +2843,16 @@ uint64_t cqf_count_key_value(const CQF *qf,
     return 0;
 }
 
-uint64_t cqf_query(const CQF *qf, uint64_t key, uint64_t *value, uint8_t flags)
+uint64_t cqf_count_key_value(const CQF *qf,
+                             uint64_t key,
+                             uint64_t value,
+                             uint8_t flags)
 {
-    // Hashing key if needed.
-    if (GET_KEY_HASH(flags) != QF_KEY_IS_HASH) {
-        if (qf->metadata->hash_mode == QF_HASH_DEFAULT)
-            key = MurmurHash64A(((void *) &key), sizeof(key),
-                                qf->metadata->seed) %
-                  qf->metadata->range;
-        else if (qf->metadata->hash_mode == QF_HASH_INVERTIBLE)
-            key = hash_64(key, BITMASK(qf->metadata->key_bits));
-    }
-    uint64_t hash = key;
+    return count_hash(qf, hash_key_value(qf, key, value, flags));
+}
 
+static uint64_t query_hash(const CQF *qf, uint64_t hash, uint64_t *value)
+{
     // Get the remainder / quotient part of hashed bits
     uint64_t hash_remainder = hash & BITMASK(qf->metadata->key_remainder_bits);
     int64_t hash_bucket_index = hash >> qf->metadata->key_remainder_bits;
@@ -2199,14 +2861,7 @@ uint64_t cqf_query(const CQF *qf, uint64_t key, uint64_t *value, uint8_t flags)
         return 0;
 
     // Find start index of target run
-    int64_t runstart_index =
-        hash_bucket_index == 0 ? 0 : run_end(qf, hash_bucket_index - 1) + 1;
-    if (runstart_index < hash_bucket_index)
-        runstart_index = hash_bucket_index;
-
-    /* printf("MC RUNSTART: %02lx RUNEND: %02lx\n", runstart_index,
-     * runend_index);
-     */
+    int64_t runstart_index = run_start(qf, hash_bucket_index);
 
     uint64_t current_remainder, current_count, current_end;
     do {
@@ -2224,6 +2879,134 @@ uint64_t cqf_query(const CQF *qf, uint64_t key, uint64_t *value, uint8_t flags)
     return 0;
 }
 
+uint64_t cqf_query(const CQF *qf, uint64_t key, uint64_t *value, uint8_t flags)
+{
+    return query_hash(qf, hash_key(qf, key, flags), value);
+}
+
+/* Bring the occupieds of bucket and the offset that run_end() starts from
+ * into cache ahead of a lookup.  The prefetchers must be inlined: gcc takes
+ * a function that only prefetches for one without side effects and drops
+ * the calls. */
+static inline __attribute__((always_inline)) void prefetch_bucket(
+    const CQF *qf,
+    uint64_t bucket)
+{
+    __builtin_prefetch(get_block(qf, bucket / QF_SLOTS_PER_BLOCK));
+    if (bucket > 0 && bucket % QF_SLOTS_PER_BLOCK == 0)
+        __builtin_prefetch(get_block(qf, bucket / QF_SLOTS_PER_BLOCK - 1));
+}
+
+/* Once prefetch_bucket() has landed, bring in the runends that run_end()
+ * selects from and the first slots of the run, as far as the block offset
+ * tells where they are. */
+static inline __attribute__((always_inline)) void prefetch_run(
+    const CQF *qf,
+    uint64_t bucket)
+{
+    if (!is_occupied(qf, bucket))
+        return;
+    uint64_t blockidx = bucket == 0 ? 0 : (bucket - 1) / QF_SLOTS_PER_BLOCK;
+    uint64_t start = QF_SLOTS_PER_BLOCK * blockidx +
+                     get_block(qf, blockidx)->offset;
+    if (start < bucket)
+        start = bucket;
+    if (start >= qf->metadata->xnslots)
+        return;
+    const qfblock *b = get_block(qf, start / QF_SLOTS_PER_BLOCK);
+    __builtin_prefetch(b);
+    __builtin_prefetch((const uint8_t *) b->slots +
+                       (start % QF_SLOTS_PER_BLOCK) *
+                           qf->metadata->bits_per_slot / 8);
+}
+
+/* The batch lookups run a pipeline CQF_PREFETCH_WIDTH lookups deep per
+ * stage: key i is hashed and its bucket prefetched while the run of key
+ * i - w is prefetched and key i - 2w, whose blocks are in cache by now, is
+ * resolved. */
+void cqf_count_key_value_batch(const CQF *qf,
+                               const uint64_t *keys,
+                               const uint64_t *values,
+                               uint64_t *counts,
+                               uint64_t n,
+                               uint8_t flags)
+{
+    const uint64_t w = CQF_PREFETCH_WIDTH;
+    uint64_t hashes[2 * CQF_PREFETCH_WIDTH];
+    uint64_t bits_per_slot = qf->metadata->bits_per_slot;
+
+    for (uint64_t i = 0; i < n + 2 * w; i++) {
+        if (i >= 2 * w)
+            counts[i - 2 * w] = count_hash(qf, hashes[i % (2 * w)]);
+        if (i >= w && i - w < n)
+            prefetch_run(qf, hashes[(i - w) % (2 * w)] >> bits_per_slot);
+        if (i < n) {
+            hashes[i % (2 * w)] = hash_key_value(
+                qf, keys[i], values ? values[i] : 0, flags);
+            prefetch_bucket(qf, hashes[i % (2 * w)] >> bits_per_slot);
+        }
+    }
+}
+
+void cqf_query_batch(const CQF *qf,
+                     const uint64_t *keys,
+                     uint64_t *values,
+                     uint64_t *counts,
+                     uint64_t n,
+                     uint8_t flags)
+{
+    const uint64_t w = CQF_PREFETCH_WIDTH;
+    uint64_t hashes[2 * CQF_PREFETCH_WIDTH];
+    uint64_t key_remainder_bits = qf->metadata->key_remainder_bits;
+
+    for (uint64_t i = 0; i < n + 2 * w; i++) {
+        if (i >= 2 * w)
+            counts[i - 2 * w] =
+                query_hash(qf, hashes[i % (2 * w)], &values[i - 2 * w]);
+        if (i >= w && i - w < n)
+            prefetch_run(qf, hashes[(i - w) % (2 * w)] >> key_remainder_bits);
+        if (i < n) {
+            hashes[i % (2 * w)] = hash_key(qf, keys[i], flags);
+            prefetch_bucket(qf, hashes[i % (2 * w)] >> key_remainder_bits);
+        }
+    }
+}
+
+uint64_t cqf_hash_key(const CQF *qf, uint64_t key, uint8_t flags)
+{
+    return hash_key(qf, key, flags);
+}
+
+bool cqf_is_occupied(const CQF *qf, uint64_t index)
+{
+    return is_occupied(qf, index);
+}
+
+bool cqf_is_runend(const CQF *qf, uint64_t index)
+{
+    return is_runend(qf, index);
+}
+
+uint64_t cqf_run_start(const CQF *qf, uint64_t bucket)
+{
+    return run_start(qf, bucket);
+}
+
+uint64_t cqf_decode_counter(const CQF *qf,
+                            uint64_t index,
+                            uint64_t *remainder,
+                            uint64_t *count)
+{
+    return decode_counter(qf, index, remainder, count);
+}
+
+uint64_t cqf_counter_size(const CQF *qf, uint64_t remainder, uint64_t count)
+{
+    uint64_t slots[67];
+    uint64_t *p = encode_counter((CQF *) qf, remainder, count, &slots[67]);
+    return &slots[67] - p;
+}
+
 int64_t cqf_get_unique_index(const CQF *qf,
                              uint64_t key,
                              uint64_t value,
@@ -2540,12 +3323,11 @@ int cqfi_next(QFi *cqfi)
                 bitselect(get_block(cqfi->qf, block_index)->occupieds[0], rank);
             if (next_run == 64) {
                 rank = 0;
+                /* Don't read past the last block. */
                 while (next_run == 64 &&
-                       block_index < cqfi->qf->metadata->nblocks) {
-                    block_index++;
+                       ++block_index < cqfi->qf->metadata->nblocks)
                     next_run = bitselect(
                         get_block(cqfi->qf, block_index)->occupieds[0], rank);
-                }
             }
             if (block_index == cqfi->qf->metadata->nblocks) {
                 /* set the index values to max. */
@@ -2583,6 +3365,184 @@ bool cqfi_end(const QFi *cqfi)
     return false;
 }
 
+void cqf_builder_init(CQF *qf, cqf_builder *b)
+{
+    cqf_reset(qf);
+    memset(b, 0, sizeof(*b));
+}
+
+/* Mark the end of the open run, and record in the offset of every block it
+ * reaches into how far it does, up to the block of next_bucket, the bucket
+ * of the following run: past it the offsets belong to that run. */
+static void builder_close_run(CQF *qf, cqf_builder *b, uint64_t next_bucket)
+{
+    uint64_t end = b->next - 1;
+    uint64_t last_block = end / QF_SLOTS_PER_BLOCK;
+    if (last_block > next_bucket / QF_SLOTS_PER_BLOCK)
+        last_block = next_bucket / QF_SLOTS_PER_BLOCK;
+    METADATA_WORD(qf, runends, end) |=
+        1ULL << ((end % QF_SLOTS_PER_BLOCK) % 64);
+    for (uint64_t block = b->bucket / QF_SLOTS_PER_BLOCK + 1;
+         block <= last_block; block++) {
+        uint64_t offset = end - block * QF_SLOTS_PER_BLOCK + 1;
+        uint64_t max_offset = BITMASK(8 * sizeof(qf->blocks[0].offset));
+        get_block(qf, block)->offset =
+            offset < max_offset ? offset : max_offset;
+    }
+    mark_dirty(qf, b->bucket, end);
+    b->run_open = false;
+}
+
+/* Write the counter of the pending hash after the last one. */
+static int builder_flush(CQF *qf, cqf_builder *b)
+{
+    uint64_t remainder = b->hash & BITMASK(qf->metadata->bits_per_slot);
+    uint64_t bucket = b->hash >> qf->metadata->bits_per_slot;
+    uint64_t slots[67];
+    uint64_t *p = encode_counter(qf, remainder, b->count, &slots[67]);
+    uint64_t len = &slots[67] - p;
+
+    if (b->run_open && bucket != b->bucket)
+        builder_close_run(qf, b, bucket);
+    uint64_t start = b->run_open || b->next > bucket ? b->next : bucket;
+    if (start + len > qf->metadata->xnslots)
+        return QF_NO_SPACE;
+
+    if (!b->run_open) {
+        METADATA_WORD(qf, occupieds, bucket) |=
+            1ULL << ((bucket % QF_SLOTS_PER_BLOCK) % 64);
+        b->bucket = bucket;
+        b->run_open = true;
+    }
+    for (uint64_t i = 0; i < len; i++)
+        set_slot(qf, start + i, p[i]);
+    mark_dirty(qf, bucket, start + len - 1);
+    b->next = start + len;
+
+    b->nelts += b->count;
+    b->ndistinct_elts++;
+    b->noccupied_slots += len;
+    b->pending = false;
+    return 0;
+}
+
+int cqf_builder_append(CQF *qf, cqf_builder *b, uint64_t hash, uint64_t count)
+{
+    if (count == 0)
+        return 0;
+    if ((hash >> qf->metadata->bits_per_slot) >= qf->metadata->nslots)
+        return QF_INVALID;
+
+    if (b->pending) {
+        if (hash == b->hash) {
+            b->count += count;
+            return 0;
+        }
+        if (hash < b->hash)
+            return QF_INVALID;
+        int ret = builder_flush(qf, b);
+        if (ret < 0)
+            return ret;
+    }
+    b->hash = hash;
+    b->count = count;
+    b->pending = true;
+    return 0;
+}
+
+int cqf_builder_finish(CQF *qf, cqf_builder *b)
+{
+    if (b->pending) {
+        int ret = builder_flush(qf, b);
+        if (ret < 0)
+            return ret;
+    }
+    if (b->run_open)
+        builder_close_run(qf, b, UINT64_MAX);
+
+    pc_add(&qf->runtimedata->pc_nelts, b->nelts);
+    pc_add(&qf->runtimedata->pc_ndistinct_elts, b->ndistinct_elts);
+    pc_add(&qf->runtimedata->pc_noccupied_slots, b->noccupied_slots);
+    b->nelts = b->ndistinct_elts = b->noccupied_slots = 0;
+    return 0;
+}
+
+int cqf_build_from_sorted(CQF *qf,
+                          const uint64_t *hashes,
+                          const uint64_t *values,
+                          const uint64_t *counts,
+                          uint64_t n)
+{
+    uint64_t value_bits = qf->metadata->value_bits;
+    cqf_builder b;
+    int ret = 0;
+
+    cqf_builder_init(qf, &b);
+    for (uint64_t i = 0; i < n && ret == 0; i++) {
+        if (qf->metadata->key_bits < 64 &&
+            hashes[i] >> qf->metadata->key_bits) {
+            ret = QF_INVALID;
+            break;
+        }
+        uint64_t value = values ? values[i] & BITMASK(value_bits) : 0;
+        ret = cqf_builder_append(qf, &b, (hashes[i] << value_bits) | value,
+                                 counts ? counts[i] : 1);
+    }
+    if (ret == 0)
+        ret = cqf_builder_finish(qf, &b);
+    if (ret < 0)
+        cqf_reset(qf);
+    return ret;
+}
+
+/* Output of a merge.  An empty CQF is built left to right; what doesn't fit
+ * that way, or anything at all merged into a non-empty one, is inserted,
+ * which lets an auto-resizing CQF grow. */
+typedef struct {
+    CQF *qf;
+    cqf_builder b;
+    bool building;
+} merge_output;
+
+static void merge_output_init(merge_output *out, CQF *qf)
+{
+    out->qf = qf;
+    out->building = cqf_get_num_distinct_key_value_pairs(qf) == 0;
+    if (out->building)
+        cqf_builder_init(qf, &out->b);
+}
+
+/* Finish what has been built; the hash the builder couldn't write, if any,
+ * is inserted. */
+static void merge_output_finish(merge_output *out)
+{
+    if (!out->building)
+        return;
+    out->building = false;
+    if (cqf_builder_finish(out->qf, &out->b) == 0)
+        return;
+    uint64_t value_bits = out->qf->metadata->value_bits;
+    uint64_t hash = out->b.hash, count = out->b.count;
+    out->b.pending = false;
+    cqf_builder_finish(out->qf, &out->b);
+    cqf_insert(out->qf, hash >> value_bits, hash & BITMASK(value_bits), count,
+               QF_NO_LOCK | QF_KEY_IS_HASH);
+}
+
+static void merge_output_add(merge_output *out,
+                             uint64_t key,
+                             uint64_t value,
+                             uint64_t count)
+{
+    if (out->building) {
+        uint64_t hash = (key << out->qf->metadata->value_bits) | value;
+        if (cqf_builder_append(out->qf, &out->b, hash, count) == 0)
+            return;
+        merge_output_finish(out);
+    }
+    cqf_insert(out->qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+}
+
 /*
  * Merge qfa and qfb into qfc
  */
@@ -2610,16 +3570,18 @@ void cqf_merge(const CQF *qfa, const CQF *qfb, CQF *qfc)
         exit(1);
     }
 
+    merge_output out;
+    merge_output_init(&out, qfc);
     uint64_t keya, valuea, counta, keyb, valueb, countb;
     cqfi_get_hash(&cqfia, &keya, &valuea, &counta);
     cqfi_get_hash(&cqfib, &keyb, &valueb, &countb);
     do {
-        if (keya < keyb) {
-            cqf_insert(qfc, keya, valuea, counta, QF_NO_LOCK | QF_KEY_IS_HASH);
+        if (keya < keyb || (keya == keyb && valuea < valueb)) {
+            merge_output_add(&out, keya, valuea, counta);
             cqfi_next(&cqfia);
             cqfi_get_hash(&cqfia, &keya, &valuea, &counta);
         } else {
-            cqf_insert(qfc, keyb, valueb, countb, QF_NO_LOCK | QF_KEY_IS_HASH);
+            merge_output_add(&out, keyb, valueb, countb);
             cqfi_next(&cqfib);
             cqfi_get_hash(&cqfib, &keyb, &valueb, &countb);
         }
@@ -2628,15 +3590,16 @@ void cqf_merge(const CQF *qfa, const CQF *qfb, CQF *qfc)
     if (!cqfi_end(&cqfia)) {
         do {
             cqfi_get_hash(&cqfia, &keya, &valuea, &counta);
-            cqf_insert(qfc, keya, valuea, counta, QF_NO_LOCK | QF_KEY_IS_HASH);
+            merge_output_add(&out, keya, valuea, counta);
         } while (!cqfi_next(&cqfia));
     }
     if (!cqfi_end(&cqfib)) {
         do {
             cqfi_get_hash(&cqfib, &keyb, &valueb, &countb);
-            cqf_insert(qfc, keyb, valueb, countb, QF_NO_LOCK | QF_KEY_IS_HASH);
+            merge_output_add(&out, keyb, valueb, countb);
         } while (!cqfi_next(&cqfib));
     }
+    merge_output_finish(&out);
 }
 
 /*
@@ -2665,6 +3628,8 @@ void cqf_multi_merge(const CQF *cqf_arr[], int nqf, CQF *qfr)
         DEBUG_DUMP(cqf_arr[i]);
     }
 
+    merge_output out;
+    merge_output_init(&out, qfr);
     while (nqf > 1) {
         uint64_t keys[nqf];
         uint64_t values[nqf];
@@ -2675,13 +3640,15 @@ void cqf_multi_merge(const CQF *cqf_arr[], int nqf, CQF *qfr)
         do {
             smallest_key = UINT64_MAX;
             for (i = 0; i < nqf; i++) {
-                if (keys[i] < smallest_key) {
+                if (keys[i] < smallest_key ||
+                    (keys[i] == smallest_key &&
+                     values[i] < values[smallest_idx])) {
                     smallest_key = keys[i];
                     smallest_idx = i;
                 }
             }
-            cqf_insert(qfr, keys[smallest_idx], values[smallest_idx],
-                       counts[smallest_idx], QF_NO_LOCK | QF_KEY_IS_HASH);
+            merge_output_add(&out, keys[smallest_idx], values[smallest_idx],
+                             counts[smallest_idx]);
             cqfi_next(&cqfi_arr[smallest_idx]);
             cqfi_get_hash(&cqfi_arr[smallest_idx], &keys[smallest_idx],
                           &values[smallest_idx], &counts[smallest_idx]);
@@ -2698,12 +3665,13 @@ void cqf_multi_merge(const CQF *cqf_arr[], int nqf, CQF *qfr)
         do {
             uint64_t key, value, count;
             cqfi_get_hash(&cqfi_arr[0], &key, &value, &count);
-            cqf_insert(qfr, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+            merge_output_add(&out, key, value, count);
             cqfi_next(&cqfi_arr[0]);
             iters++;
         } while (!cqfi_end(&cqfi_arr[0]));
         DEBUG_CQF("Num of iterations: %lu\n", iters);
     }
+    merge_output_finish(&out);
 
     DEBUG_CQF("%s", "Final CQF after merging.\n");
     DEBUG_DUMP(qfr);
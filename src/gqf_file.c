@@ -7,6 +7,7 @@
  * ============================================================================
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #if 0
 #include <assert.h>
@@ -23,11 +24,23 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "dirty-pages.h"
 #include "gqf.h"
 #include "gqf_file.h"
 #include "gqf_int.h"
 #include "hashutil.h"
 
+/* Hook the partitioned counters up to the counts in the metadata. */
+static void init_counters(CQF *qf)
+{
+    pc_init(&qf->runtimedata->pc_nelts, (int64_t *) &qf->metadata->nelts, 8,
+            100);
+    pc_init(&qf->runtimedata->pc_ndistinct_elts,
+            (int64_t *) &qf->metadata->ndistinct_elts, 8, 100);
+    pc_init(&qf->runtimedata->pc_noccupied_slots,
+            (int64_t *) &qf->metadata->noccupied_slots, 8, 100);
+}
+
 #define NUM_SLOTS_TO_LOCK (1ULL << 16)
 
 bool cqf_initfile(CQF *qf,
@@ -82,6 +95,14 @@ bool cqf_initfile(CQF *qf,
     strcpy(qf->runtimedata->f_info.filepath, filename);
     /* initialize container resize */
     qf->runtimedata->container_resize = cqf_resize_file;
+    /* everything cqf_init() wrote is yet to be flushed */
+    qf->runtimedata->dirty =
+        (volatile uint8_t *) malloc(dirty_nflags(total_num_bytes));
+    if (qf->runtimedata->dirty == NULL) {
+        perror("Couldn't allocate memory for runtime dirty flags.");
+        exit(EXIT_FAILURE);
+    }
+    memset((void *) qf->runtimedata->dirty, 1, dirty_nflags(total_num_bytes));
 
     if (init_size == total_num_bytes)
         return true;
@@ -128,6 +149,16 @@ uint64_t cqf_usefile(CQF *qf, const char *filename, int flag)
         exit(EXIT_FAILURE);
     }
 
+    qfmetadata metadata;
+    if (pread(qf->runtimedata->f_info.fd, &metadata, sizeof(metadata), 0) ==
+            sizeof(metadata) &&
+        metadata.reserved == CQF_RESIZING) {
+        fprintf(stderr, "%s was left half resized.\n", filename);
+        close(qf->runtimedata->f_info.fd);
+        free(qf->runtimedata);
+        return 0;
+    }
+
     qf->runtimedata->f_info.filepath = (char *) malloc(strlen(filename) + 1);
     if (qf->runtimedata->f_info.filepath == NULL) {
         perror("Couldn't allocate memory for runtime f_info filepath.");
@@ -165,18 +196,21 @@ uint64_t cqf_usefile(CQF *qf, const char *filename, int flag)
         exit(EXIT_FAILURE);
     }
     qf->blocks = (qfblock *) (qf->metadata + 1);
-
-    pc_init(&qf->runtimedata->pc_nelts, (int64_t *) &qf->metadata->nelts, 8,
-            100);
-    pc_init(&qf->runtimedata->pc_ndistinct_elts,
-            (int64_t *) &qf->metadata->ndistinct_elts, 8, 100);
-    pc_init(&qf->runtimedata->pc_noccupied_slots,
-            (int64_t *) &qf->metadata->noccupied_slots, 8, 100);
+    if (flag == QF_USEFILE_READ_WRITE) {
+        qf->runtimedata->dirty =
+            (volatile uint8_t *) calloc(dirty_nflags(sb.st_size), 1);
+        if (qf->runtimedata->dirty == NULL) {
+            perror("Couldn't allocate memory for runtime dirty flags.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    init_counters(qf);
 
     return sizeof(qfmetadata) + qf->metadata->total_size_in_bytes;
 }
 
-int64_t cqf_resize_file(CQF *qf, uint64_t nslots)
+/* Resize by copying into a new file, which replaces the old one. */
+static int64_t resize_file_copy(CQF *qf, uint64_t nslots)
 {
     // calculate the new filename length
     int new_filename_len = strlen(qf->runtimedata->f_info.filepath) + 1;
@@ -202,7 +236,9 @@ int64_t cqf_resize_file(CQF *qf, uint64_t nslots)
     if (qf->runtimedata->auto_resize)
         cqf_set_auto_resize(&new_qf, true);
 
-    // copy keys from qf into new_qf
+    // copy keys from qf into new_qf, in order
+    cqf_builder b;
+    cqf_builder_init(&new_qf, &b);
     QFi qfi;
     cqf_iterator_from_position(qf, &qfi, 0);
     int64_t ret_numkeys = 0;
@@ -210,8 +246,8 @@ int64_t cqf_resize_file(CQF *qf, uint64_t nslots)
         uint64_t key, value, count;
         cqfi_get_hash(&qfi, &key, &value, &count);
         cqfi_next(&qfi);
-        int ret =
-            cqf_insert(&new_qf, key, value, count, QF_NO_LOCK | QF_KEY_IS_HASH);
+        int ret = cqf_builder_append(
+            &new_qf, &b, (key << qf->metadata->value_bits) | value, count);
         if (ret < 0) {
             fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n",
                     key);
@@ -219,6 +255,10 @@ int64_t cqf_resize_file(CQF *qf, uint64_t nslots)
         }
         ret_numkeys++;
     } while (!cqfi_end(&qfi));
+    if (cqf_builder_finish(&new_qf, &b) < 0) {
+        fprintf(stderr, "Failed to finish the new CQF.\n");
+        return QF_NO_SPACE;
+    }
 
     // Copy old QF path in temp.
     char *path = (char *) malloc(strlen(qf->runtimedata->f_info.filepath) + 1);
@@ -238,6 +278,273 @@ int64_t cqf_resize_file(CQF *qf, uint64_t nslots)
     return ret_numkeys;
 }
 
+/* Hashes read from the old table but not written to the new one yet. */
+struct resize_queue {
+    uint64_t (*items)[2]; /* hash, count */
+    size_t head, len, cap;
+};
+
+static void resize_queue_push(struct resize_queue *queue,
+                              uint64_t hash,
+                              uint64_t count)
+{
+    assert(queue->len < queue->cap);
+    size_t tail = (queue->head + queue->len++) % queue->cap;
+    queue->items[tail][0] = hash;
+    queue->items[tail][1] = count;
+}
+
+/* Offset in the file of the block after the last slot the builder of grown
+ * may write when it appends a hash of bucket, with next its first slot not
+ * written yet. The old CQF has to be read up to there first. */
+static uint64_t resize_write_end(const CQF *grown,
+                                 uint64_t next,
+                                 uint64_t bucket,
+                                 uint64_t new_size)
+{
+    uint64_t last = (next > bucket ? next : bucket) + 66;
+    if (last / QF_SLOTS_PER_BLOCK + 1 >= grown->metadata->nblocks)
+        return new_size;
+    return sizeof(qfmetadata) +
+           ((const char *) get_block(grown, last / QF_SLOTS_PER_BLOCK + 1) -
+            (const char *) grown->blocks);
+}
+
+/* The most counters cqf_resize_file() holds in its queue at once when it
+ * grows qf to nslots: its loop, run over the old CQF without writing
+ * anything. The builder lays out distinct hashes one after the other, so
+ * where it writes follows from the counters alone. */
+static size_t resize_queue_size(const CQF *qf,
+                                uint64_t nslots,
+                                uint64_t delta,
+                                uint64_t new_size)
+{
+    qfmetadata metadata = *qf->metadata;
+    CQF grown = {NULL, &metadata, qf->blocks};
+    metadata.bits_per_slot -= __builtin_ctzll(nslots) -
+                              __builtin_ctzll(qf->metadata->nslots);
+    metadata.nblocks =
+        (new_size - sizeof(qfmetadata)) /
+        ((const char *) get_block(&grown, 1) - (const char *) qf->blocks);
+
+    uint64_t value_bits = metadata.value_bits, bits = metadata.bits_per_slot;
+    uint64_t nread = 0, next = 0, pending = 0, pending_bucket = 0;
+    size_t size = 1;
+    QFi reader, writer;
+
+    if (qf->metadata->ndistinct_elts == 0)
+        return size;
+    cqf_iterator_from_position(qf, &reader, 0);
+    writer = reader;
+    for (uint64_t i = 0; i < nread || !cqfi_end(&reader); i++) {
+        uint64_t key, value, count;
+        if (nread == i) {
+            cqfi_next(&reader);
+            nread++;
+        }
+
+        cqfi_get_hash(&writer, &key, &value, &count);
+        cqfi_next(&writer);
+        uint64_t hash = key << value_bits | value;
+        uint64_t bucket = hash >> bits;
+        uint64_t end = resize_write_end(&grown, next, bucket, new_size);
+        while (!cqfi_end(&reader)) {
+            const char *block =
+                (const char *) get_block(qf, reader.run / QF_SLOTS_PER_BLOCK);
+            if (delta + (block - (const char *) qf->metadata) >= end)
+                break;
+            cqfi_next(&reader);
+            nread++;
+        }
+        if (nread - i > size)
+            size = nread - i;
+
+        /* Appending this hash writes the one before it. */
+        if (i > 0)
+            next = (next > pending_bucket ? next : pending_bucket) + pending;
+        pending = cqf_counter_size(&grown, hash & ((1ULL << bits) - 1), count);
+        pending_bucket = bucket;
+    }
+    return size;
+}
+
+/* Grow the file and the mapping, move the old CQF to the end of it with one
+ * sequential pass, and build the new one from the start with another. The
+ * reader always stays ahead of the blocks the builder writes, keeping what
+ * it read early in a queue. */
+int64_t cqf_resize_file(CQF *qf, uint64_t nslots)
+{
+    if (nslots <= qf->metadata->nslots)
+        return resize_file_copy(qf, nslots);
+
+    cqf_sync_counters(qf);
+    qfmetadata old_metadata = *qf->metadata;
+    uint64_t old_size = sizeof(qfmetadata) + old_metadata.total_size_in_bytes;
+    uint64_t new_size =
+        cqf_init(qf, nslots, old_metadata.key_bits, old_metadata.value_bits,
+                 old_metadata.hash_mode, old_metadata.seed, NULL, 0);
+    uint64_t delta = new_size - old_size;
+
+    /* The queue cannot grow once the old CQF starts being overwritten. */
+    struct resize_queue queue = {NULL, 0, 0, 0};
+    queue.cap = resize_queue_size(qf, nslots, delta, new_size);
+    queue.items = malloc(queue.cap * sizeof(*queue.items));
+    if (queue.items == NULL) {
+        perror("Couldn't allocate memory for resize queue.");
+        return -1;
+    }
+
+    qfruntime *runtime = qf->runtimedata;
+    if (posix_fallocate(runtime->f_info.fd, 0, new_size) != 0) {
+        perror("Couldn't fallocate file.");
+        free(queue.items);
+        return -1;
+    }
+    pc_destructor(&runtime->pc_nelts);
+    pc_destructor(&runtime->pc_ndistinct_elts);
+    pc_destructor(&runtime->pc_noccupied_slots);
+    char *base = mremap(qf->metadata, old_size, new_size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        perror("Couldn't mremap file.");
+        init_counters(qf);
+        free(queue.items);
+        return -1;
+    }
+    qf->metadata = (qfmetadata *) base;
+    qf->blocks = (qfblock *) (qf->metadata + 1);
+
+    /* The table is half built for a while, make the file unusable until it
+     * is done. */
+    qf->metadata->reserved = CQF_RESIZING;
+    if (msync(base, sizeof(qfmetadata), MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk.");
+        qf->metadata->reserved = 0;
+        init_counters(qf);
+        free(queue.items);
+        return -1;
+    }
+    memmove(base + delta, base, old_size);
+
+    qfruntime old_runtime;
+    memset(&old_runtime, 0, sizeof(old_runtime));
+    CQF old_qf = {&old_runtime, &old_metadata,
+                  (qfblock *) (base + delta + sizeof(qfmetadata))};
+
+    /* Write the new metadata over the old, which is only read from the copy
+     * from now on, keeping the file and the resize settings. */
+    uint32_t auto_resize = runtime->auto_resize;
+    volatile uint8_t *dirty = runtime->dirty;
+    free((void *) runtime->locks);
+    free(runtime->wait_times);
+    runtime->dirty = NULL;
+    cqf_init(qf, nslots, old_metadata.key_bits, old_metadata.value_bits,
+             old_metadata.hash_mode, old_metadata.seed, base, new_size);
+    qf->metadata->reserved = CQF_RESIZING;
+    runtime->auto_resize = auto_resize;
+    runtime->container_resize = cqf_resize_file;
+
+    uint64_t zeroed = sizeof(qfmetadata);
+    bool reader_done = old_metadata.ndistinct_elts == 0;
+    cqf_builder b;
+    QFi qfi;
+
+    memset(&b, 0, sizeof(b));
+    if (!reader_done) {
+        cqf_iterator_from_position(&old_qf, &qfi, 0);
+        reader_done = cqfi_end(&qfi);
+    }
+    while (queue.len || !reader_done) {
+        uint64_t key, value, count;
+        if (queue.len == 0) {
+            cqfi_get_hash(&qfi, &key, &value, &count);
+            resize_queue_push(&queue, key << old_metadata.value_bits | value,
+                              count);
+            cqfi_next(&qfi);
+            reader_done = cqfi_end(&qfi);
+        }
+
+        /* Appending may write the counter before this one, starting from the
+         * bucket of this one at the latest, and close its run. Everything up
+         * to the end of the last block that reaches is read before it is
+         * cleared. */
+        uint64_t hash = queue.items[queue.head][0];
+        uint64_t bucket = hash >> qf->metadata->bits_per_slot;
+        uint64_t end = resize_write_end(qf, b.next, bucket, new_size);
+        while (!reader_done &&
+               (uint64_t) ((char *) get_block(&old_qf,
+                                              qfi.run / QF_SLOTS_PER_BLOCK) -
+                           base) < end) {
+            cqfi_get_hash(&qfi, &key, &value, &count);
+            resize_queue_push(&queue, key << old_metadata.value_bits | value,
+                              count);
+            cqfi_next(&qfi);
+            reader_done = cqfi_end(&qfi);
+        }
+        if (end > zeroed) {
+            memset(base + zeroed, 0, end - zeroed);
+            zeroed = end;
+        }
+
+        count = queue.items[queue.head][1];
+        queue.head = (queue.head + 1) % queue.cap;
+        queue.len--;
+        if (cqf_builder_append(qf, &b, hash, count) < 0) {
+            /* The old CQF is half overwritten by now. */
+            fprintf(stderr, "Failed to insert key: %ld into the new CQF.\n",
+                    hash >> old_metadata.value_bits);
+            abort();
+        }
+    }
+    memset(base + zeroed, 0, new_size - zeroed);
+    if (cqf_builder_finish(qf, &b) < 0) {
+        fprintf(stderr, "Failed to finish the new CQF.\n");
+        abort();
+    }
+    free(queue.items);
+
+    /* The new table has to be on disk before the header says so. */
+    cqf_sync_counters(qf);
+    if (msync(base, new_size, MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk.");
+        exit(EXIT_FAILURE);
+    }
+    qf->metadata->reserved = 0;
+    if (msync(base, sizeof(qfmetadata), MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (madvise(base, new_size, MADV_RANDOM) < 0) {
+        perror("Couldn't madvise file.");
+        exit(EXIT_FAILURE);
+    }
+    /* every page changed and is yet to be flushed */
+    if (dirty != NULL) {
+        free((void *) dirty);
+        runtime->dirty = (volatile uint8_t *) malloc(dirty_nflags(new_size));
+        if (runtime->dirty == NULL) {
+            perror("Couldn't allocate memory for runtime dirty flags.");
+            exit(EXIT_FAILURE);
+        }
+        memset((void *) runtime->dirty, 1, dirty_nflags(new_size));
+    }
+
+    return old_metadata.ndistinct_elts;
+}
+
+int64_t cqf_flush_incremental(CQF *qf, int nthreads)
+{
+    if (qf->runtimedata->dirty == NULL)
+        return 0;
+
+    /* The counters live in the metadata, which is synced like the rest. */
+    cqf_sync_counters(qf);
+    dirty_mark(qf->runtimedata->dirty, 0, sizeof(qfmetadata) - 1);
+    return dirty_msync(qf->metadata,
+                       sizeof(qfmetadata) + qf->metadata->total_size_in_bytes,
+                       qf->runtimedata->dirty, nthreads);
+}
+
 bool cqf_closefile(CQF *qf)
 {
     assert(qf->metadata != NULL);
@@ -0,0 +1,431 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "quotient-filter-blocked.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define LOW_MASK(n) ((1ULL << (n)) - 1ULL)
+
+#define BQF_SLOTS_PER_BLOCK 64
+
+typedef struct {
+    /* Number of slots at the start of this block that hold runs whose
+     * quotient belongs to an earlier block. */
+    uint64_t offset;
+    uint64_t occupieds;
+    uint64_t runends;
+    /* 64 slots of rbits each, i.e. exactly rbits words. */
+    uint64_t remainders[];
+} bqf_block;
+
+static inline uint64_t nblocks_for(uint32_t q)
+{
+    /* Leave room for runs that spill past the last home slot. */
+    uint64_t xnslots = (1ULL << q) + (10ULL << (q / 2));
+    return (xnslots + BQF_SLOTS_PER_BLOCK - 1) / BQF_SLOTS_PER_BLOCK;
+}
+
+bool bqf_init(blocked_quotient_filter *qf, uint32_t q, uint32_t r)
+{
+    if (q == 0 || r == 0 || q + r > 64)
+        return false;
+
+    qf->qbits = q;
+    qf->rbits = r;
+    qf->index_mask = LOW_MASK(q);
+    qf->rmask = LOW_MASK(r);
+    qf->entries = 0;
+    qf->nslots = 1ULL << q;
+    qf->nblocks = nblocks_for(q);
+    qf->xnslots = qf->nblocks * BQF_SLOTS_PER_BLOCK;
+    qf->max_size = qf->nslots;
+    qf->blocks = (uint64_t *) calloc(bqf_table_size(q, r), 1);
+    return qf->blocks != NULL;
+}
+
+static inline bqf_block *get_block(const blocked_quotient_filter *qf,
+                                   uint64_t block_index)
+{
+    return (bqf_block *) (qf->blocks +
+                          block_index * (sizeof(bqf_block) / 8 + qf->rbits));
+}
+
+static inline uint64_t popcnt(uint64_t val)
+{
+    asm("popcnt %[val], %[val]" : [val] "+r"(val) : : "cc");
+    return val;
+}
+
+/* Position of the rank'th (0-based) set bit of val. Requires enough bits.
+ * Halve the word down to a byte before clearing bits one at a time, so the
+ * cost does not grow with the rank. */
+static inline uint64_t bitselect(uint64_t val, uint64_t rank)
+{
+    uint64_t pos = 0;
+    for (int width = 32; width >= 8; width /= 2) {
+        uint64_t cnt = popcnt(val & LOW_MASK(width));
+        if (rank >= cnt) {
+            rank -= cnt;
+            val >>= width;
+            pos += width;
+        }
+    }
+    while (rank--)
+        val &= val - 1;
+    return pos + __builtin_ctzll(val);
+}
+
+static inline bool is_occupied(const blocked_quotient_filter *qf, uint64_t s)
+{
+    return (get_block(qf, s / 64)->occupieds >> (s % 64)) & 1;
+}
+
+static inline void set_occupied(blocked_quotient_filter *qf, uint64_t s)
+{
+    get_block(qf, s / 64)->occupieds |= 1ULL << (s % 64);
+}
+
+static inline void clr_occupied(blocked_quotient_filter *qf, uint64_t s)
+{
+    get_block(qf, s / 64)->occupieds &= ~(1ULL << (s % 64));
+}
+
+static inline bool is_runend(const blocked_quotient_filter *qf, uint64_t s)
+{
+    return (get_block(qf, s / 64)->runends >> (s % 64)) & 1;
+}
+
+static inline void put_runend(blocked_quotient_filter *qf,
+                              uint64_t s,
+                              bool runend)
+{
+    bqf_block *b = get_block(qf, s / 64);
+    b->runends = (b->runends & ~(1ULL << (s % 64))) |
+                 ((uint64_t) runend << (s % 64));
+}
+
+/* Return the remainder stored in slot s. */
+static uint64_t get_remainder(const blocked_quotient_filter *qf, uint64_t s)
+{
+    const uint64_t *words = get_block(qf, s / 64)->remainders;
+    size_t bitpos = qf->rbits * (s % 64);
+    size_t tabpos = bitpos / 64;
+    size_t slotpos = bitpos % 64;
+    int spillbits = (slotpos + qf->rbits) - 64;
+    uint64_t rem = (words[tabpos] >> slotpos) & qf->rmask;
+    if (spillbits > 0) {
+        uint64_t x = words[tabpos + 1] & LOW_MASK(spillbits);
+        rem |= x << (qf->rbits - spillbits);
+    }
+    return rem;
+}
+
+/* Store the lower rbits of rem into slot s. */
+static void set_remainder(blocked_quotient_filter *qf, uint64_t s, uint64_t rem)
+{
+    uint64_t *words = get_block(qf, s / 64)->remainders;
+    size_t bitpos = qf->rbits * (s % 64);
+    size_t tabpos = bitpos / 64;
+    size_t slotpos = bitpos % 64;
+    int spillbits = (slotpos + qf->rbits) - 64;
+    rem &= qf->rmask;
+    words[tabpos] &= ~(qf->rmask << slotpos);
+    words[tabpos] |= rem << slotpos;
+    if (spillbits > 0) {
+        words[tabpos + 1] &= ~LOW_MASK(spillbits);
+        words[tabpos + 1] |= rem >> (qf->rbits - spillbits);
+    }
+}
+
+static inline uint64_t hash_to_quotient(blocked_quotient_filter *qf,
+                                        uint64_t hash)
+{
+    return (hash >> qf->rbits) & qf->index_mask;
+}
+
+static inline uint64_t hash_to_remainder(blocked_quotient_filter *qf,
+                                         uint64_t hash)
+{
+    return hash & qf->rmask;
+}
+
+/* Return the last slot used by the runs whose quotient is <= x. The result
+ * is smaller than x when none of these runs reaches slot x, so slot x is
+ * empty iff run_end(qf, x) < x.
+ */
+static int64_t run_end(const blocked_quotient_filter *qf, int64_t x)
+{
+    if (x < 0)
+        return -1;
+
+    uint64_t block_index = x / 64;
+    const bqf_block *b = get_block(qf, block_index);
+    uint64_t rank = popcnt(b->occupieds & ((2ULL << (x % 64)) - 1));
+    if (rank == 0)
+        return (int64_t)(block_index * 64 + b->offset) - 1;
+
+    /* The rank'th run of this block ends at the rank'th runend that follows
+     * the runs spilled over from earlier blocks. */
+    uint64_t runend_block = block_index + b->offset / 64;
+    uint64_t runends =
+        get_block(qf, runend_block)->runends & ~LOW_MASK(b->offset % 64);
+    --rank;
+    while (popcnt(runends) <= rank) {
+        rank -= popcnt(runends);
+        runends = get_block(qf, ++runend_block)->runends;
+    }
+    return runend_block * 64 + bitselect(runends, rank);
+}
+
+/* Index of the first slot of the run for fq, given that the run exists and
+ * ends at `end': the slot after the previous runend, unless that one lies
+ * before fq. */
+static uint64_t run_start(const blocked_quotient_filter *qf,
+                          uint64_t fq,
+                          uint64_t end)
+{
+    if (end == fq)
+        return fq;
+    uint64_t block_index = (end - 1) / 64;
+    uint64_t word =
+        get_block(qf, block_index)->runends & ((2ULL << ((end - 1) % 64)) - 1);
+    while (!word) {
+        if (block_index * 64 <= fq)
+            return fq;
+        word = get_block(qf, --block_index)->runends;
+    }
+    uint64_t prev = block_index * 64 + 63 - __builtin_clzll(word);
+    return MAX(fq, prev + 1);
+}
+
+static uint64_t find_first_empty_slot(const blocked_quotient_filter *qf,
+                                      uint64_t from)
+{
+    while (from < qf->xnslots) {
+        int64_t end = run_end(qf, from);
+        if (end < (int64_t) from)
+            break;
+        from = end + 1;
+    }
+    return from;
+}
+
+/* First occupied quotient >= from, or nslots if there is none. */
+static uint64_t next_occupied(const blocked_quotient_filter *qf, uint64_t from)
+{
+    if (from >= qf->nslots)
+        return qf->nslots;
+    uint64_t block_index = from / 64;
+    uint64_t word =
+        get_block(qf, block_index)->occupieds & ~LOW_MASK(from % 64);
+    while (!word) {
+        if (++block_index * 64 >= qf->nslots)
+            return qf->nslots;
+        word = get_block(qf, block_index)->occupieds;
+    }
+    return block_index * 64 + __builtin_ctzll(word);
+}
+
+/* First slot >= from whose runend bit is set. */
+static uint64_t next_runend(const blocked_quotient_filter *qf, uint64_t from)
+{
+    uint64_t block_index = from / 64;
+    uint64_t word = get_block(qf, block_index)->runends & ~LOW_MASK(from % 64);
+    while (!word)
+        word = get_block(qf, ++block_index)->runends;
+    return block_index * 64 + __builtin_ctzll(word);
+}
+
+/* Copy slot `from' (remainder and runend bit) into slot `to'. */
+static inline void move_slot(blocked_quotient_filter *qf,
+                             uint64_t to,
+                             uint64_t from)
+{
+    set_remainder(qf, to, get_remainder(qf, from));
+    put_runend(qf, to, is_runend(qf, from));
+}
+
+/* Shift the slots [first, last) one slot to the right, overwriting the
+ * (empty) slot `last'. The runend bits move a word at a time. */
+static void shift_right(blocked_quotient_filter *qf,
+                        uint64_t first,
+                        uint64_t last)
+{
+    for (uint64_t i = last; i > first; --i)
+        set_remainder(qf, i, get_remainder(qf, i - 1));
+
+    /* Bits above `last' keep their place; 2 << 63 wraps to 0 in C. */
+    uint64_t first_block = first / 64, last_block = last / 64;
+    uint64_t keep = ~((2ULL << (last % 64)) - 1);
+    for (uint64_t i = last_block; i > first_block; --i) {
+        bqf_block *b = get_block(qf, i);
+        uint64_t carry = get_block(qf, i - 1)->runends >> 63;
+        b->runends =
+            (b->runends & keep) | (((b->runends << 1) | carry) & ~keep);
+        keep = 0;
+    }
+    bqf_block *b = get_block(qf, first_block);
+    keep |= LOW_MASK(first % 64);
+    b->runends = (b->runends & keep) | ((b->runends << 1) & ~keep);
+}
+
+bool bqf_insert(blocked_quotient_filter *qf, uint64_t hash)
+{
+    if (qf->entries >= qf->max_size)
+        return false;
+
+    uint64_t fq = hash_to_quotient(qf, hash);
+    uint64_t fr = hash_to_remainder(qf, hash);
+    int64_t end = run_end(qf, fq);
+    bool occupied = is_occupied(qf, fq);
+    uint64_t s;
+
+    if (!occupied) {
+        /* Special-case filling canonical slots. */
+        if (end < (int64_t) fq) {
+            set_remainder(qf, fq, fr);
+            put_runend(qf, fq, true);
+            set_occupied(qf, fq);
+            ++qf->entries;
+            return true;
+        }
+        /* The new run goes right after the runs of smaller quotients. */
+        s = end + 1;
+    } else {
+        /* Move the cursor to the insert position in the fq run. */
+        for (s = run_start(qf, fq, end); s <= (uint64_t) end; ++s) {
+            uint64_t rem = get_remainder(qf, s);
+            if (rem == fr) {
+                return true;
+            } else if (rem > fr) {
+                break;
+            }
+        }
+    }
+
+    uint64_t empty = find_first_empty_slot(qf, s);
+    if (empty >= qf->xnslots)
+        return false;
+
+    shift_right(qf, s, empty);
+    set_remainder(qf, s, fr);
+
+    if (!occupied) {
+        put_runend(qf, s, true);
+        set_occupied(qf, fq);
+    } else if (s == (uint64_t) end + 1) {
+        /* Appending to the run moves its runend. */
+        put_runend(qf, end, false);
+        put_runend(qf, s, true);
+    } else {
+        put_runend(qf, s, false);
+    }
+
+    /* Every block between the home slot and the empty slot now holds one
+     * more slot of runs from earlier blocks. */
+    for (uint64_t i = fq / 64 + 1; i <= empty / 64; ++i)
+        get_block(qf, i)->offset++;
+
+    ++qf->entries;
+    return true;
+}
+
+bool bqf_may_contain(blocked_quotient_filter *qf, uint64_t hash)
+{
+    uint64_t fq = hash_to_quotient(qf, hash);
+    uint64_t fr = hash_to_remainder(qf, hash);
+
+    /* If this quotient has no run, give up. */
+    if (!is_occupied(qf, fq))
+        return false;
+
+    /* Scan the sorted run for the target remainder. */
+    uint64_t end = run_end(qf, fq);
+    for (uint64_t s = run_start(qf, fq, end); s <= end; ++s) {
+        uint64_t rem = get_remainder(qf, s);
+        if (rem == fr) {
+            return true;
+        } else if (rem > fr) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool bqf_remove(blocked_quotient_filter *qf, uint64_t hash)
+{
+    uint64_t highbits = hash >> (qf->qbits + qf->rbits);
+    if (qf->qbits + qf->rbits < 64 && highbits)
+        return false;
+
+    uint64_t fq = hash_to_quotient(qf, hash);
+    uint64_t fr = hash_to_remainder(qf, hash);
+
+    if (!is_occupied(qf, fq) || !qf->entries)
+        return true;
+
+    uint64_t end = run_end(qf, fq);
+    uint64_t start = run_start(qf, fq, end);
+    uint64_t s;
+
+    /* Find the offending table index */
+    for (s = start; s <= end; ++s) {
+        uint64_t rem = get_remainder(qf, s);
+        if (rem == fr) {
+            break;
+        } else if (rem > fr) {
+            return true;
+        }
+    }
+    if (s > end)
+        return true;
+
+    if (start == end) {
+        /* We are deleting the last entry in a run. */
+        clr_occupied(qf, fq);
+    } else if (s == end) {
+        put_runend(qf, end - 1, true);
+    }
+
+    /* Close the gap inside the fq run... */
+    for (; s < end; ++s)
+        move_slot(qf, s, s + 1);
+
+    /* ...then slide every following run of the cluster that is not in its
+     * canonical slot back by one slot. */
+    uint64_t gap = end;
+    uint64_t quot = fq;
+    while ((quot = next_occupied(qf, quot + 1)) < qf->nslots && quot <= gap) {
+        uint64_t last = next_runend(qf, gap + 1);
+        for (s = gap; s < last; ++s)
+            move_slot(qf, s, s + 1);
+        gap = last;
+    }
+    set_remainder(qf, gap, 0);
+    put_runend(qf, gap, false);
+
+    /* Recompute the offsets of the blocks whose first slot moved. */
+    for (uint64_t i = fq / 64 + 1; i <= gap / 64; ++i) {
+        int64_t used = run_end(qf, i * 64 - 1) - (int64_t)(i * 64) + 1;
+        get_block(qf, i)->offset = MAX(used, 0);
+    }
+
+    --qf->entries;
+    return true;
+}
+
+void bqf_clear(blocked_quotient_filter *qf)
+{
+    qf->entries = 0;
+    memset(qf->blocks, 0, bqf_table_size(qf->qbits, qf->rbits));
+}
+
+size_t bqf_table_size(uint32_t q, uint32_t r)
+{
+    return nblocks_for(q) * (sizeof(bqf_block) + r * sizeof(uint64_t));
+}
+
+void bqf_destroy(blocked_quotient_filter *qf)
+{
+    free(qf->blocks);
+}
@@ -0,0 +1,55 @@
+#include "quotient-filter-convert.h"
+#include "gqf_int.h"
+#include "quotient-filter-int.h"
+
+bool qf_to_cqf(CQF *cqf, quotient_filter *qf)
+{
+    qf_iterator qfi;
+    cqf_builder b;
+
+    if (qf->rbits < 2)
+        return false;
+    if (!cqf_malloc(cqf, qf->max_size, qf->qbits + qf->rbits, 0,
+                    QF_HASH_NONE, 0))
+        return false;
+
+    cqf_builder_init(cqf, &b);
+    qfi_start(qf, &qfi);
+    while (!qfi_done(qf, &qfi)) {
+        if (cqf_builder_append(cqf, &b, qfi_next(qf, &qfi), 1) < 0) {
+            cqf_free(cqf);
+            return false;
+        }
+    }
+    if (cqf_builder_finish(cqf, &b) < 0) {
+        cqf_free(cqf);
+        return false;
+    }
+    return true;
+}
+
+bool cqf_to_qf(quotient_filter *qf, const CQF *cqf)
+{
+    uint64_t nslots = cqf_get_nslots(cqf);
+    uint32_t q = __builtin_ctzll(nslots);
+    uint32_t r = cqf_get_bits_per_slot(cqf);
+    uint64_t value_bits = cqf_get_num_value_bits(cqf);
+    qf_builder b;
+    QFi cqfi;
+
+    if (!qf_init(qf, q, r))
+        return false;
+
+    qf_builder_init(&b);
+    if (cqf_iterator_from_position(cqf, &cqfi, 0) < 0)
+        return true;
+    do {
+        uint64_t key, value, count;
+        cqfi_get_hash(&cqfi, &key, &value, &count);
+        if (!qf_builder_append(qf, &b, key << value_bits | value)) {
+            qf_destroy(qf);
+            return false;
+        }
+    } while (cqfi_next(&cqfi) == 0);
+    return true;
+}
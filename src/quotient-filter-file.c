@@ -1,70 +1,928 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "dirty-pages.h"
 #include "quotient-filter-file.h"
+#include "quotient-filter-int.h"
 
 #define LOW_MASK(n) ((1ULL << (n)) - 1ULL)
 
+/* "QFILE_01" */
+#define QF_FILE_MAGIC 0x31305f454c494651ULL
+#define QF_FILE_VERSION 1
+
+/* The header takes the first page of the file, so that the table after it
+ * stays page aligned. */
+#define QF_FILE_HEADER_SIZE 4096
+
+/* "QFWAL_01" */
+#define QF_WAL_MAGIC 0x31305f4c41574651ULL
+
+/* Log records buffered before they are written out. */
+#define QF_WAL_BUFFER 4096
+
+struct qf_file_header {
+    uint64_t magic;
+    uint32_t version;
+    uint8_t qbits, rbits;
+    uint8_t clean; /* closed with qf_closefile() after the last change */
+    uint8_t reserved;
+    uint64_t entries; /* only valid if clean */
+    uint64_t table_size;
+    uint64_t generation; /* bumped by every checkpoint */
+};
+
+/* The log starts with a header naming the checkpoint it continues. */
+struct qf_wal_header {
+    uint64_t magic;
+    uint64_t generation;
+};
+
+enum qf_wal_op { QF_WAL_INSERT = 1, QF_WAL_REMOVE = 2 };
+
+struct qf_wal_record {
+    uint64_t hash;
+    uint32_t op;
+    uint32_t check; /* tells a torn or unwritten tail from a record */
+};
+
+/* "QFCKPT01" */
+#define QF_CKPT_MAGIC 0x313054504b434651ULL
+
+/* A checkpoint first copies the pages it writes back, and the new file
+ * header, to a journal in "<filename>.ckpt", so that a crash while they
+ * are written into the file can be recovered from. The journal starts with
+ * this, written once everything after it is on disk, then the new file
+ * header, then the pages as ranges of the file.
+ */
+struct qf_ckpt_header {
+    uint64_t magic;
+    uint64_t generation; /* of the file once the checkpoint is done */
+    uint64_t bytes;      /* of ranges after the file header */
+    uint64_t check;
+};
+
+struct qf_ckpt_range {
+    uint64_t offset; /* in the file */
+    uint64_t len;    /* of the bytes that follow */
+};
+
+struct qf_file {
+    int fd;
+    bool writable;
+    bool shared; /* writes go straight to the file */
+    struct qf_file_header *header; /* start of the mapping */
+    size_t size;                   /* of the mapping */
+    char *path;
+    /* Write-ahead logging, wal_fd is -1 without. */
+    int wal_fd;
+    uint64_t wal_group;
+    uint64_t wal_bytes;  /* of records in the log */
+    uint64_t nunsynced;  /* records not known to be on disk */
+    size_t npending;     /* records not written yet */
+    struct qf_wal_record *pending;
+};
+
+static void set_geometry(quotient_filter *qf, uint32_t q, uint32_t r)
+{
+    qf->qbits = q;
+    qf->rbits = r;
+    qf->elem_bits = qf->rbits + 3;
+    qf->index_mask = LOW_MASK(q);
+    qf->rmask = LOW_MASK(r);
+    qf->elem_mask = LOW_MASK(qf->elem_bits);
+    qf->entries = 0;
+    qf->max_size = 1ULL << q;
+    qf->locks = NULL;
+    qf->nlocks = 0;
+    qf->dirty = NULL;
+}
+
+/* Map all of fd and hang the table after the header. A private mapping is
+ * always writable, and its changes never reach the file. */
+static bool map_table(quotient_filter *qf, int fd, size_t size, bool shared)
+{
+    int prot = shared && !qf->file->writable ? PROT_READ
+                                             : PROT_READ | PROT_WRITE;
+    void *base =
+        mmap(NULL, size, prot, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Couldn't mmap file");
+        return false;
+    }
+
+    if (madvise(base, size, MADV_RANDOM) < 0) {
+        perror("Couldn't madvise file");
+        munmap(base, size);
+        return false;
+    }
+
+    qf->file->fd = fd;
+    qf->file->shared = shared;
+    qf->file->header = base;
+    qf->file->size = size;
+    qf->table = (uint64_t *) ((char *) base + QF_FILE_HEADER_SIZE);
+    return true;
+}
+
+static bool open_file(quotient_filter *qf,
+                      const char *filename,
+                      int fd,
+                      size_t size,
+                      bool writable,
+                      bool shared)
+{
+    qf->file = calloc(1, sizeof(*qf->file));
+    if (!qf->file)
+        return false;
+    qf->file->writable = writable;
+    qf->file->wal_fd = -1;
+    qf->file->path = strdup(filename);
+    if (writable)
+        qf->dirty = calloc(dirty_nflags(size - QF_FILE_HEADER_SIZE), 1);
+    if (!qf->file->path || (writable && !qf->dirty) ||
+        !map_table(qf, fd, size, shared)) {
+        free((void *) qf->dirty);
+        qf->dirty = NULL;
+        free(qf->file->path);
+        free(qf->file);
+        qf->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void free_file(quotient_filter *qf)
+{
+    free((void *) qf->dirty);
+    qf->dirty = NULL;
+    free(qf->file->pending);
+    free(qf->file->path);
+    free(qf->file);
+    qf->file = NULL;
+}
+
+/* filename with ext appended, the log or the checkpoint journal. */
+static char *side_path(const char *filename, const char *ext)
+{
+    char *path = malloc(strlen(filename) + strlen(ext) + 1);
+    if (path)
+        sprintf(path, "%s%s", filename, ext);
+    return path;
+}
+
+static uint32_t wal_check(uint64_t hash, uint32_t op)
+{
+    uint64_t x = (hash ^ op) * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t) (x >> 32) ^ 0x51574c21;
+}
+
 /**
  * Initializes a quotient filter with capacity 2^q in disk.
  * Increasing r improves the filter's accuracy but uses more space.
  *
- * Returns false if q == 0, r == 0, q+r > 64, or file allocation failed.
+ * Returns false if q == 0, r == 0, q+r > 64, r > 61, or file allocation
+ * failed.
  */
 bool qf_initfile(quotient_filter *qf,
                  uint32_t q,
                  uint32_t r,
                  const char *filename)
 {
-    if (q == 0 || r == 0 || q + r > 64)
+    if (q == 0 || r == 0 || q + r > 64 || r > 61)
         return false;
 
-    qf->qbits = q;
-    qf->rbits = r;
-    qf->elem_bits = qf->rbits + 3;
-    qf->index_mask = LOW_MASK(q);
-    qf->rmask = LOW_MASK(r);
-    qf->elem_mask = LOW_MASK(qf->elem_bits);
-    qf->entries = 0;
-    qf->max_size = 1 << q;
+    set_geometry(qf, q, r);
+    qf->file = NULL;
 
     int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
-    uint64_t total_bytes = qf_table_size(q, r);
+    if (fd < 0) {
+        perror("Couldn't open file");
+        return false;
+    }
 
-    if (posix_fallocate(fd, 0, total_bytes) < 0) {
-        fprintf(stderr, "Couldn't fallocate file.");
-        exit(0);
+    uint64_t table_size = qf_table_size(q, r);
+    uint64_t total_bytes = QF_FILE_HEADER_SIZE + table_size;
+    if (posix_fallocate(fd, 0, total_bytes) != 0) {
+        fprintf(stderr, "Couldn't fallocate file.\n");
+        close(fd);
+        return false;
     }
 
-    qf->table =
-        mmap(NULL, total_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (qf->table == MAP_FAILED) {
-        perror("Couldn't mmap file");
-        exit(0);
+    if (!open_file(qf, filename, fd, total_bytes, true, true)) {
+        close(fd);
+        return false;
     }
 
-    if (madvise(qf->table, total_bytes, MADV_RANDOM) < 0) {
-        perror("Couldn't fallocate file in madvise");
-        exit(0);
+    struct qf_file_header *header = qf->file->header;
+    header->magic = QF_FILE_MAGIC;
+    header->version = QF_FILE_VERSION;
+    header->qbits = q;
+    header->rbits = r;
+    header->clean = 0;
+    header->entries = 0;
+    header->table_size = table_size;
+    header->generation = 0;
+    return true;
+}
+
+
+/* pwrite() all of buf, however many calls it takes. */
+static bool write_all(int fd, const void *buf, size_t len, off_t off)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0)
+            return false;
+        p += n;
+        len -= n;
+        off += n;
+    }
+    return true;
+}
+
+/* Apply the records of the log at path that continue the given checkpoint,
+ * up to the first torn one. Returns the number of bytes they take, 0 if the
+ * log is missing or belongs to another checkpoint.
+ */
+static uint64_t wal_replay(quotient_filter *qf,
+                           const char *path,
+                           uint64_t generation)
+{
+    struct qf_wal_header header;
+    struct qf_wal_record records[256];
+    uint64_t bytes = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != QF_WAL_MAGIC || header.generation != generation) {
+        close(fd);
+        return 0;
+    }
+
+    for (;;) {
+        ssize_t n = pread(fd, records, sizeof(records), sizeof(header) + bytes);
+        if (n <= 0)
+            break;
+        size_t i, nrecords = n / sizeof(records[0]);
+        for (i = 0; i < nrecords; ++i) {
+            struct qf_wal_record *rec = &records[i];
+            if (rec->check != wal_check(rec->hash, rec->op))
+                break;
+            if (rec->op == QF_WAL_INSERT)
+                qf_insert(qf, rec->hash);
+            else if (rec->op == QF_WAL_REMOVE)
+                qf_remove(qf, rec->hash);
+            else
+                break;
+        }
+        bytes += i * sizeof(records[0]);
+        if (i < nrecords || nrecords < sizeof(records) / sizeof(records[0]))
+            break;
+    }
+    close(fd);
+    return bytes;
+}
+
+/* Start logging to the log at path, which already holds bytes of records
+ * past its header, or is created if truncate is set.
+ */
+static bool wal_open(quotient_filter *qf,
+                     const char *path,
+                     uint64_t bytes,
+                     bool truncate)
+{
+    struct qf_file *file = qf->file;
+    struct qf_wal_header header = {QF_WAL_MAGIC, file->header->generation};
+
+    file->pending = malloc(QF_WAL_BUFFER * sizeof(*file->pending));
+    if (!file->pending)
+        return false;
+    file->npending = 0;
+
+    int fd = open(path, O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), S_IRWXU);
+    if (fd < 0) {
+        perror("Couldn't open log");
+        goto fail;
+    }
+    if (truncate ? !write_all(fd, &header, sizeof(header), 0)
+                 : ftruncate(fd, sizeof(header) + bytes) < 0) {
+        perror("Couldn't write log");
+        close(fd);
+        goto fail;
+    }
+    if (fdatasync(fd) < 0) {
+        perror("Couldn't sync log");
+        close(fd);
+        goto fail;
+    }
+    file->wal_fd = fd;
+    file->wal_bytes = bytes;
+    return true;
+
+fail:
+    free(file->pending);
+    file->pending = NULL;
+    return false;
+}
+
+/* Write the buffered records out, without waiting for them to hit disk. */
+static bool wal_write(struct qf_file *file)
+{
+    size_t len = file->npending * sizeof(*file->pending);
+    if (!write_all(file->wal_fd, file->pending, len,
+                   sizeof(struct qf_wal_header) + file->wal_bytes)) {
+        perror("Couldn't write log");
+        return false;
+    }
+    file->wal_bytes += len;
+    file->npending = 0;
+    return true;
+}
+
+static bool wal_append(quotient_filter *qf, uint64_t hash, uint32_t op)
+{
+    struct qf_file *file = qf->file;
+    file->pending[file->npending++] =
+        (struct qf_wal_record){hash, op, wal_check(hash, op)};
+    file->nunsynced++;
+
+    if (file->wal_group && file->nunsynced >= file->wal_group)
+        return qf_wal_commit(qf);
+    if (file->npending == QF_WAL_BUFFER)
+        return wal_write(file);
+    return true;
+}
+
+/* fsync the directory holding path, so that a file created in it is
+ * durable. */
+static bool sync_dir(const char *path)
+{
+    char *copy = strdup(path);
+    if (!copy)
+        return false;
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+static uint64_t ckpt_check(const struct qf_ckpt_header *ckpt)
+{
+    uint64_t x = (ckpt->generation ^ ckpt->bytes) * 0x9e3779b97f4a7c15ULL;
+    return x ^ QF_CKPT_MAGIC;
+}
+
+/* Write the pages of the table flagged in qf->dirty, or all of them if it
+ * is NULL, to fd: as ranges of the journal from *journal on, or into the
+ * file if journal is NULL.
+ */
+static bool write_dirty(quotient_filter *qf, int fd, uint64_t *journal)
+{
+    uint64_t size = qf_table_size(qf->qbits, qf->rbits);
+    uint64_t nflags = dirty_nflags(size);
+
+    for (uint64_t i = 0; i < nflags; ++i) {
+        if (qf->dirty && !qf->dirty[i])
+            continue;
+        /* Pages flagged in a row are written in one go, and flag j isn't. */
+        uint64_t j = i + 1;
+        while (j < nflags && (!qf->dirty || qf->dirty[j]))
+            ++j;
+
+        uint64_t begin = i << DIRTY_SHIFT;
+        uint64_t end = j << DIRTY_SHIFT < size ? j << DIRTY_SHIFT : size;
+        struct qf_ckpt_range range = {QF_FILE_HEADER_SIZE + begin,
+                                      end - begin};
+        const char *data = (const char *) qf->table + begin;
+        i = j;
+        if (!journal) {
+            if (!write_all(fd, data, range.len, range.offset))
+                return false;
+            continue;
+        }
+        if (!write_all(fd, &range, sizeof(range), *journal) ||
+            !write_all(fd, data, range.len, *journal + sizeof(range)))
+            return false;
+        *journal += sizeof(range) + range.len;
+    }
+    return true;
+}
+
+/* Journal the pages a checkpoint to header writes back, at path. */
+static bool ckpt_write(quotient_filter *qf,
+                       const struct qf_file_header *header,
+                       const char *path)
+{
+    struct qf_ckpt_header ckpt = {QF_CKPT_MAGIC, header->generation, 0, 0};
+    uint64_t start = sizeof(ckpt) + sizeof(*header), end = start;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fd < 0)
+        return false;
+    bool ok = write_all(fd, header, sizeof(*header), sizeof(ckpt)) &&
+              write_dirty(qf, fd, &end) && fsync(fd) == 0;
+    if (ok) {
+        ckpt.bytes = end - start;
+        ckpt.check = ckpt_check(&ckpt);
+        ok = write_all(fd, &ckpt, sizeof(ckpt), 0) && fsync(fd) == 0 &&
+             sync_dir(path);
+    }
+    close(fd);
+    return ok;
+}
+
+/* Open the journal at path if it finishes the checkpoint after generation
+ * and is complete, and read the file header it writes.
+ * Returns its fd, or -1.
+ */
+static int ckpt_open(const char *path,
+                     uint64_t generation,
+                     struct qf_file_header *header)
+{
+    struct qf_ckpt_header ckpt;
+    struct qf_file_header next;
+    struct stat sb;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0 ||
+        pread(fd, &ckpt, sizeof(ckpt), 0) != sizeof(ckpt) ||
+        ckpt.magic != QF_CKPT_MAGIC || ckpt.check != ckpt_check(&ckpt) ||
+        ckpt.generation != generation + 1 ||
+        (uint64_t) sb.st_size < sizeof(ckpt) + sizeof(next) + ckpt.bytes ||
+        pread(fd, &next, sizeof(next), sizeof(ckpt)) != sizeof(next)) {
+        close(fd);
+        return -1;
+    }
+    *header = next;
+    return fd;
+}
+
+/* Copy the ranges of the journal opened with ckpt_open() into the file fd
+ * and then its header, or into the mapping of the file at base if fd is -1.
+ */
+static bool ckpt_apply(int journal, int fd, char *base)
+{
+    struct qf_ckpt_header ckpt;
+    struct qf_file_header header;
+    struct qf_ckpt_range range;
+    char buf[1 << 16];
+
+    if (pread(journal, &ckpt, sizeof(ckpt), 0) != sizeof(ckpt) ||
+        pread(journal, &header, sizeof(header), sizeof(ckpt)) !=
+            sizeof(header))
+        return false;
+    uint64_t pos = sizeof(ckpt) + sizeof(header);
+    uint64_t end = pos + ckpt.bytes;
+    while (pos < end) {
+        if (pread(journal, &range, sizeof(range), pos) != sizeof(range))
+            return false;
+        pos += sizeof(range);
+        for (uint64_t done = 0; done < range.len;) {
+            size_t len = range.len - done < sizeof(buf) ? range.len - done
+                                                        : sizeof(buf);
+            char *dst = fd < 0 ? base + range.offset + done : buf;
+            if (pread(journal, dst, len, pos + done) != (ssize_t) len ||
+                (fd >= 0 && !write_all(fd, buf, len, range.offset + done)))
+                return false;
+            done += len;
+        }
+        pos += range.len;
+    }
+
+    /* The header goes last, once the table it describes is on disk. */
+    if (fd < 0) {
+        memcpy(base, &header, sizeof(header));
+        return true;
+    }
+    return fsync(fd) == 0 && write_all(fd, &header, sizeof(header), 0) &&
+           fsync(fd) == 0;
+}
+
+/**
+ * Opens a quotient filter that was created with qf_initfile().
+ * The table is mapped in place, nothing is read up front.
+ *
+ * Returns false when the file can't be opened or is not a QF file.
+ */
+bool qf_usefile(quotient_filter *qf, const char *filename, int flag)
+{
+    struct stat sb;
+    bool writable;
+
+    if (flag == QF_USEFILE_READ_ONLY) {
+        writable = false;
+    } else if (flag == QF_USEFILE_READ_WRITE) {
+        writable = true;
+    } else {
+        fprintf(stderr, "Wrong flag specified.\n");
+        return false;
+    }
+
+    int fd = open(filename, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct qf_file_header header;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        close(fd);
+        return false;
+    }
+
+    /* A checkpoint cut short by a crash is finished from its journal, or
+     * only read from it if the file is read-only. */
+    char *journal = side_path(filename, ".ckpt");
+    if (!journal) {
+        close(fd);
+        return false;
+    }
+    int journal_fd = ckpt_open(journal, header.generation, &header);
+    if (writable) {
+        bool ok = journal_fd < 0 || ckpt_apply(journal_fd, fd, NULL);
+        if (journal_fd >= 0)
+            close(journal_fd);
+        journal_fd = -1;
+        if (!ok) {
+            perror("Couldn't finish checkpoint");
+            free(journal);
+            close(fd);
+            return false;
+        }
+        unlink(journal);
+    }
+    free(journal);
+
+    if (header.magic != QF_FILE_MAGIC || header.version != QF_FILE_VERSION ||
+        header.qbits == 0 || header.rbits == 0 ||
+        header.qbits + header.rbits > 64 || header.rbits > 61 ||
+        header.table_size != qf_table_size(header.qbits, header.rbits) ||
+        (uint64_t) sb.st_size < QF_FILE_HEADER_SIZE + header.table_size) {
+        if (journal_fd >= 0)
+            close(journal_fd);
+        close(fd);
+        return false;
+    }
+
+    char *log = side_path(filename, ".wal");
+    if (!log) {
+        if (journal_fd >= 0)
+            close(journal_fd);
+        close(fd);
+        return false;
+    }
+
+    /* A log left behind by a writer in WAL mode has to be replayed on a
+     * private copy of the table, the file only changes at checkpoints. */
+    struct qf_wal_header log_header;
+    bool replay = false;
+    int log_fd = open(log, O_RDONLY);
+    if (log_fd >= 0) {
+        replay = fstat(log_fd, &sb) == 0 &&
+                 (uint64_t) sb.st_size >=
+                     sizeof(log_header) + sizeof(struct qf_wal_record) &&
+                 pread(log_fd, &log_header, sizeof(log_header), 0) ==
+                     sizeof(log_header) &&
+                 log_header.magic == QF_WAL_MAGIC &&
+                 log_header.generation == header.generation;
+        close(log_fd);
+    }
+
+    set_geometry(qf, header.qbits, header.rbits);
+    bool shared = !replay && journal_fd < 0;
+    if (!open_file(qf, filename, fd, QF_FILE_HEADER_SIZE + header.table_size,
+                   writable, shared)) {
+        if (journal_fd >= 0)
+            close(journal_fd);
+        close(fd);
+        free(log);
+        return false;
+    }
+    if (journal_fd >= 0) {
+        bool ok = ckpt_apply(journal_fd, -1, (char *) qf->file->header);
+        close(journal_fd);
+        if (!ok) {
+            free(log);
+            qf_closefile(qf);
+            return false;
+        }
     }
 
-    return qf->table != NULL;
+    /* Count the entries if the last writer didn't get to close the file. */
+    if (header.clean) {
+        qf->entries = header.entries;
+    } else {
+        qf_stats_report stats;
+        qf_stats(qf, &stats);
+        qf->entries = stats.entries;
+    }
+
+    if (replay) {
+        uint64_t bytes = wal_replay(qf, log, header.generation);
+        if (writable && !wal_open(qf, log, bytes, false)) {
+            free(log);
+            qf_closefile(qf);
+            return false;
+        }
+    } else if (writable) {
+        /* Anything in a stale log is part of the table already. */
+        unlink(log);
+        /* Changes may reach the disk before the next flush. */
+        qf->file->header->clean = 0;
+        if (msync(qf->file->header, QF_FILE_HEADER_SIZE, MS_SYNC) < 0) {
+            perror("Couldn't sync file to disk");
+            free(log);
+            qf_closefile(qf);
+            return false;
+        }
+    }
+    free(log);
+
+    return true;
 }
 
+/**
+ * Switches a QF opened for writing to logging its changes, or sets the
+ * group size of one that already logs them.
+ *
+ * Returns false if the file is read-only or the log can't be created.
+ */
+bool qf_wal_enable(quotient_filter *qf, uint64_t group)
+{
+    struct qf_file *file = qf->file;
+    if (!file || !file->writable)
+        return false;
+    if (file->wal_fd >= 0) {
+        file->wal_group = group;
+        return true;
+    }
+
+    /* Leave a clean file behind, the log continues from there. */
+    file->header->entries = qf->entries;
+    if (msync(file->header, file->size, MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk");
+        return false;
+    }
+    file->header->clean = 1;
+    if (msync(file->header, QF_FILE_HEADER_SIZE, MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk");
+        return false;
+    }
+
+    char *log = side_path(file->path, ".wal");
+    if (!log)
+        return false;
+    bool ok = wal_open(qf, log, 0, true);
+    free(log);
+    if (!ok)
+        return false;
+
+    /* From now on the table only reaches the file at checkpoints. */
+    void *base = file->header;
+    size_t size = file->size;
+    if (!map_table(qf, file->fd, size, false)) {
+        close(file->wal_fd);
+        file->wal_fd = -1;
+        free(file->pending);
+        file->pending = NULL;
+        return false;
+    }
+    munmap(base, size);
+    /* Everything is on disk, the flags now collect the next checkpoint. */
+    memset((void *) qf->dirty, 0, dirty_nflags(size - QF_FILE_HEADER_SIZE));
+    file->wal_group = group;
+    file->nunsynced = 0;
+    return true;
+}
 
 /**
- * TODO :
- * Read a quotient filter in disk.
+ * Inserts a hash like qf_insert(), and logs it.
  *
- * Returns false when file open failed.
+ * Returns false if the QF is full or the log can't be written.
  */
-bool qf_usefile(quotient_filter *qf, const char *filename)
+bool qf_wal_insert(quotient_filter *qf, uint64_t hash)
 {
+    assert(qf->file != NULL && qf->file->wal_fd >= 0);
+    if (!qf_insert(qf, hash))
+        return false;
+    return wal_append(qf, hash, QF_WAL_INSERT);
+}
+
+/**
+ * Removes a hash like qf_remove(), and logs it. Hashes that aren't in the
+ * QF are not logged.
+ *
+ * Returns false if the hash isn't in the QF or the log can't be written.
+ */
+bool qf_wal_remove(quotient_filter *qf, uint64_t hash)
+{
+    assert(qf->file != NULL && qf->file->wal_fd >= 0);
+    if (!qf_may_contain(qf, hash) || !qf_remove(qf, hash))
+        return false;
+    return wal_append(qf, hash, QF_WAL_REMOVE);
+}
+
+/**
+ * Makes all logged changes durable.
+ *
+ * Returns false if the log can't be written.
+ */
+bool qf_wal_commit(quotient_filter *qf)
+{
+    struct qf_file *file = qf->file;
+    assert(file != NULL && file->wal_fd >= 0);
+
+    if (!wal_write(file))
+        return false;
+    if (file->nunsynced) {
+        if (fdatasync(file->wal_fd) < 0) {
+            perror("Couldn't sync log");
+            return false;
+        }
+        file->nunsynced = 0;
+    }
+
+    if (file->wal_bytes >= QF_WAL_CHECKPOINT_BYTES)
+        return qf_checkpoint(qf);
+    return true;
+}
+
+/**
+ * Writes the pages of the table that changed since the last checkpoint
+ * back into the file, through a journal, and empties the log.
+ *
+ * Returns false if they can't be written.
+ */
+bool qf_checkpoint(quotient_filter *qf)
+{
+    struct qf_file *file = qf->file;
+    assert(file != NULL && file->wal_fd >= 0);
+
+    /* The log stays valid until the file header says otherwise. */
+    if (!wal_write(file))
+        return false;
+    if (file->nunsynced && fdatasync(file->wal_fd) < 0) {
+        perror("Couldn't sync log");
+        return false;
+    }
+    file->nunsynced = 0;
+
+    struct qf_file_header header = *file->header;
+    header.generation++;
+    header.entries = qf->entries;
+    header.clean = 1;
+
+    /* Once the journal is complete, a crash while the pages are written
+     * back leaves a checkpoint that qf_usefile() finishes. */
+    char *journal = side_path(file->path, ".ckpt");
+    if (!journal)
+        return false;
+    if (!ckpt_write(qf, &header, journal) ||
+        !write_dirty(qf, file->fd, NULL) || fsync(file->fd) < 0 ||
+        !write_all(file->fd, &header, sizeof(header), 0) ||
+        fsync(file->fd) < 0) {
+        perror("Couldn't write checkpoint");
+        free(journal);
+        return false;
+    }
+
+    /* From here on the old log and the journal are stale: their generation
+     * no longer matches the file, so a crash before they are gone loses
+     * nothing. */
+    struct qf_wal_header log_header = {QF_WAL_MAGIC, header.generation};
+    if (ftruncate(file->wal_fd, 0) < 0 ||
+        !write_all(file->wal_fd, &log_header, sizeof(log_header), 0) ||
+        fdatasync(file->wal_fd) < 0) {
+        perror("Couldn't reset log");
+        free(journal);
+        return false;
+    }
+    file->wal_bytes = 0;
+    unlink(journal);
+    free(journal);
+
+    /* Map the file again, instead of keeping private copies of every page
+     * that changed. */
+    void *base = file->header;
+    size_t size = file->size;
+    if (!map_table(qf, file->fd, size, false))
+        return false;
+    munmap(base, size);
+    if (!qf->dirty)
+        qf->dirty = calloc(dirty_nflags(size - QF_FILE_HEADER_SIZE), 1);
+    else
+        memset((void *) qf->dirty, 0,
+               dirty_nflags(size - QF_FILE_HEADER_SIZE));
+    return true;
+}
+
+/**
+ * Writes the pages of the table that changed since the last flush back to
+ * the file, with up to nthreads threads.
+ *
+ * Returns the number of bytes written back, or -1 on failure.
+ */
+int64_t qf_flush_incremental(quotient_filter *qf, int nthreads)
+{
+    assert(qf->file != NULL);
+    if (qf->file->wal_fd >= 0)
+        return qf_wal_commit(qf) ? 0 : -1;
+    if (!qf->dirty)
+        return 0;
+    return dirty_msync(qf->table, qf_table_size(qf->qbits, qf->rbits),
+                       qf->dirty, nthreads);
+}
+
+/**
+ * Doubles the number of slots of the QF in its own file, like qf_expand().
+ *
+ * Returns false if r < 2 or the file can't be grown.
+ */
+bool qf_expandfile(quotient_filter *qf)
+{
+    struct qf_file *file = qf->file;
+    assert(file != NULL);
+    if (!file->writable || qf->rbits < 2)
+        return false;
+
+    uint64_t table_size = qf_table_size(qf->qbits + 1, qf->rbits - 1);
+    size_t size = QF_FILE_HEADER_SIZE + table_size;
+    bool wal = file->wal_fd >= 0;
+
+    /* The flags for the new table, allocated while a failure changes
+     * nothing. */
+    volatile uint8_t *flags = calloc(dirty_nflags(table_size), 1);
+    if (!flags)
+        return false;
+
+    /* The table is half rewritten for a while, make the file unusable until
+     * it is done. In WAL mode the file doesn't change until the checkpoint,
+     * and a longer file is still the old one. */
+    if (!wal) {
+        file->header->table_size = 0;
+        if (msync(file->header, QF_FILE_HEADER_SIZE, MS_SYNC) < 0) {
+            perror("Couldn't sync file to disk");
+            goto fail;
+        }
+    }
+    if (posix_fallocate(file->fd, 0, size) != 0) {
+        fprintf(stderr, "Couldn't fallocate file.\n");
+        goto fail;
+    }
+    void *base = mremap(file->header, file->size, size, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        perror("Couldn't mremap file");
+        goto fail;
+    }
+    file->header = base;
+    file->size = size;
+    qf->table = (uint64_t *) ((char *) base + QF_FILE_HEADER_SIZE);
+
+    volatile uint8_t *dirty = qf->dirty;
+    qf->dirty = NULL;
+    if (!qf_expand_in_place(qf)) {
+        qf->dirty = dirty;
+        goto fail;
+    }
+    free((void *) dirty);
+    qf->dirty = flags;
+
+    file->header->qbits = qf->qbits;
+    file->header->rbits = qf->rbits;
+    file->header->table_size = table_size;
+    file->header->entries = qf->entries;
+    if (wal) {
+        /* Every page changed and goes through the checkpoint. */
+        dirty_mark(qf->dirty, 0, table_size - 1);
+        return qf_checkpoint(qf);
+    }
+
+    /* Every page changed, so sync them all before the header. */
+    if (msync(file->header, file->size, MS_SYNC) < 0) {
+        perror("Couldn't sync file to disk");
+        return false;
+    }
+    return true;
+
+fail:
+    free((void *) flags);
+    file->header->table_size = qf_table_size(qf->qbits, qf->rbits);
     return false;
 }
 
@@ -75,18 +933,40 @@ bool qf_usefile(quotient_filter *qf, const char *filename)
  */
 bool qf_closefile(quotient_filter *qf)
 {
-    assert(qf->table != NULL);
+    assert(qf->table != NULL && qf->file != NULL);
 
-    uint64_t size = qf_table_size(qf->qbits, qf->rbits);
-    if (msync(qf->table, size, MS_SYNC) < 0) {
-        perror("Couldn't sync file to disk");
-        exit(0);
+    struct qf_file *file = qf->file;
+    if (file->wal_fd >= 0) {
+        /* Fold the log into the file, then it isn't needed anymore. */
+        if (!qf_checkpoint(qf)) {
+            fprintf(stderr, "Couldn't checkpoint file.\n");
+            exit(0);
+        }
+        close(file->wal_fd);
+        char *log = side_path(file->path, ".wal");
+        if (log)
+            unlink(log);
+        free(log);
+    } else if (file->writable && file->shared) {
+        /* The table has to be on disk before the header says so. */
+        file->header->entries = qf->entries;
+        if (qf_flush_incremental(qf, 1) < 0)
+            exit(0);
+        file->header->clean = 1;
+        if (msync(file->header, QF_FILE_HEADER_SIZE, MS_SYNC) < 0) {
+            perror("Couldn't sync file to disk");
+            exit(0);
+        }
     }
 
-    if (munmap(qf->table, size) == -1) {
+    if (munmap(file->header, file->size) == -1) {
         perror("Couldn't munmap file");
         exit(0);
     }
+    close(file->fd);
+    free_file(qf);
+    free((void *) qf->locks);
+    qf->table = NULL;
 
     return true;
 }
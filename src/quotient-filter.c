@@ -1,21 +1,106 @@
 #include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-#include "quotient-filter.h"
+#include "dirty-pages.h"
+#include "quotient-filter-int.h"
+
+/* Runs of 8, 16 and 32-bit slots are scanned with AVX2 on CPUs that have it.
+ * Define QF_NO_SIMD to always scan them one slot at a time. */
+#if defined(__x86_64__) && !defined(QF_NO_SIMD)
+#include <immintrin.h>
+#define QF_SIMD 1
+#endif
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define LOW_MASK(n) ((1ULL << (n)) - 1ULL)
 
-struct __qf_iterator {
-    uint64_t index;
-    uint64_t quotient;
-    uint64_t visited;
-};
+/* The hot paths below take the slot width as a constant `width' argument and
+ * are always inlined, so every width in QF_DISPATCH() gets its own copy with
+ * the slot arithmetic folded away. Width 0 is the generic, bit-packed kernel.
+ */
+#define QF_KERNEL static inline __attribute__((always_inline))
+
+/* The slot width of qf if it has specialized kernels, else 0. The 8, 16 and
+ * 32-bit kernels rely on the little-endian layout of the packed table, so
+ * other machines always take the generic one. */
+static inline int slot_width(const quotient_filter *qf)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (qf->elem_bits == 8 || qf->elem_bits == 16 || qf->elem_bits == 32)
+        return qf->elem_bits;
+#endif
+    return 0;
+}
+
+/* Run the kernel for the slot width of qf. elem_bits is fixed by qf_init(),
+ * so the branch always goes the same way for a given filter. */
+#define QF_DISPATCH(kernel, qf, ...)                \
+    do {                                            \
+        switch (slot_width(qf)) {                   \
+        case 8:                                     \
+            return kernel((qf), __VA_ARGS__, 8);    \
+        case 16:                                    \
+            return kernel((qf), __VA_ARGS__, 16);   \
+        case 32:                                    \
+            return kernel((qf), __VA_ARGS__, 32);   \
+        default:                                    \
+            return kernel((qf), __VA_ARGS__, 0);    \
+        }                                           \
+    } while (0)
+
+/* The table is an array of uint64_t; narrower views of it must be allowed to
+ * alias it. */
+typedef uint16_t __attribute__((__may_alias__)) qf_u16;
+typedef uint32_t __attribute__((__may_alias__)) qf_u32;
+
+/* Number of lookups qf_may_contain_batch() keeps prefetched ahead. */
+#ifndef QF_PREFETCH_WIDTH
+#define QF_PREFETCH_WIDTH 16
+#endif
+
+/* qf_is_subsetof() probes rhs instead of scanning it when lhs holds fewer
+ * than 1/QF_SUBSET_PROBE_RATIO as many entries. */
+#ifndef QF_SUBSET_PROBE_RATIO
+#define QF_SUBSET_PROBE_RATIO 16
+#endif
+
+/* Slots guarded by one lock in concurrent mode. Clusters must be shorter. */
+#ifndef QF_SLOTS_PER_LOCK
+#define QF_SLOTS_PER_LOCK (1ULL << 16)
+#endif
+
+/* Tables of at least this many bytes ask for transparent hugepages. */
+#ifndef QF_HUGEPAGE_THRESHOLD
+#define QF_HUGEPAGE_THRESHOLD (2 << 20)
+#endif
+
+/* Map a zeroed table. Pages are only backed by memory once they are written,
+ * so a huge, sparsely filled table doesn't cost its full size up front.
+ */
+static uint64_t *alloc_table(size_t size)
+{
+    void *table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    /* Fewer TLB misses on random probes; failure only costs performance. */
+    if (size >= QF_HUGEPAGE_THRESHOLD)
+        madvise(table, size, MADV_HUGEPAGE);
+#endif
+    return table;
+}
 
 bool qf_init(quotient_filter *qf, uint32_t q, uint32_t r)
 {
-    if (q == 0 || r == 0 || q + r > 64)
+    if (q == 0 || r == 0 || q + r > 64 || r > 61)
         return false;
 
     qf->qbits = q;
@@ -25,14 +110,104 @@ bool qf_init(quotient_filter *qf, uint32_t q, uint32_t r)
     qf->rmask = LOW_MASK(r);
     qf->elem_mask = LOW_MASK(qf->elem_bits);
     qf->entries = 0;
-    qf->max_size = 1 << q;
-    qf->table = (uint64_t *) calloc(qf_table_size(q, r), 1);
+    qf->max_size = 1ULL << q;
+    qf->locks = NULL;
+    qf->nlocks = 0;
+    qf->file = NULL;
+    qf->dirty = NULL;
+    qf->table = alloc_table(qf_table_size(q, r));
     return qf->table != NULL;
 }
 
-/* Return QF[idx] in the lower bits. */
-static uint64_t get_elem(quotient_filter *qf, uint64_t idx)
+bool qf_set_concurrent(quotient_filter *qf, bool enable)
+{
+    free((void *) qf->locks);
+    qf->locks = NULL;
+    qf->nlocks = 0;
+    if (!enable)
+        return true;
+
+    uint64_t nlocks =
+        (qf->max_size + QF_SLOTS_PER_LOCK - 1) / QF_SLOTS_PER_LOCK;
+    qf->locks = calloc(nlocks, sizeof(int));
+    if (!qf->locks)
+        return false;
+    qf->nlocks = nlocks;
+    return true;
+}
+
+/* Spin a while, then give the CPU to the holder in case it was preempted. */
+static inline void qf_spin_lock(volatile int *lock)
+{
+    for (int spins = 0; __sync_lock_test_and_set(lock, 1) != 0;) {
+        while (*lock) {
+            if (++spins % 1024 == 0)
+                sched_yield();
+        }
+    }
+}
+
+static inline void qf_spin_unlock(volatile int *lock)
+{
+    __sync_lock_release(lock);
+}
+
+/* Find the regions an operation on home slot fq may touch: the cluster may
+ * begin in the previous region and shift into the next one. They are
+ * returned in ascending order, which is the order every thread takes them in,
+ * so there is no deadlock when the table wraps around.
+ */
+static int lock_regions(quotient_filter *qf, uint64_t fq, uint64_t *regions)
+{
+    uint64_t n = qf->nlocks;
+    if (n <= 3) {
+        for (uint64_t i = 0; i < n; ++i)
+            regions[i] = i;
+        return n;
+    }
+
+    uint64_t region = fq / QF_SLOTS_PER_LOCK;
+    uint64_t prev = (region + n - 1) % n, next = (region + 1) % n;
+    if (region == 0) {
+        regions[0] = region, regions[1] = next, regions[2] = prev;
+    } else if (next == 0) {
+        regions[0] = next, regions[1] = prev, regions[2] = region;
+    } else {
+        regions[0] = prev, regions[1] = region, regions[2] = next;
+    }
+    return 3;
+}
+
+static int lock_home(quotient_filter *qf, uint64_t fq, uint64_t *regions)
+{
+    int n = lock_regions(qf, fq, regions);
+    for (int i = 0; i < n; ++i)
+        qf_spin_lock(&qf->locks[regions[i]]);
+    return n;
+}
+
+static void unlock_home(quotient_filter *qf, const uint64_t *regions, int n)
+{
+    while (n--)
+        qf_spin_unlock(&qf->locks[regions[n]]);
+}
+
+/* Return QF[idx] in the lower bits.
+ * Slots of 8, 16 or 32 bits are naturally aligned, and on a little-endian
+ * machine the packed layout puts slot idx exactly at element idx of an array
+ * of that width.
+ */
+QF_KERNEL uint64_t get_elem_w(quotient_filter *qf, uint64_t idx, int width)
 {
+    switch (width) {
+    case 8:
+        return ((uint8_t *) qf->table)[idx];
+    case 16:
+        return ((qf_u16 *) qf->table)[idx];
+    case 32:
+        return ((qf_u32 *) qf->table)[idx];
+    }
+
     size_t bitpos = qf->elem_bits * idx;
     size_t tabpos = bitpos / 64;
     size_t slotpos = bitpos % 64;
@@ -47,20 +222,46 @@ static uint64_t get_elem(quotient_filter *qf, uint64_t idx)
 }
 
 /* Store the lower bits of elt into QF[idx]. */
-static void set_elem(quotient_filter *qf, uint64_t idx, uint64_t elt)
+QF_KERNEL void set_elem_w(quotient_filter *qf,
+                          uint64_t idx,
+                          uint64_t elt,
+                          int width)
 {
     size_t bitpos = qf->elem_bits * idx;
-    size_t tabpos = bitpos / 64;
-    size_t slotpos = bitpos % 64;
-    int spillbits = (slotpos + qf->elem_bits) - 64;
-    elt &= qf->elem_mask;
-    qf->table[tabpos] &= ~(qf->elem_mask << slotpos);
-    qf->table[tabpos] |= elt << slotpos;
-    if (spillbits > 0) {
-        ++tabpos;
-        qf->table[tabpos] &= ~LOW_MASK(spillbits);
-        qf->table[tabpos] |= elt >> (qf->elem_bits - spillbits);
+
+    switch (width) {
+    case 8:
+        ((uint8_t *) qf->table)[idx] = elt;
+        break;
+    case 16:
+        ((qf_u16 *) qf->table)[idx] = elt;
+        break;
+    case 32:
+        ((qf_u32 *) qf->table)[idx] = elt;
+        break;
+    default: {
+        size_t tabpos = bitpos / 64;
+        size_t slotpos = bitpos % 64;
+        int spillbits = (slotpos + qf->elem_bits) - 64;
+        elt &= qf->elem_mask;
+        qf->table[tabpos] &= ~(qf->elem_mask << slotpos);
+        qf->table[tabpos] |= elt << slotpos;
+        if (spillbits > 0) {
+            ++tabpos;
+            qf->table[tabpos] &= ~LOW_MASK(spillbits);
+            qf->table[tabpos] |= elt >> (qf->elem_bits - spillbits);
+        }
+    }
     }
+
+    if (qf->dirty)
+        dirty_mark(qf->dirty, bitpos / 8, (bitpos + qf->elem_bits - 1) / 8);
+}
+
+/* Width-agnostic accessor for the paths that are not worth specializing. */
+static uint64_t get_elem(quotient_filter *qf, uint64_t idx)
+{
+    return get_elem_w(qf, idx, 0);
 }
 
 static inline uint64_t incr(quotient_filter *qf, uint64_t idx)
@@ -162,11 +363,11 @@ static inline uint64_t hash_to_remainder(quotient_filter *qf, uint64_t hash)
 }
 
 /* Find the start index of the run for fq (given that the run exists). */
-static uint64_t find_run_index(quotient_filter *qf, uint64_t fq)
+QF_KERNEL uint64_t find_run_index(quotient_filter *qf, uint64_t fq, int width)
 {
     /* Find the start of the cluster. */
     uint64_t b = fq;
-    while (is_shifted(get_elem(qf, b)))
+    while (is_shifted(get_elem_w(qf, b, width)))
         b = decr(qf, b);
 
     /* Find the start of the run for fq. */
@@ -174,23 +375,26 @@ static uint64_t find_run_index(quotient_filter *qf, uint64_t fq)
     while (b != fq) {
         do {
             s = incr(qf, s);
-        } while (is_continuation(get_elem(qf, s)));
+        } while (is_continuation(get_elem_w(qf, s, width)));
 
         do {
             b = incr(qf, b);
-        } while (!is_occupied(get_elem(qf, b)));
+        } while (!is_occupied(get_elem_w(qf, b, width)));
     }
     return s;
 }
 
 /* Insert elt into QF[s], shifting over elements as necessary. */
-static void insert_into(quotient_filter *qf, uint64_t s, uint64_t elt)
+QF_KERNEL void insert_into(quotient_filter *qf,
+                           uint64_t s,
+                           uint64_t elt,
+                           int width)
 {
     uint64_t curr = elt;
     bool empty;
 
     do {
-        uint64_t prev = get_elem(qf, s);
+        uint64_t prev = get_elem_w(qf, s, width);
         empty = is_empty_element(prev);
         if (!empty) {
             /* Fix up `is_shifted' and `is_occupied'. */
@@ -200,51 +404,49 @@ static void insert_into(quotient_filter *qf, uint64_t s, uint64_t elt)
                 prev = clr_occupied(prev);
             }
         }
-        set_elem(qf, s, curr);
+        set_elem_w(qf, s, curr, width);
         curr = prev;
         s = incr(qf, s);
     } while (!empty);
 }
 
-bool qf_insert(quotient_filter *qf, uint64_t hash)
+/* Put hash into its run. Returns false if it was already there.
+ * Leaves qf->entries alone, the callers account for it. */
+QF_KERNEL bool insert_entry_w(quotient_filter *qf, uint64_t hash, int width)
 {
-    if (qf->entries >= qf->max_size)
-        return false;
-
     uint64_t fq = hash_to_quotient(qf, hash);
     uint64_t fr = hash_to_remainder(qf, hash);
-    uint64_t T_fq = get_elem(qf, fq);
+    uint64_t T_fq = get_elem_w(qf, fq, width);
     uint64_t entry = (fr << 3) & ~7;
 
     /* Special-case filling canonical slots to simplify insert_into(). */
     if (is_empty_element(T_fq)) {
-        set_elem(qf, fq, set_occupied(entry));
-        ++qf->entries;
+        set_elem_w(qf, fq, set_occupied(entry), width);
         return true;
     }
 
     if (!is_occupied(T_fq))
-        set_elem(qf, fq, set_occupied(T_fq));
+        set_elem_w(qf, fq, set_occupied(T_fq), width);
 
-    uint64_t start = find_run_index(qf, fq);
+    uint64_t start = find_run_index(qf, fq, width);
     uint64_t s = start;
 
     if (is_occupied(T_fq)) {
         /* Move the cursor to the insert position in the fq run. */
         do {
-            uint64_t rem = get_remainder(get_elem(qf, s));
+            uint64_t rem = get_remainder(get_elem_w(qf, s, width));
             if (rem == fr) {
-                return true;
+                return false;
             } else if (rem > fr) {
                 break;
             }
             s = incr(qf, s);
-        } while (is_continuation(get_elem(qf, s)));
+        } while (is_continuation(get_elem_w(qf, s, width)));
 
         if (s == start) {
             /* The old start-of-run becomes a continuation. */
-            uint64_t old_head = get_elem(qf, start);
-            set_elem(qf, start, set_continuation(old_head));
+            uint64_t old_head = get_elem_w(qf, start, width);
+            set_elem_w(qf, start, set_continuation(old_head), width);
         } else {
             /* The new element becomes a continuation. */
             entry = set_continuation(entry);
@@ -255,48 +457,334 @@ bool qf_insert(quotient_filter *qf, uint64_t hash)
     if (s != fq)
         entry = set_shifted(entry);
 
-    insert_into(qf, s, entry);
+    insert_into(qf, s, entry, width);
+    return true;
+}
+
+QF_KERNEL bool insert_w(quotient_filter *qf, uint64_t hash, int width)
+{
+    if (qf->entries >= qf->max_size)
+        return false;
+
+    qf->entries += insert_entry_w(qf, hash, width);
+    return true;
+}
+
+/* Other threads change entries too, so claim room for hash up front and
+ * give it back if hash turns out to be a duplicate. */
+QF_KERNEL bool insert_locked_w(quotient_filter *qf, uint64_t hash, int width)
+{
+    if (__sync_fetch_and_add(&qf->entries, 1) >= qf->max_size) {
+        __sync_fetch_and_sub(&qf->entries, 1);
+        return false;
+    }
+
+    uint64_t regions[3];
+    int n = lock_home(qf, hash_to_quotient(qf, hash), regions);
+    bool added = insert_entry_w(qf, hash, width);
+    unlock_home(qf, regions, n);
+
+    if (!added)
+        __sync_fetch_and_sub(&qf->entries, 1);
+    return true;
+}
+
+bool qf_insert(quotient_filter *qf, uint64_t hash)
+{
+    if (qf->locks)
+        QF_DISPATCH(insert_locked_w, qf, hash);
+    QF_DISPATCH(insert_w, qf, hash);
+}
+
+void qf_builder_init(qf_builder *b)
+{
+    b->next = 0;
+    b->quot = 0;
+    b->rem = 0;
+    b->started = false;
+    b->wrapped = false;
+}
+
+/* Append hash to a QF that holds nothing but what the builder wrote.
+ * Returns false, and writes nothing, if the fingerprint would have to wrap
+ * around the end of the table; that needs shifting, so leave it and every
+ * later fingerprint to insert_w().
+ */
+QF_KERNEL bool builder_add(quotient_filter *qf,
+                           qf_builder *b,
+                           uint64_t hash,
+                           int width)
+{
+    uint64_t fq = hash_to_quotient(qf, hash);
+    uint64_t fr = hash_to_remainder(qf, hash);
+    uint64_t entry = fr << 3;
+    bool new_run = !b->started || fq != b->quot;
+    uint64_t s;
+
+    if (new_run) {
+        s = MAX(fq, b->next);
+    } else {
+        if (fr == b->rem)
+            return true;
+        s = b->next;
+        entry = set_continuation(entry);
+    }
+
+    if (s > qf->index_mask)
+        return false;
+
+    if (s != fq) {
+        entry = set_shifted(entry);
+        if (new_run) {
+            uint64_t T_fq = get_elem_w(qf, fq, width);
+            set_elem_w(qf, fq, set_occupied(T_fq), width);
+        }
+    } else {
+        entry = set_occupied(entry);
+    }
+    set_elem_w(qf, s, entry, width);
+
+    b->next = s + 1;
+    b->quot = fq;
+    b->rem = fr;
+    b->started = true;
     ++qf->entries;
     return true;
 }
 
-bool qf_may_contain(quotient_filter *qf, uint64_t hash)
+/* Append hash with builder_add(), or with insert_w() once the tail of the
+ * last cluster has wrapped around to the start of the table.
+ *
+ * Returns false if the QF is full.
+ */
+QF_KERNEL bool builder_append(quotient_filter *qf,
+                              qf_builder *b,
+                              uint64_t hash,
+                              int width)
+{
+    if (!b->wrapped) {
+        if (qf->entries >= qf->max_size)
+            return false;
+        b->wrapped = !builder_add(qf, b, hash, width);
+        if (!b->wrapped)
+            return true;
+    }
+    return insert_w(qf, hash, width);
+}
+
+bool qf_builder_append(quotient_filter *qf, qf_builder *b, uint64_t hash)
+{
+    QF_DISPATCH(builder_append, qf, b, hash);
+}
+
+QF_KERNEL bool insert_sorted_w(quotient_filter *qf,
+                               const uint64_t *hashes,
+                               size_t n,
+                               int width)
+{
+    qf_builder b;
+
+    qf_builder_init(&b);
+    for (size_t i = 0; i < n; ++i) {
+        if (!builder_append(qf, &b, hashes[i], width))
+            return false;
+    }
+    return true;
+}
+
+bool qf_insert_sorted(quotient_filter *qf, const uint64_t *hashes, size_t n)
+{
+    uint64_t mask = (qf->index_mask << qf->rbits) | qf->rmask;
+    for (size_t i = 1; i < n; ++i) {
+        if ((hashes[i] & mask) < (hashes[i - 1] & mask))
+            return false;
+    }
+
+    /* The builder can only lay out an empty table. */
+    if (qf->entries) {
+        for (size_t i = 0; i < n; ++i) {
+            if (!qf_insert(qf, hashes[i]))
+                return false;
+        }
+        return true;
+    }
+
+    QF_DISPATCH(insert_sorted_w, qf, hashes, n);
+}
+
+#ifdef QF_SIMD
+/* Scan the run starting at slot s for remainder fr, one 32-byte vector of
+ * 8, 16 or 32-bit slots at a time: the remainders of all lanes are compared
+ * at once, and the first lane without the continuation bit ends the run.
+ * Runs that reach the end of the table are finished one slot at a time.
+ */
+__attribute__((target("avx2"))) static bool run_contains_avx2(
+    quotient_filter *qf,
+    uint64_t s,
+    uint64_t fr,
+    int width)
+{
+    const uint64_t lanes = 256 / width;
+    const char *base = (const char *) qf->table;
+    __m256i target, meta, cont, zero = _mm256_setzero_si256();
+    switch (width) {
+    case 8:
+        target = _mm256_set1_epi8(fr << 3);
+        meta = _mm256_set1_epi8(7);
+        cont = _mm256_set1_epi8(2);
+        break;
+    case 16:
+        target = _mm256_set1_epi16(fr << 3);
+        meta = _mm256_set1_epi16(7);
+        cont = _mm256_set1_epi16(2);
+        break;
+    default:
+        target = _mm256_set1_epi32(fr << 3);
+        meta = _mm256_set1_epi32(7);
+        cont = _mm256_set1_epi32(2);
+    }
+
+    /* The run head has no continuation bit; don't take it for the end. */
+    uint32_t head = LOW_MASK(width / 8);
+    while (s + lanes <= qf->max_size) {
+        __m256i v =
+            _mm256_loadu_si256((const __m256i *) (base + s * width / 8));
+        __m256i rem = _mm256_andnot_si256(meta, v);
+        __m256i c = _mm256_and_si256(v, cont);
+        uint32_t hits, ends;
+        switch (width) {
+        case 8:
+            hits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(rem, target));
+            ends = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, zero));
+            break;
+        case 16:
+            hits = _mm256_movemask_epi8(_mm256_cmpeq_epi16(rem, target));
+            ends = _mm256_movemask_epi8(_mm256_cmpeq_epi16(c, zero));
+            break;
+        default:
+            hits = _mm256_movemask_epi8(_mm256_cmpeq_epi32(rem, target));
+            ends = _mm256_movemask_epi8(_mm256_cmpeq_epi32(c, zero));
+        }
+        ends &= ~head;
+        if (ends)
+            return hits & LOW_MASK(__builtin_ctz(ends));
+        if (hits)
+            return true;
+        s += lanes;
+        head = 0;
+    }
+
+    for (s &= qf->index_mask;; head = 0) {
+        uint64_t elt = get_elem_w(qf, s, width);
+        if (!head && !is_continuation(elt))
+            return false;
+        if (get_remainder(elt) == fr)
+            return true;
+        s = incr(qf, s);
+    }
+}
+#endif
+
+QF_KERNEL bool may_contain_w(quotient_filter *qf, uint64_t hash, int width)
 {
     uint64_t fq = hash_to_quotient(qf, hash);
     uint64_t fr = hash_to_remainder(qf, hash);
-    uint64_t T_fq = get_elem(qf, fq);
+    uint64_t T_fq = get_elem_w(qf, fq, width);
 
     /* If this quotient has no run, give up. */
     if (!is_occupied(T_fq))
         return false;
 
     /* Scan the sorted run for the target remainder. */
-    uint64_t s = find_run_index(qf, fq);
+    uint64_t s = find_run_index(qf, fq, width);
+#ifdef QF_SIMD
+    if (width && __builtin_cpu_supports("avx2"))
+        return run_contains_avx2(qf, s, fr, width);
+#endif
     do {
-        uint64_t rem = get_remainder(get_elem(qf, s));
+        uint64_t rem = get_remainder(get_elem_w(qf, s, width));
         if (rem == fr) {
             return true;
         } else if (rem > fr) {
             return false;
         }
         s = incr(qf, s);
-    } while (is_continuation(get_elem(qf, s)));
+    } while (is_continuation(get_elem_w(qf, s, width)));
     return false;
 }
 
+QF_KERNEL bool may_contain_locked_w(quotient_filter *qf,
+                                    uint64_t hash,
+                                    int width)
+{
+    uint64_t regions[3];
+    int n = lock_home(qf, hash_to_quotient(qf, hash), regions);
+    bool found = may_contain_w(qf, hash, width);
+    unlock_home(qf, regions, n);
+    return found;
+}
+
+bool qf_may_contain(quotient_filter *qf, uint64_t hash)
+{
+    if (qf->locks)
+        QF_DISPATCH(may_contain_locked_w, qf, hash);
+    QF_DISPATCH(may_contain_w, qf, hash);
+}
+
+/* Bring the home slot of hash into cache ahead of the lookup. */
+QF_KERNEL void prefetch_home(quotient_filter *qf, uint64_t hash, int width)
+{
+    uint64_t fq = hash_to_quotient(qf, hash);
+    uint64_t bitpos = (width ? width : qf->elem_bits) * fq;
+    __builtin_prefetch(&qf->table[bitpos / 64]);
+}
+
+QF_KERNEL size_t may_contain_batch_w(quotient_filter *qf,
+                                     const uint64_t *hashes,
+                                     size_t n,
+                                     bool *results,
+                                     int width)
+{
+    size_t ahead = MIN(n, QF_PREFETCH_WIDTH);
+    size_t found = 0;
+    for (size_t i = 0; i < ahead; ++i)
+        prefetch_home(qf, hashes[i], width);
+
+    /* Keep QF_PREFETCH_WIDTH home slots in flight while resolving runs. */
+    for (size_t i = 0; i < n; ++i) {
+        if (i + ahead < n)
+            prefetch_home(qf, hashes[i + ahead], width);
+        results[i] = qf->locks ? may_contain_locked_w(qf, hashes[i], width)
+                               : may_contain_w(qf, hashes[i], width);
+        found += results[i];
+    }
+    return found;
+}
+
+size_t qf_may_contain_batch(quotient_filter *qf,
+                            const uint64_t *hashes,
+                            size_t n,
+                            bool *results)
+{
+    QF_DISPATCH(may_contain_batch_w, qf, hashes, n, results);
+}
+
 /* Remove the entry in QF[s] and slide the rest of the cluster forward. */
-static void delete_entry(quotient_filter *qf, uint64_t s, uint64_t quot)
+QF_KERNEL void delete_entry(quotient_filter *qf,
+                            uint64_t s,
+                            uint64_t quot,
+                            int width)
 {
-    uint64_t curr = get_elem(qf, s);
+    uint64_t curr = get_elem_w(qf, s, width);
     uint64_t sp = incr(qf, s);
     uint64_t orig = s;
 
     while (1) {
-        uint64_t next = get_elem(qf, sp);
+        uint64_t next = get_elem_w(qf, sp, width);
         bool curr_occupied = is_occupied(curr);
 
         if (is_empty_element(next) || is_cluster_start(next) || sp == orig) {
-            set_elem(qf, s, 0);
+            set_elem_w(qf, s, 0, width);
             return;
         } else {
             /* Fix entries which slide into canonical slots. */
@@ -304,16 +792,17 @@ static void delete_entry(quotient_filter *qf, uint64_t s, uint64_t quot)
             if (is_run_start(next)) {
                 do {
                     quot = incr(qf, quot);
-                } while (!is_occupied(get_elem(qf, quot)));
+                } while (!is_occupied(get_elem_w(qf, quot, width)));
 
                 if (curr_occupied && quot == s) {
                     updated_next = clr_shifted(next);
                 }
             }
 
-            set_elem(qf, s,
-                     curr_occupied ? set_occupied(updated_next)
-                                   : clr_occupied(updated_next));
+            set_elem_w(qf, s,
+                       curr_occupied ? set_occupied(updated_next)
+                                     : clr_occupied(updated_next),
+                       width);
             s = sp;
             sp = incr(qf, sp);
             curr = next;
@@ -321,80 +810,367 @@ static void delete_entry(quotient_filter *qf, uint64_t s, uint64_t quot)
     }
 }
 
-bool qf_remove(quotient_filter *qf, uint64_t hash)
+/* Take hash out of its run. Returns false if it wasn't there.
+ * Leaves qf->entries alone, the callers account for it. */
+QF_KERNEL bool remove_entry_w(quotient_filter *qf, uint64_t hash, int width)
 {
-    uint64_t highbits = hash >> (qf->qbits + qf->rbits);
-    if (qf->qbits + qf->rbits < 64 && highbits)
-        return false;
-
     uint64_t fq = hash_to_quotient(qf, hash);
     uint64_t fr = hash_to_remainder(qf, hash);
-    uint64_t T_fq = get_elem(qf, fq);
+    uint64_t T_fq = get_elem_w(qf, fq, width);
 
-    if (!is_occupied(T_fq) || !qf->entries)
-        return true;
+    if (!is_occupied(T_fq))
+        return false;
 
-    uint64_t start = find_run_index(qf, fq);
+    uint64_t start = find_run_index(qf, fq, width);
     uint64_t s = start;
     uint64_t rem;
 
     /* Find the offending table index */
     do {
-        rem = get_remainder(get_elem(qf, s));
+        rem = get_remainder(get_elem_w(qf, s, width));
         if (rem == fr) {
             break;
         } else if (rem > fr) {
-            return true;
+            return false;
         }
         s = incr(qf, s);
-    } while (is_continuation(get_elem(qf, s)));
+    } while (is_continuation(get_elem_w(qf, s, width)));
     if (rem != fr) {
-        return true;
+        return false;
     }
 
-    uint64_t kill = (s == fq) ? T_fq : get_elem(qf, s);
+    uint64_t kill = (s == fq) ? T_fq : get_elem_w(qf, s, width);
     bool replace_run_start = is_run_start(kill);
 
     /* If we are deleting the last entry in a run, clear `is_occupied'. */
     if (is_run_start(kill)) {
-        uint64_t next = get_elem(qf, incr(qf, s));
+        uint64_t next = get_elem_w(qf, incr(qf, s), width);
         T_fq &= ~1ULL | (next & 2ULL) >> 1;
-        set_elem(qf, fq, T_fq);
+        set_elem_w(qf, fq, T_fq, width);
     }
 
-    delete_entry(qf, s, fq);
+    delete_entry(qf, s, fq, width);
 
     if (replace_run_start) {
-        uint64_t next = get_elem(qf, s);
+        uint64_t next = get_elem_w(qf, s, width);
         /* Clear continuation bit. */
         next &= ~2;
         if (s == fq && is_run_start(next)) {
             /* The new start is in the canonical slot. */
             next &= ~4;
         }
-        set_elem(qf, s, next);
+        set_elem_w(qf, s, next, width);
     }
 
-    --qf->entries;
     return true;
 }
 
+QF_KERNEL bool remove_w(quotient_filter *qf, uint64_t hash, int width)
+{
+    uint64_t highbits = hash >> (qf->qbits + qf->rbits);
+    if (qf->qbits + qf->rbits < 64 && highbits)
+        return false;
+
+    if (qf->entries)
+        qf->entries -= remove_entry_w(qf, hash, width);
+    return true;
+}
+
+QF_KERNEL bool remove_locked_w(quotient_filter *qf, uint64_t hash, int width)
+{
+    uint64_t highbits = hash >> (qf->qbits + qf->rbits);
+    if (qf->qbits + qf->rbits < 64 && highbits)
+        return false;
+
+    uint64_t regions[3];
+    int n = lock_home(qf, hash_to_quotient(qf, hash), regions);
+    bool removed = remove_entry_w(qf, hash, width);
+    unlock_home(qf, regions, n);
+
+    if (removed)
+        __sync_fetch_and_sub(&qf->entries, 1);
+    return true;
+}
+
+bool qf_remove(quotient_filter *qf, uint64_t hash)
+{
+    if (qf->locks)
+        QF_DISPATCH(remove_locked_w, qf, hash);
+    QF_DISPATCH(remove_w, qf, hash);
+}
+
+/* Rewrite the cluster that starts at slot c without the fingerprints listed
+ * in victims, which are sorted and cut down to q+r bits. Entries that stay
+ * move towards their home slots, and their bits are set as they are
+ * written; gaps that open up between runs split the cluster.
+ *
+ * Offsets below are relative to c, since the cluster may wrap around.
+ * Returns the length the cluster had, and adds the number of removed
+ * entries to *removed.
+ */
+QF_KERNEL uint64_t compact_cluster_w(quotient_filter *qf,
+                                     uint64_t c,
+                                     const uint64_t *victims,
+                                     size_t nvictims,
+                                     uint64_t *removed,
+                                     int width)
+{
+    uint64_t mask = qf->index_mask;
+    uint64_t rs = 0; /* next entry to read */
+    uint64_t wo = 0; /* next slot to write */
+    uint64_t qo = 0; /* home of the run being read */
+    uint64_t kept = 0;
+    uint64_t fq = c;
+    size_t lo = 0, hi = nvictims;
+
+    /* Find the first victim at or after the cluster start. */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (victims[mid] >> qf->rbits < c)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t j = lo;
+
+    for (; rs < qf->max_size; ++rs) {
+        uint64_t elt = get_elem_w(qf, (c + rs) & mask, width);
+        if (rs > 0 && (is_empty_element(elt) || is_cluster_start(elt)))
+            break;
+
+        if (rs > 0 && !is_continuation(elt)) {
+            /* The previous run is gone if nothing of it was kept. */
+            if (!kept) {
+                uint64_t home = (c + qo) & mask;
+                set_elem_w(qf, home, clr_occupied(get_elem_w(qf, home, width)),
+                           width);
+            }
+            do {
+                ++qo;
+            } while (!is_occupied(get_elem_w(qf, (c + qo) & mask, width)));
+            kept = 0;
+            uint64_t next_fq = (c + qo) & mask;
+            if (next_fq < fq)
+                j = 0;
+            fq = next_fq;
+        }
+
+        uint64_t hash = fq << qf->rbits | get_remainder(elt);
+        while (j < nvictims && victims[j] < hash)
+            ++j;
+        if (j < nvictims && victims[j] == hash) {
+            ++*removed;
+            continue;
+        }
+
+        uint64_t entry = get_remainder(elt) << 3;
+        if (kept) {
+            entry = set_shifted(set_continuation(entry));
+        } else {
+            /* Entries between the last run and this home have moved out. */
+            for (; wo < qo; ++wo)
+                set_elem_w(qf, (c + wo) & mask, 0, width);
+            if (wo != qo)
+                entry = set_shifted(entry);
+        }
+        /* The occupied bit belongs to the slot, not to the entry. */
+        uint64_t slot = (c + wo) & mask;
+        entry |= is_occupied(get_elem_w(qf, slot, width));
+        set_elem_w(qf, slot, entry, width);
+        ++wo;
+        ++kept;
+    }
+
+    if (!kept) {
+        uint64_t home = (c + qo) & mask;
+        set_elem_w(qf, home, clr_occupied(get_elem_w(qf, home, width)), width);
+    }
+    for (; wo < rs; ++wo)
+        set_elem_w(qf, (c + wo) & mask, 0, width);
+    return rs;
+}
+
+QF_KERNEL uint64_t remove_batch_w(quotient_filter *qf,
+                                  const uint64_t *victims,
+                                  size_t n,
+                                  int width)
+{
+    uint64_t removed = 0;
+    size_t i = 0;
+
+    while (i < n) {
+        uint64_t fq = victims[i] >> qf->rbits;
+        if (!is_occupied(get_elem_w(qf, fq, width))) {
+            ++i;
+            continue;
+        }
+
+        uint64_t c = fq;
+        while (is_shifted(get_elem_w(qf, c, width)))
+            c = decr(qf, c);
+        uint64_t len = compact_cluster_w(qf, c, victims, n, &removed, width);
+
+        /* Skip the victims whose home was in the cluster. */
+        while (i < n &&
+               (((victims[i] >> qf->rbits) - c) & qf->index_mask) < len)
+            ++i;
+    }
+    return removed;
+}
+
+/* qf_remove() for each hash, counting what was there. */
+QF_KERNEL size_t remove_each_w(quotient_filter *qf,
+                               const uint64_t *hashes,
+                               size_t n,
+                               int width)
+{
+    uint32_t fbits = qf->qbits + qf->rbits;
+    size_t removed = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (fbits < 64 && hashes[i] >> fbits)
+            continue;
+        if (qf->locks) {
+            uint64_t regions[3];
+            int nregions =
+                lock_home(qf, hash_to_quotient(qf, hashes[i]), regions);
+            bool gone = remove_entry_w(qf, hashes[i], width);
+            unlock_home(qf, regions, nregions);
+            if (gone) {
+                __sync_fetch_and_sub(&qf->entries, 1);
+                ++removed;
+            }
+        } else if (remove_entry_w(qf, hashes[i], width)) {
+            --qf->entries;
+            ++removed;
+        }
+    }
+    return removed;
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+size_t qf_remove_batch(quotient_filter *qf, const uint64_t *hashes, size_t n)
+{
+    uint32_t fbits = qf->qbits + qf->rbits;
+    uint64_t *victims = NULL;
+    size_t nvictims = 0;
+
+    /* Other threads may be working on the clusters in concurrent mode. */
+    if (!qf->locks)
+        victims = malloc(n * sizeof(uint64_t));
+    if (!victims)
+        QF_DISPATCH(remove_each_w, qf, hashes, n);
+
+    /* Drop what qf_remove() would refuse. */
+    for (size_t i = 0; i < n; ++i) {
+        if (fbits == 64 || !(hashes[i] >> fbits))
+            victims[nvictims++] = hashes[i];
+    }
+    qsort(victims, nvictims, sizeof(uint64_t), cmp_hash);
+
+    uint64_t removed;
+    switch (slot_width(qf)) {
+    case 8:
+        removed = remove_batch_w(qf, victims, nvictims, 8);
+        break;
+    case 16:
+        removed = remove_batch_w(qf, victims, nvictims, 16);
+        break;
+    case 32:
+        removed = remove_batch_w(qf, victims, nvictims, 32);
+        break;
+    default:
+        removed = remove_batch_w(qf, victims, nvictims, 0);
+    }
+    qf->entries -= removed;
+    free(victims);
+    return removed;
+}
+
 void qf_clear(quotient_filter *qf)
 {
+    size_t table_size = qf_table_size(qf->qbits, qf->rbits);
     qf->entries = 0;
-    memset(qf->table, 0, qf_table_size(qf->qbits, qf->rbits));
+    memset(qf->table, 0, table_size);
+    if (qf->dirty)
+        dirty_mark(qf->dirty, 0, table_size - 1);
 }
 
 size_t qf_table_size(uint32_t q, uint32_t r)
 {
-    size_t bits = (size_t)(1 << q) * (r + 3);
-    size_t bytes = bits / 8;
-    return (bits % 8) ? (bytes + 1) : bytes;
+    /* get_elem() reads whole words, so round up to one. */
+    size_t bits = ((size_t) 1 << q) * (r + 3);
+    size_t words = (bits + 63) / 64;
+    return words * sizeof(uint64_t);
 }
 
 void qf_destroy(quotient_filter *qf)
 {
-    free(qf->table);
+    munmap(qf->table, qf_table_size(qf->qbits, qf->rbits));
+    free((void *) qf->locks);
+}
+
+/* Return the first slot in [idx, end) that is not empty, or end. A table
+ * word of zeros holds only empty slots, so those are skipped a word at a time.
+ */
+QF_KERNEL uint64_t scan_nonempty_w(quotient_filter *qf,
+                                   uint64_t idx,
+                                   uint64_t end,
+                                   int width)
+{
+    uint64_t last = (end * qf->elem_bits + 63) / 64;
+    if (idx >= end)
+        return end;
+
+    if (width) {
+        /* The metadata bits of every slot in a word, tested all at once. */
+        const uint64_t meta = width == 8    ? 0x0707070707070707ULL
+                              : width == 16 ? 0x0007000700070007ULL
+                                            : 0x0000000700000007ULL;
+        uint64_t word = idx * width / 64;
+        uint64_t bits = qf->table[word] & meta & (~0ULL << (idx * width % 64));
+        while (!bits) {
+            if (++word >= last)
+                return end;
+            bits = qf->table[word] & meta;
+        }
+        idx = (word * 64 + __builtin_ctzll(bits)) / width;
+        return MIN(idx, end);
+    }
+
+    while (idx < end) {
+        uint64_t word = idx * qf->elem_bits / 64;
+        if (qf->table[word] == 0) {
+            do {
+                ++word;
+            } while (word < last && qf->table[word] == 0);
+            /* Only the slot straddling into `word' may be in use. */
+            uint64_t next = word * 64 / qf->elem_bits;
+            if (next > idx) {
+                idx = next;
+                continue;
+            }
+        }
+        if (!is_empty_element(get_elem_w(qf, idx, width)))
+            return idx;
+        ++idx;
+    }
+    return MIN(idx, end);
+}
+
+/* Find the first non-empty slot from idx on, wrapping around the table. The
+ * QF must not be empty. */
+QF_KERNEL uint64_t next_nonempty_w(quotient_filter *qf, uint64_t idx, int width)
+{
+    uint64_t next = scan_nonempty_w(qf, idx, qf->max_size, width);
+    if (next == qf->max_size)
+        next = scan_nonempty_w(qf, 0, idx, width);
+    return next;
 }
 
 void qfi_start(quotient_filter *qf, qf_iterator *i)
@@ -405,15 +1181,51 @@ void qfi_start(quotient_filter *qf, qf_iterator *i)
     if (qf->entries == 0)
         return;
 
-    /* Find the start of a cluster. */
-    uint64_t start;
-    for (start = 0; start < qf->max_size; ++start) {
-        if (is_cluster_start(get_elem(qf, start)))
-            break;
+    /* Find the start of a cluster: the first non-empty slot, unless a cluster
+     * wraps around into the beginning of the table. Then it's the first
+     * non-empty slot after that. */
+    uint64_t start = scan_nonempty_w(qf, 0, qf->max_size, 0);
+    while (start < qf->max_size && !is_cluster_start(get_elem(qf, start))) {
+        ++start;
+        if (start < qf->max_size && is_empty_element(get_elem(qf, start)))
+            start = scan_nonempty_w(qf, start, qf->max_size, 0);
     }
 
     i->visited = 0;
     i->index = start;
+
+    /* A cluster that wraps around the end of the table can hold runs of the
+     * smallest quotients right after its wrapped part. Start with the first
+     * of those runs so that fingerprints come out in ascending order.
+     */
+    if (!is_shifted(get_elem(qf, 0)))
+        return;
+
+    uint64_t s = qf->index_mask;
+    while (is_shifted(get_elem(qf, s)))
+        s = decr(qf, s);
+
+    uint64_t quot = s;
+    while (1) {
+        s = incr(qf, s);
+        uint64_t elt = get_elem(qf, s);
+        if (is_empty_element(elt) || is_cluster_start(elt))
+            return;
+        if (is_run_start(elt)) {
+            uint64_t next = quot;
+            do {
+                next = incr(qf, next);
+            } while (!is_occupied(get_elem(qf, next)));
+
+            if (next < quot) {
+                /* qfi_next() moves on to `next' from here. */
+                i->index = s;
+                i->quotient = quot;
+                return;
+            }
+            quot = next;
+        }
+    }
 }
 
 bool qfi_done(quotient_filter *qf, qf_iterator *i)
@@ -421,10 +1233,16 @@ bool qfi_done(quotient_filter *qf, qf_iterator *i)
     return qf->entries == i->visited;
 }
 
-uint64_t qfi_next(quotient_filter *qf, qf_iterator *i)
+QF_KERNEL uint64_t qfi_next_w(quotient_filter *qf, qf_iterator *i, int width)
 {
     while (!qfi_done(qf, i)) {
-        uint64_t elt = get_elem(qf, i->index);
+        uint64_t elt = get_elem_w(qf, i->index, width);
+
+        /* Jump over the gap to the next cluster. */
+        if (is_empty_element(elt)) {
+            i->index = next_nonempty_w(qf, i->index, width);
+            continue;
+        }
 
         /* Keep track of the current run. */
         if (is_cluster_start(elt)) {
@@ -434,31 +1252,69 @@ uint64_t qfi_next(quotient_filter *qf, qf_iterator *i)
                 uint64_t quot = i->quotient;
                 do {
                     quot = incr(qf, quot);
-                } while (!is_occupied(get_elem(qf, quot)));
+                } while (!is_occupied(get_elem_w(qf, quot, width)));
                 i->quotient = quot;
             }
         }
 
         i->index = incr(qf, i->index);
 
-        if (!is_empty_element(elt)) {
-            uint64_t quot = i->quotient;
-            uint64_t rem = get_remainder(elt);
-            uint64_t hash = (quot << qf->rbits) | rem;
-            ++i->visited;
-            return hash;
-        }
+        uint64_t hash = (i->quotient << qf->rbits) | get_remainder(elt);
+        ++i->visited;
+        return hash;
     }
 
     /* shall not reach here */
     abort();
 }
 
+uint64_t qfi_next(quotient_filter *qf, qf_iterator *i)
+{
+    QF_DISPATCH(qfi_next_w, qf, i);
+}
+
+/* Check if @lhs is a subset of @rhs by walking both in ascending order. Both
+ * filters have the same qbits and rbits.
+ */
+QF_KERNEL bool is_subsetof_w(quotient_filter *lhs,
+                             quotient_filter *rhs,
+                             int width)
+{
+    qf_iterator lqfi, rqfi;
+
+    /* Each fingerprint is stored once, so a subset can't have more. */
+    if (lhs->entries > rhs->entries)
+        return false;
+
+    qfi_start(lhs, &lqfi);
+    qfi_start(rhs, &rqfi);
+    while (!qfi_done(lhs, &lqfi)) {
+        uint64_t hash = qfi_next_w(lhs, &lqfi, width);
+        uint64_t rhash;
+        do {
+            if (qfi_done(rhs, &rqfi))
+                return false;
+            rhash = qfi_next_w(rhs, &rqfi, width);
+        } while (rhash < hash);
+        if (rhash != hash)
+            return false;
+    }
+
+    return true;
+}
+
 /* Check if @lhs is a subset of @rhs */
 bool qf_is_subsetof(quotient_filter *lhs, quotient_filter *rhs)
 {
     qf_iterator lqfi;
 
+    /* A merge-join reads both tables sequentially, but has to read all of
+     * rhs. When lhs is much smaller, a random probe per entry is cheaper.
+     */
+    if (lhs->qbits == rhs->qbits && lhs->rbits == rhs->rbits &&
+        lhs->entries >= rhs->entries / QF_SUBSET_PROBE_RATIO)
+        QF_DISPATCH(is_subsetof_w, lhs, rhs);
+
     qfi_start(lhs, &lqfi);
     while (!qfi_done(lhs, &lqfi)) {
         if (!qf_may_contain(rhs, qfi_next(lhs, &lqfi))) {
@@ -469,9 +1325,53 @@ bool qf_is_subsetof(quotient_filter *lhs, quotient_filter *rhs)
     return true;
 }
 
+/* Two-way merge of the fingerprints of qf1 and qf2, in ascending order,
+ * into the empty qf_out. All three filters have the same fingerprint size.
+ */
+QF_KERNEL void merge_w(quotient_filter *qf_out,
+                       quotient_filter *qf1,
+                       quotient_filter *qf2,
+                       int width)
+{
+    qf_iterator qfi1, qfi2;
+    qf_builder b;
+
+    qfi_start(qf1, &qfi1);
+    qfi_start(qf2, &qfi2);
+    bool has1 = !qfi_done(qf1, &qfi1);
+    bool has2 = !qfi_done(qf2, &qfi2);
+    uint64_t hash1 = has1 ? qfi_next(qf1, &qfi1) : 0;
+    uint64_t hash2 = has2 ? qfi_next(qf2, &qfi2) : 0;
+
+    qf_builder_init(&b);
+    while (has1 || has2) {
+        uint64_t hash;
+        if (!has2 || (has1 && hash1 <= hash2)) {
+            hash = hash1;
+            has1 = !qfi_done(qf1, &qfi1);
+            if (has1)
+                hash1 = qfi_next(qf1, &qfi1);
+        } else {
+            hash = hash2;
+            has2 = !qfi_done(qf2, &qfi2);
+            if (has2)
+                hash2 = qfi_next(qf2, &qfi2);
+        }
+
+        /* Common fingerprints come out back to back and the builder drops
+         * the second one. */
+        builder_append(qf_out, &b, hash, width);
+    }
+}
+
 /*
  * Initializes qf_out and copies over all elements from qf1 and qf2.
- * Caution: qf_out holds twice as many entries as either qf1 or qf2.
+ * qf_out gets one more quotient bit than the larger input, so that it holds
+ * both of them.
+ *
+ * When qf1 and qf2 keep fingerprints of the same size, qf_out keeps that
+ * size too and is written in a single sequential pass. Otherwise the
+ * fingerprints are re-inserted one by one into a QF with the larger r.
  *
  * Returns false on ENOMEM.
  */
@@ -481,8 +1381,30 @@ bool qf_merge(quotient_filter *qf_out,
 {
     qf_iterator qfi;
 
-    uint32_t q = MAX(qf1->qbits, qf2->qbits);
+    uint32_t q = MAX(qf1->qbits, qf2->qbits) + 1;
+    uint32_t fbits = qf1->qbits + qf1->rbits;
+    if (fbits == (uint32_t) (qf2->qbits + qf2->rbits) && fbits > q) {
+        if (!qf_init(qf_out, q, fbits - q))
+            return false;
+        switch (slot_width(qf_out)) {
+        case 8:
+            merge_w(qf_out, qf1, qf2, 8);
+            break;
+        case 16:
+            merge_w(qf_out, qf1, qf2, 16);
+            break;
+        case 32:
+            merge_w(qf_out, qf1, qf2, 32);
+            break;
+        default:
+            merge_w(qf_out, qf1, qf2, 0);
+        }
+        return true;
+    }
+
     uint32_t r = MAX(qf1->rbits, qf2->rbits);
+    if (q + r > 64)
+        r = 64 - q;
     if (!qf_init(qf_out, q, r)) {
         return false;
     }
@@ -500,6 +1422,706 @@ bool qf_merge(quotient_filter *qf_out,
     return true;
 }
 
+/* Merge-join of qf1 and qf2 into the empty qf_out, keeping the fingerprints
+ * found in both. All three filters have the same fingerprint size.
+ */
+QF_KERNEL void intersect_w(quotient_filter *qf_out,
+                           quotient_filter *qf1,
+                           quotient_filter *qf2,
+                           int width)
+{
+    qf_iterator qfi1, qfi2;
+    qf_builder b;
+
+    qfi_start(qf1, &qfi1);
+    qfi_start(qf2, &qfi2);
+    qf_builder_init(&b);
+    if (qfi_done(qf1, &qfi1) || qfi_done(qf2, &qfi2))
+        return;
+
+    uint64_t hash1 = qfi_next(qf1, &qfi1);
+    uint64_t hash2 = qfi_next(qf2, &qfi2);
+    for (;;) {
+        if (hash1 < hash2) {
+            if (qfi_done(qf1, &qfi1))
+                return;
+            hash1 = qfi_next(qf1, &qfi1);
+        } else if (hash2 < hash1) {
+            if (qfi_done(qf2, &qfi2))
+                return;
+            hash2 = qfi_next(qf2, &qfi2);
+        } else {
+            builder_append(qf_out, &b, hash1, width);
+            if (qfi_done(qf1, &qfi1) || qfi_done(qf2, &qfi2))
+                return;
+            hash1 = qfi_next(qf1, &qfi1);
+            hash2 = qfi_next(qf2, &qfi2);
+        }
+    }
+}
+
+/* Merge-join of qf1 and qf2 into the empty qf_out, keeping the fingerprints
+ * of qf1 that are not in qf2. All three filters have the same fingerprint
+ * size.
+ */
+QF_KERNEL void difference_w(quotient_filter *qf_out,
+                            quotient_filter *qf1,
+                            quotient_filter *qf2,
+                            int width)
+{
+    qf_iterator qfi1, qfi2;
+    qf_builder b;
+
+    qfi_start(qf1, &qfi1);
+    qfi_start(qf2, &qfi2);
+    qf_builder_init(&b);
+    bool has2 = !qfi_done(qf2, &qfi2);
+    uint64_t hash2 = has2 ? qfi_next(qf2, &qfi2) : 0;
+
+    while (!qfi_done(qf1, &qfi1)) {
+        uint64_t hash = qfi_next(qf1, &qfi1);
+        while (has2 && hash2 < hash) {
+            has2 = !qfi_done(qf2, &qfi2);
+            if (has2)
+                hash2 = qfi_next(qf2, &qfi2);
+        }
+        if (!has2 || hash2 != hash)
+            builder_append(qf_out, &b, hash, width);
+    }
+}
+
+/* Iterate qf1 into qf_out, keeping the fingerprints for which
+ * qf_may_contain(qf2) is @found. Only right if the fingerprints of qf2 are
+ * no longer than those of qf1, since qf2 only sees the low bits of each.
+ */
+static void probe_join(quotient_filter *qf_out,
+                       quotient_filter *qf1,
+                       quotient_filter *qf2,
+                       bool found)
+{
+    qf_iterator qfi;
+
+    qfi_start(qf1, &qfi);
+    while (!qfi_done(qf1, &qfi)) {
+        uint64_t hash = qfi_next(qf1, &qfi);
+        if (qf_may_contain(qf2, hash) == found)
+            qf_insert(qf_out, hash);
+    }
+}
+
+bool qf_intersect(quotient_filter *qf_out,
+                  quotient_filter *qf1,
+                  quotient_filter *qf2)
+{
+    uint32_t fbits1 = qf1->qbits + qf1->rbits;
+    uint32_t fbits2 = qf2->qbits + qf2->rbits;
+
+    if (fbits1 != fbits2) {
+        /* Walk the one with the longer fingerprints and probe the other. */
+        if (fbits1 < fbits2) {
+            quotient_filter *tmp = qf1;
+            qf1 = qf2;
+            qf2 = tmp;
+        }
+        if (!qf_init(qf_out, qf1->qbits, qf1->rbits))
+            return false;
+        probe_join(qf_out, qf1, qf2, true);
+        return true;
+    }
+
+    /* The result is no bigger than the smaller input. */
+    uint32_t q = MIN(qf1->qbits, qf2->qbits);
+    if (!qf_init(qf_out, q, fbits1 - q))
+        return false;
+    switch (slot_width(qf_out)) {
+    case 8:
+        intersect_w(qf_out, qf1, qf2, 8);
+        break;
+    case 16:
+        intersect_w(qf_out, qf1, qf2, 16);
+        break;
+    case 32:
+        intersect_w(qf_out, qf1, qf2, 32);
+        break;
+    default:
+        intersect_w(qf_out, qf1, qf2, 0);
+    }
+    return true;
+}
+
+bool qf_difference(quotient_filter *qf_out,
+                   quotient_filter *qf1,
+                   quotient_filter *qf2)
+{
+    uint32_t fbits1 = qf1->qbits + qf1->rbits;
+    uint32_t fbits2 = qf2->qbits + qf2->rbits;
+    quotient_filter shorter;
+
+    if (!qf_init(qf_out, qf1->qbits, qf1->rbits))
+        return false;
+    if (fbits1 > fbits2) {
+        probe_join(qf_out, qf1, qf2, false);
+        return true;
+    }
+
+    /* Cut the fingerprints of qf2 down to those of qf1, then join. */
+    if (fbits1 < fbits2) {
+        qf_iterator qfi;
+        if (!qf_init(&shorter, qf1->qbits, qf1->rbits)) {
+            qf_destroy(qf_out);
+            return false;
+        }
+        qfi_start(qf2, &qfi);
+        while (!qfi_done(qf2, &qfi)) {
+            if (!qf_insert(&shorter, qfi_next(qf2, &qfi))) {
+                qf_destroy(&shorter);
+                qf_destroy(qf_out);
+                return false;
+            }
+        }
+        qf2 = &shorter;
+    }
+
+    switch (slot_width(qf_out)) {
+    case 8:
+        difference_w(qf_out, qf1, qf2, 8);
+        break;
+    case 16:
+        difference_w(qf_out, qf1, qf2, 16);
+        break;
+    case 32:
+        difference_w(qf_out, qf1, qf2, 32);
+        break;
+    default:
+        difference_w(qf_out, qf1, qf2, 0);
+    }
+    if (fbits1 < fbits2)
+        qf_destroy(&shorter);
+    return true;
+}
+
+/* Copy the fingerprints of qf, in ascending order, into the empty qf_out.
+ * Both filters have the same fingerprint size. */
+QF_KERNEL void copy_w(quotient_filter *qf_out, quotient_filter *qf, int width)
+{
+    qf_iterator qfi;
+    qf_builder b;
+
+    qf_builder_init(&b);
+    qfi_start(qf, &qfi);
+    while (!qfi_done(qf, &qfi))
+        builder_append(qf_out, &b, qfi_next(qf, &qfi), width);
+}
+
+bool qf_expand(quotient_filter *qf)
+{
+    quotient_filter bigger;
+
+    if (qf->rbits < 2 || !qf_init(&bigger, qf->qbits + 1, qf->rbits - 1))
+        return false;
+    if (qf->locks && !qf_set_concurrent(&bigger, true)) {
+        qf_destroy(&bigger);
+        return false;
+    }
+
+    switch (bigger.elem_bits) {
+    case 8:
+        copy_w(&bigger, qf, 8);
+        break;
+    case 16:
+        copy_w(&bigger, qf, 16);
+        break;
+    case 32:
+        copy_w(&bigger, qf, 32);
+        break;
+    default:
+        copy_w(&bigger, qf, 0);
+    }
+
+    qf_destroy(qf);
+    *qf = bigger;
+    return true;
+}
+
+/* Fingerprints read from the old table but not written to the new one. */
+struct fp_queue {
+    uint64_t *fps;
+    size_t head, len, cap;
+};
+
+static void fp_push(struct fp_queue *queue, uint64_t fp)
+{
+    assert(queue->len < queue->cap);
+    queue->fps[(queue->head + queue->len++) % queue->cap] = fp;
+}
+
+static uint64_t fp_pop(struct fp_queue *queue)
+{
+    uint64_t fp = queue->fps[queue->head];
+    queue->head = (queue->head + 1) % queue->cap;
+    --queue->len;
+    return fp;
+}
+
+/* Slot of the old table where the fingerprint qfi_next() returns next
+ * starts to be read: the home slot of its run, unless that wraps around. */
+static uint64_t fp_read_slot(const qf_iterator *qfi)
+{
+    return qfi->quotient <= qfi->index ? qfi->quotient : 0;
+}
+
+/* Byte of the new table after the word that holds slot s, where s is the
+ * slot the builder writes next; qf_expand_in_place() reads everything
+ * before it first. */
+static size_t fp_read_end(const quotient_filter *old,
+                          uint64_t s,
+                          bool wrapped,
+                          size_t new_size)
+{
+    if (wrapped || s > LOW_MASK(old->qbits + 1))
+        return new_size;
+    return ((s + 1) * (old->elem_bits - 1) + 63) / 64 * 8;
+}
+
+/* The most fingerprints qf_expand_in_place() holds in its queue at once.
+ * Runs its loop without writing anything: the builder only places
+ * distinct fingerprints one after the other, so its position is known
+ * from the fingerprints alone.
+ */
+static size_t fp_queue_size(quotient_filter *old,
+                            const qf_iterator *start,
+                            const uint64_t *tail,
+                            uint64_t ntail,
+                            size_t delta,
+                            size_t new_size)
+{
+    qf_iterator reader = *start, writer = *start;
+    uint64_t nread = 0, nmain = old->entries - ntail, next = 0;
+    unsigned shift = old->rbits - 1;
+    uint64_t mask = LOW_MASK(old->qbits + 1);
+    bool wrapped = false;
+    size_t size = 1;
+
+    for (uint64_t i = 0; i < old->entries; ++i) {
+        if (nread == i) {
+            if (nread < nmain)
+                qfi_next(old, &reader);
+            ++nread;
+        }
+
+        uint64_t fp = i < nmain ? qfi_next(old, &writer) : tail[i - nmain];
+        uint64_t s = MAX((fp >> shift) & mask, next);
+        size_t end = fp_read_end(old, s, wrapped, new_size);
+        while (nread < nmain) {
+            if (delta + fp_read_slot(&reader) * old->elem_bits / 64 * 8 >= end)
+                break;
+            qfi_next(old, &reader);
+            ++nread;
+        }
+        size = MAX(size, nread - i);
+
+        if (s > mask)
+            wrapped = true;
+        else if (!wrapped)
+            next = s + 1;
+    }
+    return size;
+}
+
+bool qf_expand_in_place(quotient_filter *qf)
+{
+    quotient_filter old = *qf, sizing = *qf;
+    size_t old_size = qf_table_size(qf->qbits, qf->rbits);
+    size_t new_size = qf_table_size(qf->qbits + 1, qf->rbits - 1);
+    size_t delta = new_size - old_size;
+    qf_iterator qfi;
+    uint64_t *tail = NULL;
+    uint64_t ntail = 0;
+
+    if (qf->rbits < 2)
+        return false;
+    sizing.max_size = 2 * qf->max_size;
+    sizing.locks = NULL;
+    if (qf->locks && !qf_set_concurrent(&sizing, true))
+        return false;
+
+    /* A cluster that wraps around the end of the table is read last, so
+     * its wrapped part at the start of the table would be overwritten by
+     * then. Decode it up front, from the start of the cluster at the end.
+     */
+    qfi_start(&old, &qfi);
+    if (old.entries && is_shifted(get_elem(&old, 0))) {
+        while (ntail < qfi.index && !is_empty_element(get_elem(&old, ntail)))
+            ++ntail;
+        tail = malloc(ntail * sizeof(*tail));
+        if (!tail) {
+            free((void *) sizing.locks);
+            return false;
+        }
+        qf_iterator wrapped = {old.index_mask, old.index_mask, 0};
+        while (is_shifted(get_elem(&old, wrapped.index)))
+            wrapped.index = wrapped.quotient = decr(&old, wrapped.index);
+        for (uint64_t i = wrapped.index; i < old.max_size; ++i)
+            qfi_next(&old, &wrapped);
+        for (uint64_t i = 0; i < ntail; ++i)
+            tail[i] = qfi_next(&old, &wrapped);
+    }
+
+    /* Whatever the builder has to wait for is read ahead into the queue,
+     * which cannot grow once the old table starts being overwritten. */
+    struct fp_queue queue = {NULL, 0, 0, 0};
+    queue.cap = fp_queue_size(&old, &qfi, tail, ntail, delta, new_size);
+    queue.fps = malloc(queue.cap * sizeof(*queue.fps));
+    if (!queue.fps) {
+        free(tail);
+        free((void *) sizing.locks);
+        return false;
+    }
+
+    /* Move the old table to the end of the new one and build the new one
+     * from the start, reading ahead of what is written. */
+    old.table = (uint64_t *) ((char *) qf->table + delta);
+    memmove(old.table, qf->table, old_size);
+    memset(qf->table, 0, delta);
+
+    qf->qbits++;
+    qf->rbits--;
+    qf->elem_bits--;
+    qf->index_mask = LOW_MASK(qf->qbits);
+    qf->rmask = LOW_MASK(qf->rbits);
+    qf->elem_mask = LOW_MASK(qf->elem_bits);
+    qf->max_size *= 2;
+    qf->entries = 0;
+    qf->locks = NULL;
+
+    uint64_t nread = 0, nmain = old.entries - ntail;
+    size_t zeroed = delta;
+    qf_builder b;
+
+    qf_builder_init(&b);
+    for (uint64_t i = 0; i < old.entries; ++i) {
+        if (!queue.len) {
+            fp_push(&queue, nread < nmain ? qfi_next(&old, &qfi)
+                                          : tail[nread - nmain]);
+            ++nread;
+        }
+
+        /* Everything up to the word that holds the slot written next must
+         * be read before it is cleared; once the last cluster wraps,
+         * insert_w() may shift slots anywhere. */
+        uint64_t s = MAX(hash_to_quotient(qf, queue.fps[queue.head]), b.next);
+        size_t end = fp_read_end(&old, s, b.wrapped, new_size);
+        while (nread < nmain) {
+            if (delta + fp_read_slot(&qfi) * old.elem_bits / 64 * 8 >= end)
+                break;
+            fp_push(&queue, qfi_next(&old, &qfi));
+            ++nread;
+        }
+        if (end > zeroed) {
+            memset((char *) qf->table + zeroed, 0, end - zeroed);
+            zeroed = end;
+        }
+
+        qf_builder_append(qf, &b, fp_pop(&queue));
+    }
+    memset((char *) qf->table + zeroed, 0, new_size - zeroed);
+
+    free(queue.fps);
+    free(tail);
+    free((void *) old.locks);
+    qf->locks = sizing.locks;
+    qf->nlocks = sizing.nlocks;
+    return true;
+}
+
+struct verify_task {
+    quotient_filter *qf;
+    uint64_t begin, end;
+    qf_verify_report report;
+    pthread_t thread;
+    bool spawned;
+};
+
+static void verify_error(qf_verify_report *report,
+                         uint64_t slot,
+                         const char *error)
+{
+    if (!report->errors++ || slot < report->error_slot) {
+        report->error_slot = slot;
+        report->error = error;
+    }
+}
+
+/* Check the cluster starting at slot c: each run belongs to the next
+ * occupied home slot of the cluster, has its remainders in ascending order,
+ * and has the shifted bit set exactly where it's not in its home slot.
+ * Returns the slot right after the cluster.
+ */
+QF_KERNEL uint64_t verify_cluster_w(quotient_filter *qf,
+                                uint64_t c,
+                                qf_verify_report *report,
+                                int width)
+{
+    uint64_t s = c, quot = c;
+    uint64_t occupieds = 0, runs = 0, prev_rem = 0;
+    uint64_t elt = get_elem_w(qf, s, width);
+
+    ++report->clusters;
+    do {
+        uint64_t rem = get_remainder(elt);
+        uint64_t meta = elt & 7;
+        if (meta == 2 || meta == 3)
+            verify_error(report, s, "continuation of an unshifted run");
+
+        if (!is_continuation(elt)) {
+            if (runs) {
+                /* The home of this run is the next occupied slot. */
+                do {
+                    quot = incr(qf, quot);
+                } while (quot != s &&
+                         !is_occupied(get_elem_w(qf, quot, width)));
+                if (!is_occupied(get_elem_w(qf, quot, width)))
+                    verify_error(report, s, "run without an occupied slot");
+            }
+            ++runs;
+        } else if (rem <= prev_rem) {
+            verify_error(report, s, "remainders out of order in a run");
+        }
+        if (!is_shifted(elt) != (s == quot))
+            verify_error(report, s, "wrong shifted bit");
+
+        occupieds += is_occupied(elt);
+        prev_rem = rem;
+        ++report->entries;
+        s = incr(qf, s);
+        elt = get_elem_w(qf, s, width);
+    } while (s != c && !is_empty_element(elt) && !is_cluster_start(elt));
+
+    if (occupieds != runs)
+        verify_error(report, c, "occupied slots don't match the runs");
+    report->runs += runs;
+    return s;
+}
+
+/* Check the slots of [begin, end) and the clusters that start there. The
+ * other slots of those clusters may lie beyond end. */
+QF_KERNEL void verify_range_w(quotient_filter *qf,
+                              uint64_t begin,
+                              uint64_t end,
+                              qf_verify_report *report,
+                              int width)
+{
+    uint64_t prev = get_elem_w(qf, decr(qf, begin), width);
+    for (uint64_t s = begin; s < end; ++s) {
+        uint64_t elt = get_elem_w(qf, s, width);
+        if (is_empty_element(elt)) {
+            if (elt)
+                verify_error(report, s, "empty slot with a remainder");
+        } else if (is_cluster_start(elt)) {
+            /* Carry on after the cluster, unless it wraps around. */
+            uint64_t next = verify_cluster_w(qf, s, report, width);
+            if (next <= s)
+                break;
+            s = next - 1;
+            elt = get_elem_w(qf, s, width);
+        } else if (is_empty_element(prev)) {
+            verify_error(report, s, "shifted slot after an empty one");
+        }
+        prev = elt;
+    }
+}
+
+static void *verify_range(void *arg)
+{
+    struct verify_task *task = arg;
+    quotient_filter *qf = task->qf;
+
+    switch (slot_width(qf)) {
+    case 8:
+        verify_range_w(qf, task->begin, task->end, &task->report, 8);
+        break;
+    case 16:
+        verify_range_w(qf, task->begin, task->end, &task->report, 16);
+        break;
+    case 32:
+        verify_range_w(qf, task->begin, task->end, &task->report, 32);
+        break;
+    default:
+        verify_range_w(qf, task->begin, task->end, &task->report, 0);
+    }
+    return NULL;
+}
+
+bool qf_verify(quotient_filter *qf, int nthreads, qf_verify_report *report)
+{
+    qf_verify_report total = {0};
+    if (nthreads < 1)
+        nthreads = 1;
+    nthreads = MIN((uint64_t) nthreads, qf->max_size);
+    struct verify_task *tasks = calloc(nthreads, sizeof(*tasks));
+    if (!tasks)
+        return false;
+
+    for (int t = 0; t < nthreads; ++t) {
+        tasks[t].qf = qf;
+        tasks[t].begin = qf->max_size * t / nthreads;
+        tasks[t].end = qf->max_size * (t + 1) / nthreads;
+    }
+    /* Ranges that don't get a thread of their own are checked right here. */
+    for (int t = 1; t < nthreads; ++t) {
+        tasks[t].spawned = !pthread_create(&tasks[t].thread, NULL,
+                                           verify_range, &tasks[t]);
+    }
+    for (int t = 0; t < nthreads; ++t) {
+        if (!tasks[t].spawned)
+            verify_range(&tasks[t]);
+    }
+
+    for (int t = 0; t < nthreads; ++t) {
+        qf_verify_report *r = &tasks[t].report;
+        if (tasks[t].spawned)
+            pthread_join(tasks[t].thread, NULL);
+        total.entries += r->entries;
+        total.clusters += r->clusters;
+        total.runs += r->runs;
+        if (r->errors && (!total.errors || r->error_slot < total.error_slot)) {
+            total.error_slot = r->error_slot;
+            total.error = r->error;
+        }
+        total.errors += r->errors;
+    }
+    free(tasks);
+
+    if (total.entries != qf->entries)
+        verify_error(&total, qf->max_size, "entries doesn't match the table");
+    if (report)
+        *report = total;
+    return total.errors == 0;
+}
+
+static inline int stats_bucket(uint64_t n)
+{
+    return n ? 64 - __builtin_clzll(n) : 0;
+}
+
+/* Probe costs summed over the entries and over the runs of the QF. */
+struct stats_sums {
+    uint64_t shift;
+    uint64_t hit_probes;
+    uint64_t miss_probes;
+};
+
+/* Add the cluster starting at slot c to stats. Offsets are relative to c,
+ * since the cluster may wrap around. Returns the slot right after the
+ * cluster.
+ */
+QF_KERNEL uint64_t stats_cluster_w(quotient_filter *qf,
+                                   uint64_t c,
+                                   qf_stats_report *stats,
+                                   struct stats_sums *sums,
+                                   int width)
+{
+    uint64_t mask = qf->index_mask;
+    uint64_t off = 0, qoff = 0, run_start = 0;
+
+    for (;;) {
+        uint64_t shift = off - qoff;
+        ++stats->shift[stats_bucket(shift)];
+        stats->max_shift = MAX(stats->max_shift, shift);
+        sums->shift += shift;
+        /* Back from the home to c, then forward to this entry. */
+        sums->hit_probes += 1 + qoff + off;
+
+        uint64_t next = get_elem_w(qf, (c + off + 1) & mask, width);
+        bool cluster_end = off + 1 == qf->max_size ||
+                           is_empty_element(next) || is_cluster_start(next);
+        if (cluster_end || !is_continuation(next)) {
+            uint64_t len = off + 1 - run_start;
+            ++stats->runs;
+            ++stats->run_length[stats_bucket(len)];
+            stats->max_run_length = MAX(stats->max_run_length, len);
+            /* Count a miss as reading through the whole run. */
+            sums->miss_probes += 1 + qoff + off;
+            if (!cluster_end) {
+                do {
+                    ++qoff;
+                } while (
+                    !is_occupied(get_elem_w(qf, (c + qoff) & mask, width)));
+                run_start = off + 1;
+            }
+        }
+        ++stats->entries;
+        ++off;
+        if (cluster_end)
+            break;
+    }
+
+    ++stats->clusters;
+    ++stats->cluster_length[stats_bucket(off)];
+    stats->max_cluster_length = MAX(stats->max_cluster_length, off);
+    return (c + off) & mask;
+}
+
+QF_KERNEL void stats_w(quotient_filter *qf,
+                       qf_stats_report *stats,
+                       struct stats_sums *sums,
+                       int width)
+{
+    for (uint64_t s = 0; s < qf->max_size; ++s) {
+        if (is_cluster_start(get_elem_w(qf, s, width))) {
+            /* Carry on after the cluster, unless it wraps around. */
+            uint64_t next = stats_cluster_w(qf, s, stats, sums, width);
+            if (next <= s)
+                break;
+            s = next - 1;
+        }
+    }
+}
+
+void qf_stats(quotient_filter *qf, qf_stats_report *stats)
+{
+    struct stats_sums sums = {0};
+
+    memset(stats, 0, sizeof(*stats));
+    switch (slot_width(qf)) {
+    case 8:
+        stats_w(qf, stats, &sums, 8);
+        break;
+    case 16:
+        stats_w(qf, stats, &sums, 16);
+        break;
+    case 32:
+        stats_w(qf, stats, &sums, 32);
+        break;
+    default:
+        stats_w(qf, stats, &sums, 0);
+    }
+
+    /* With a uniform hash, entries end up as far from home as in linear
+     * probing, a / (2 (1 - a)) on average, and the walk between the start
+     * of the cluster and the home slot takes (a / (1 - a))^2 slots there and
+     * back. A miss only walks if its home is occupied, which is the case for
+     * 1 - e^-a of the slots.
+     */
+    double a = (double) stats->entries / qf->max_size;
+    stats->load_factor = a;
+    if (a < 1) {
+        double walk = a / (1 - a) * a / (1 - a) + a / (2 * (1 - a));
+        stats->expected_hit_probes = 1 + walk;
+        stats->expected_miss_probes = 1 + (1 - exp(-a)) * walk;
+    } else {
+        stats->expected_hit_probes = stats->expected_miss_probes = INFINITY;
+    }
+    if (stats->entries) {
+        stats->mean_shift = (double) sums.shift / stats->entries;
+        stats->observed_hit_probes = (double) sums.hit_probes / stats->entries;
+    }
+    /* A miss whose home is not occupied only reads the home slot. */
+    stats->observed_miss_probes =
+        (double) (sums.miss_probes + qf->max_size - stats->runs) /
+        qf->max_size;
+}
+
 bool qf_is_consistent(quotient_filter *qf)
 {
     // Make sure all the properties of quotient_filter exist (non-zero)
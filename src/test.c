@@ -1,11 +1,19 @@
 #include <openssl/rand.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "gqf.h"
 #include "gqf_file.h"
 #include "gqf_int.h"
+#include "quotient-filter-blocked.h"
+#include "quotient-filter-convert.h"
 #include "quotient-filter-file.h"
+#include "quotient-filter-int.h"
 #include "quotient-filter.h"
 
 
@@ -54,6 +62,22 @@ void qf_test()
         abort();
     }
 
+    // Test batched lookup
+    printf("Testing QF with %lu batched lookup ", nkeys);
+    bool *found = calloc(nkeys, sizeof(bool));
+    if (qf_may_contain_batch(&qf, keys, nkeys, found) != nkeys) {
+        fprintf(stderr, "QF failed to batch lookup inserted keys.\n");
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!found[i]) {
+            fprintf(stderr, "QF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    free(found);
+    printf("validated\n");
+
     // Test remove
     printf("Testing QF with %lu removal of inserted elements ", nkeys);
     for (uint64_t i = 0; i < nkeys; i++) {
@@ -65,56 +89,1464 @@ void qf_test()
         if (i % 10000000 == 0)
             printf(".");
     }
-    printf(" validated\n");
+    printf(" validated\n");
+    qf_destroy(&qf);
+
+    printf("\n");
+
+    // Test sequential insert & lookup
+    q = 16;
+    r = 64 - q;
+    nkeys = (3 * (1 << q) / 4);
+    qf_init(&qf, q, r);
+    printf("Testing QF with %lu sequential insertion and lookup ", nkeys);
+    uint64_t key = rand64();
+    for (uint32_t i = 0; i < nkeys; i++) {
+        if (!qf_insert(&qf, key + i)) {
+            fprintf(stderr, "QF failed to insert for key: %lx.\n", key + i);
+            abort();
+        }
+        if (!qf_may_contain(&qf, key + i)) {
+            fprintf(stderr, "QF failed to lookup for key: %lx.\n", key + i);
+            abort();
+        }
+
+        if (i % 2000 == 0)
+            printf(".");
+    }
+    printf(" validated\n");
+
+    // Check QF consistency
+    if (qf_is_consistent(&qf)) {
+        printf("QF is consistent.\n");
+    } else {
+        printf("QF consistency check failed.\n");
+        abort();
+    }
+
+    // Test sequential remove
+    printf("Testing QF with %lu removal of inserted elements ", nkeys);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!qf_remove(&qf, key + i)) {
+            fprintf(stderr, "QF failed to remove for key: %lx.\n", keys[i]);
+            abort();
+        }
+
+        if (i % 2000 == 0)
+            printf(".");
+    }
+    printf(" validated\n");
+    qf_destroy(&qf);
+
+    free(keys);
+}
+
+void qf_width_test()
+{
+    quotient_filter qf;
+
+    // Slot widths of 8, 16 and 32 bits run specialized kernels
+    uint32_t q = 16;
+    uint32_t rs[] = {5, 13, 29};
+    uint64_t nkeys = (3 * (1 << q) / 4);
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    for (int w = 0; w < 3; w++) {
+        uint32_t r = rs[w];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        qf_init(&qf, q, r);
+        printf("Testing QF of %u-bit slots with %lu insertion and removal ",
+               r + 3, nkeys);
+        for (uint64_t i = 0; i < nkeys; i++) {
+            keys[i] = rand64() & mask;
+            if (!qf_insert(&qf, keys[i]) || !qf_may_contain(&qf, keys[i])) {
+                fprintf(stderr, "QF failed to insert for key: %lx.\n",
+                        keys[i]);
+                abort();
+            }
+        }
+        if (!qf_is_consistent(&qf)) {
+            printf("QF consistency check failed.\n");
+            abort();
+        }
+        for (uint64_t i = 0; i < nkeys; i++) {
+            if (!qf_remove(&qf, keys[i])) {
+                fprintf(stderr, "QF failed to remove for key: %lx.\n",
+                        keys[i]);
+                abort();
+            }
+        }
+        if (qf.entries || !qf_is_consistent(&qf)) {
+            printf("QF is not empty after removal.\n");
+            abort();
+        }
+        printf("validated\n");
+        qf_destroy(&qf);
+    }
+
+    free(keys);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void qf_sorted_test()
+{
+    quotient_filter qf, expected;
+
+    // Bulk-load sorted keys and compare with one-by-one insertion
+    uint32_t q = 20;
+    uint32_t rs[] = {5, 12};
+    uint64_t nkeys = (3 * (1 << q) / 4);
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    for (int t = 0; t < 4; t++) {
+        uint32_t r = rs[t % 2];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        uint64_t n = nkeys;
+        // The last rounds crowd the top of the table so that the last
+        // cluster wraps around.
+        if (t >= 2) {
+            n = (1 << q) / 64;
+            mask >>= 7;
+        }
+        RAND_bytes((unsigned char *) keys, sizeof(*keys) * n);
+        for (uint64_t i = 0; i < n; i++)
+            keys[i] = (keys[i] & mask) | (~mask & ((1ULL << (q + r)) - 1));
+        qsort(keys, n, sizeof(uint64_t), cmp_u64);
+
+        qf_init(&qf, q, r);
+        qf_init(&expected, q, r);
+        printf("Testing QF with %lu sorted insertion (r = %u) ", n, r);
+        for (uint64_t i = 0; i < n; i++)
+            qf_insert(&expected, keys[i]);
+        if (!qf_insert_sorted(&qf, keys, n)) {
+            fprintf(stderr, "QF failed sorted insertion.\n");
+            abort();
+        }
+        if (qf.entries != expected.entries ||
+            memcmp(qf.table, expected.table, qf_table_size(q, r))) {
+            fprintf(stderr, "QF sorted insertion built a different table.\n");
+            abort();
+        }
+        if (!qf_is_consistent(&qf)) {
+            printf("QF consistency check failed.\n");
+            abort();
+        }
+        printf("validated\n");
+        qf_destroy(&qf);
+        qf_destroy(&expected);
+    }
+
+    // Unsorted input is rejected
+    qf_init(&qf, q, 12);
+    uint64_t unsorted[] = {2, 1};
+    if (qf_insert_sorted(&qf, unsorted, 2) || qf.entries) {
+        fprintf(stderr, "QF sorted insertion accepted unsorted keys.\n");
+        abort();
+    }
+    qf_destroy(&qf);
+
+    free(keys);
+}
+
+void qf_merge_test()
+{
+    quotient_filter qf1, qf2, merged, expected;
+
+    // Merge two filters with the same fingerprint size and compare with a
+    // filter built from the union of their keys
+    uint32_t q = 18;
+    uint32_t r = 14;
+    uint64_t mask = (1ULL << (q + r)) - 1;
+    uint64_t nkeys = (3 * (1 << q) / 4);
+    uint64_t *keys = calloc(2 * nkeys, sizeof(uint64_t));
+    for (int t = 0; t < 2; t++) {
+        uint64_t n = nkeys;
+        uint64_t top = 0;
+        // The second round crowds the top of the tables so that the last
+        // clusters wrap around.
+        if (t == 1) {
+            n = (1 << q) / 64;
+            top = mask & ~(mask >> 7);
+        }
+        RAND_bytes((unsigned char *) keys, sizeof(*keys) * 2 * n);
+        for (uint64_t i = 0; i < 2 * n; i++)
+            keys[i] = (keys[i] & (mask >> (t ? 7 : 0))) | top;
+        // Share a tenth of the keys between both filters.
+        for (uint64_t i = 0; i < n / 10; i++)
+            keys[n + i] = keys[i];
+
+        qf_init(&qf1, q, r);
+        qf_init(&qf2, q + 1, r - 1);
+        for (uint64_t i = 0; i < n; i++) {
+            qf_insert(&qf1, keys[i]);
+            qf_insert(&qf2, keys[n + i]);
+        }
+        printf("Testing QF merge of %lu and %lu entries ", qf1.entries,
+               qf2.entries);
+        if (!qf_merge(&merged, &qf1, &qf2)) {
+            fprintf(stderr, "QF failed to merge.\n");
+            abort();
+        }
+        qsort(keys, 2 * n, sizeof(uint64_t), cmp_u64);
+        qf_init(&expected, q + 2, r - 2);
+        qf_insert_sorted(&expected, keys, 2 * n);
+        if (merged.qbits != q + 2 || merged.rbits != r - 2 ||
+            merged.entries != expected.entries ||
+            memcmp(merged.table, expected.table, qf_table_size(q + 2, r - 2))) {
+            fprintf(stderr, "QF merge built a different table.\n");
+            abort();
+        }
+        printf("validated\n");
+        qf_destroy(&qf1);
+        qf_destroy(&qf2);
+        qf_destroy(&merged);
+        qf_destroy(&expected);
+    }
+
+    // Fingerprints of different sizes are re-inserted
+    qf_init(&qf1, 12, 4);
+    qf_init(&qf2, 12, 8);
+    for (uint64_t i = 0; i < 1000; i++) {
+        qf_insert(&qf1, keys[i] & 0xffff);
+        qf_insert(&qf2, keys[i] & 0xfffff);
+    }
+    printf("Testing QF merge of fingerprints of different sizes ");
+    if (!qf_merge(&merged, &qf1, &qf2) || merged.qbits != 13 ||
+        merged.rbits != 8 || !qf_is_consistent(&merged)) {
+        fprintf(stderr, "QF failed to merge.\n");
+        abort();
+    }
+    for (uint64_t i = 0; i < 1000; i++) {
+        if (!qf_may_contain(&merged, keys[i] & 0xfffff)) {
+            fprintf(stderr, "QF merge lost key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    printf("validated\n");
+    qf_destroy(&qf1);
+    qf_destroy(&qf2);
+    qf_destroy(&merged);
+
+    free(keys);
+}
+
+static uint64_t sort_unique(uint64_t *keys, uint64_t n)
+{
+    uint64_t m = 0;
+    qsort(keys, n, sizeof(uint64_t), cmp_u64);
+    for (uint64_t i = 0; i < n; i++) {
+        if (m == 0 || keys[m - 1] != keys[i])
+            keys[m++] = keys[i];
+    }
+    return m;
+}
+
+void qf_setop_test()
+{
+    quotient_filter qf1, qf2, out, expected;
+
+    // Intersect and subtract two filters with the same fingerprint size and
+    // compare with filters built from the result sets
+    uint32_t q = 16;
+    uint32_t r = 12;
+    uint64_t mask = (1ULL << (q + r)) - 1;
+    uint64_t nkeys = (3 * (1 << q) / 4);
+    uint64_t *keys = calloc(4 * nkeys, sizeof(uint64_t));
+    uint64_t *keys1 = keys, *keys2 = keys + nkeys, *res = keys + 2 * nkeys;
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * 2 * nkeys);
+    for (uint64_t i = 0; i < 2 * nkeys; i++)
+        keys[i] &= mask;
+    // Share a quarter of the keys between both filters.
+    for (uint64_t i = 0; i < nkeys / 4; i++)
+        keys2[i] = keys1[i];
+
+    qf_init(&qf1, q, r);
+    qf_init(&qf2, q + 1, r - 1);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        qf_insert(&qf1, keys1[i]);
+        qf_insert(&qf2, keys2[i]);
+    }
+    uint64_t n1 = sort_unique(keys1, nkeys);
+    uint64_t n2 = sort_unique(keys2, nkeys);
+    uint64_t nboth = 0, nonly1 = 0;
+    for (uint64_t i = 0, j = 0; i < n1; i++) {
+        while (j < n2 && keys2[j] < keys1[i])
+            j++;
+        if (j < n2 && keys2[j] == keys1[i])
+            res[nboth++] = keys1[i];
+        else
+            res[2 * nkeys - 1 - nonly1++] = keys1[i];
+    }
+
+    printf("Testing QF intersection of %lu and %lu entries ", qf1.entries,
+           qf2.entries);
+    qf_init(&expected, q, r);
+    qf_insert_sorted(&expected, res, nboth);
+    if (!qf_intersect(&out, &qf1, &qf2) || out.qbits != q || out.rbits != r ||
+        out.entries != expected.entries ||
+        memcmp(out.table, expected.table, qf_table_size(q, r))) {
+        fprintf(stderr, "QF intersection built a different table.\n");
+        abort();
+    }
+    printf("validated\n");
+    qf_destroy(&out);
+    qf_destroy(&expected);
+
+    printf("Testing QF difference of %lu and %lu entries ", qf1.entries,
+           qf2.entries);
+    // The keys only in qf1 were stored from the back.
+    for (uint64_t i = 0; i < nonly1 / 2; i++) {
+        uint64_t tmp = res[2 * nkeys - 1 - i];
+        res[2 * nkeys - 1 - i] = res[2 * nkeys - nonly1 + i];
+        res[2 * nkeys - nonly1 + i] = tmp;
+    }
+    qf_init(&expected, q, r);
+    qf_insert_sorted(&expected, res + 2 * nkeys - nonly1, nonly1);
+    if (!qf_difference(&out, &qf1, &qf2) || out.qbits != q ||
+        out.rbits != r || out.entries != expected.entries ||
+        memcmp(out.table, expected.table, qf_table_size(q, r))) {
+        fprintf(stderr, "QF difference built a different table.\n");
+        abort();
+    }
+    qf_destroy(&out);
+    qf_destroy(&expected);
+    if (!qf_difference(&out, &qf1, &qf1) || out.entries) {
+        fprintf(stderr, "QF difference with itself is not empty.\n");
+        abort();
+    }
+    printf("validated\n");
+    qf_destroy(&out);
+    qf_destroy(&qf1);
+    qf_destroy(&qf2);
+
+    // Fingerprints of different sizes are probed
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * 2000);
+    qf_init(&qf1, 12, 8);
+    qf_init(&qf2, 12, 4);
+    for (uint64_t i = 0; i < 1000; i++) {
+        qf_insert(&qf1, keys[i] & 0xfffff);
+        qf_insert(&qf2, keys[i < 500 ? i : 1000 + i] & 0xffff);
+    }
+    printf("Testing QF set operations on fingerprints of different sizes ");
+    if (!qf_intersect(&out, &qf2, &qf1) || out.qbits != 12 ||
+        out.rbits != 8 || out.entries > qf1.entries ||
+        !qf_is_consistent(&out)) {
+        fprintf(stderr, "QF failed to intersect.\n");
+        abort();
+    }
+    for (uint64_t i = 0; i < 500; i++) {
+        if (!qf_may_contain(&out, keys[i] & 0xfffff)) {
+            fprintf(stderr, "QF intersection lost key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    qf_destroy(&out);
+    for (int t = 0; t < 2; t++) {
+        quotient_filter *lhs = t ? &qf2 : &qf1, *rhs = t ? &qf1 : &qf2;
+        if (!qf_difference(&out, lhs, rhs) || out.qbits != lhs->qbits ||
+            out.rbits != lhs->rbits || out.entries > lhs->entries ||
+            !qf_is_consistent(&out)) {
+            fprintf(stderr, "QF failed to subtract.\n");
+            abort();
+        }
+        for (uint64_t i = 0; i < 500; i++) {
+            if (qf_may_contain(&out, keys[i])) {
+                fprintf(stderr, "QF difference kept key: %lx.\n", keys[i]);
+                abort();
+            }
+        }
+        qf_destroy(&out);
+    }
+    printf("validated\n");
+    qf_destroy(&qf1);
+    qf_destroy(&qf2);
+
+    free(keys);
+}
+
+void qf_subset_test()
+{
+    quotient_filter small, large, other;
+
+    // Check containment between filters of the same size
+    uint32_t q = 20;
+    uint32_t r = 12;
+    uint64_t mask = (1ULL << (q + r)) - 1;
+    uint64_t nkeys = (3 * (1 << q) / 4);
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    qf_init(&small, q, r);
+    qf_init(&large, q, r);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        keys[i] &= mask;
+        if (i < nkeys / 2)
+            qf_insert(&small, keys[i]);
+        qf_insert(&large, keys[i]);
+    }
+    printf("Testing QF subset of %lu and %lu entries ", small.entries,
+           large.entries);
+    if (!qf_is_subsetof(&small, &large) || qf_is_subsetof(&large, &small) ||
+        !qf_is_subsetof(&small, &small)) {
+        fprintf(stderr, "QF subset check failed.\n");
+        abort();
+    }
+    qf_remove(&large, keys[nkeys / 4]);
+    if (qf_is_subsetof(&small, &large)) {
+        fprintf(stderr, "QF subset check missed a removed key.\n");
+        abort();
+    }
+    printf("validated\n");
+
+    // A small lhs and filters of different sizes use probing
+    printf("Testing QF subset with probing ");
+    qf_init(&other, q + 1, r - 1);
+    for (uint64_t i = 0; i < nkeys / 2; i++)
+        qf_insert(&other, keys[i]);
+    if (!qf_is_subsetof(&small, &other) || !qf_is_subsetof(&other, &small)) {
+        fprintf(stderr, "QF subset check failed.\n");
+        abort();
+    }
+    qf_destroy(&other);
+    qf_init(&other, q, r + 4);
+    for (uint64_t i = 0; i < 1000; i++)
+        qf_insert(&other, keys[i]);
+    if (!qf_is_subsetof(&other, &small)) {
+        fprintf(stderr, "QF subset check failed.\n");
+        abort();
+    }
+    qf_destroy(&other);
+    qf_init(&other, q, r);
+    for (uint64_t i = 0; i < 1000; i++)
+        qf_insert(&other, keys[i]);
+    if (!qf_is_subsetof(&other, &small)) {
+        fprintf(stderr, "QF subset check failed.\n");
+        abort();
+    }
+    qf_insert(&other, keys[nkeys - 1]);
+    if (qf_is_subsetof(&other, &small)) {
+        fprintf(stderr, "QF subset check missed an extra key.\n");
+        abort();
+    }
+    printf("validated\n");
+
+    qf_destroy(&other);
+    qf_destroy(&small);
+    qf_destroy(&large);
+    free(keys);
+}
+
+void qf_expand_test()
+{
+    quotient_filter qf, expected;
+
+    // Fill a filter, expand it twice and keep inserting
+    uint32_t q = 16;
+    uint32_t r = 7;
+    uint64_t mask = (1ULL << (q + r)) - 1;
+    uint64_t nkeys = 3 * (1 << q);
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    qf_init(&qf, q, r);
+    printf("Testing QF expansion with %lu insertion ", nkeys);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        keys[i] &= mask;
+        if (!qf_insert(&qf, keys[i])) {
+            if (!qf_expand(&qf) || !qf_insert(&qf, keys[i])) {
+                fprintf(stderr, "QF failed to expand.\n");
+                abort();
+            }
+        }
+    }
+    if (qf.qbits != q + 2 || qf.rbits != r - 2) {
+        fprintf(stderr, "QF expanded to a wrong size.\n");
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!qf_may_contain(&qf, keys[i])) {
+            fprintf(stderr, "QF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    qsort(keys, nkeys, sizeof(uint64_t), cmp_u64);
+    qf_init(&expected, q + 2, r - 2);
+    qf_insert_sorted(&expected, keys, nkeys);
+    if (qf.entries != expected.entries ||
+        memcmp(qf.table, expected.table, qf_table_size(q + 2, r - 2))) {
+        fprintf(stderr, "QF expansion built a different table.\n");
+        abort();
+    }
+    printf("validated\n");
+    qf_destroy(&expected);
+
+    // A filter without spare remainder bits can't expand
+    qf_destroy(&qf);
+    qf_init(&qf, q, 1);
+    if (qf_expand(&qf) || qf.qbits != q) {
+        fprintf(stderr, "QF expanded without remainder bits.\n");
+        abort();
+    }
+    qf_destroy(&qf);
+
+    free(keys);
+}
+
+typedef struct {
+    quotient_filter *qf;
+    const uint64_t *keys;
+    uint64_t n;
+    bool insert;
+} qf_worker_args;
+
+static void *qf_worker(void *arg)
+{
+    qf_worker_args *args = arg;
+    for (uint64_t i = 0; i < args->n; i++) {
+        bool ok = args->insert ? qf_insert(args->qf, args->keys[i])
+                               : qf_remove(args->qf, args->keys[i]);
+        if (!ok) {
+            fprintf(stderr, "QF failed to update key: %lx.\n", args->keys[i]);
+            abort();
+        }
+    }
+    return NULL;
+}
+
+/* Insert or remove keys from nthreads threads at once. */
+static void qf_run_workers(quotient_filter *qf,
+                           const uint64_t *keys,
+                           uint64_t nkeys,
+                           bool insert)
+{
+    enum { nthreads = 4 };
+    pthread_t threads[nthreads];
+    qf_worker_args args[nthreads];
+    for (int t = 0; t < nthreads; t++) {
+        uint64_t begin = nkeys * t / nthreads;
+        uint64_t end = nkeys * (t + 1) / nthreads;
+        args[t] = (qf_worker_args){qf, keys + begin, end - begin, insert};
+        pthread_create(&threads[t], NULL, qf_worker, &args[t]);
+    }
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+}
+
+void qf_run_test()
+{
+    quotient_filter qf;
+
+    // Long runs: quotients are multiples of 32, the last ones wrap around
+    // the end of the table. With all q+r bits stored the QF is exact.
+    uint32_t q = 16;
+    uint32_t rs[] = {5, 13, 29, 10};
+    uint64_t nkeys = (1 << q) / 2;
+    uint64_t nprobes = 4 * nkeys;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *probes = calloc(nprobes, sizeof(uint64_t));
+    for (int t = 0; t < 4; t++) {
+        uint32_t r = rs[t];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        uint64_t skew = ~(31ULL << r) | (7ULL << r);
+        RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+        RAND_bytes((unsigned char *) probes, sizeof(*probes) * nprobes);
+        for (uint64_t i = 0; i < nkeys; i++)
+            keys[i] &= mask & ~(31ULL << r);
+        for (uint64_t i = 0; i < nkeys / 64; i++)
+            keys[i] |= mask & ~((1ULL << (r + 3)) - 1);
+        for (uint64_t i = 0; i < nprobes; i++)
+            probes[i] &= mask & skew;
+
+        qf_init(&qf, q, r);
+        printf("Testing QF with %lu lookups in long runs (r = %u) ", nprobes,
+               r);
+        for (uint64_t i = 0; i < nkeys; i++)
+            qf_insert(&qf, keys[i]);
+        for (uint64_t i = 0; i < nkeys; i++) {
+            if (!qf_may_contain(&qf, keys[i])) {
+                fprintf(stderr, "QF failed to lookup for key: %lx.\n",
+                        keys[i]);
+                abort();
+            }
+        }
+        qsort(keys, nkeys, sizeof(uint64_t), cmp_u64);
+        for (uint64_t i = 0; i < nprobes; i++) {
+            bool expected = bsearch(&probes[i], keys, nkeys, sizeof(uint64_t),
+                                    cmp_u64) != NULL;
+            if (qf_may_contain(&qf, probes[i]) != expected) {
+                fprintf(stderr, "QF lookup for %lx is wrong.\n", probes[i]);
+                abort();
+            }
+        }
+        printf("validated\n");
+        qf_destroy(&qf);
+    }
+    free(keys);
+    free(probes);
+}
+
+void qf_remove_batch_test()
+{
+    quotient_filter qf, expected;
+
+    // Remove a third of a crowded table, whose last clusters wrap around,
+    // at once and compare with removing the same hashes one by one
+    uint32_t q = 16;
+    uint32_t rs[] = {5, 13, 29, 10};
+    uint64_t nkeys = 9 * (1 << q) / 10;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *victims = calloc(nkeys, sizeof(uint64_t));
+    for (int t = 0; t < 4; t++) {
+        uint32_t r = rs[t];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+        for (uint64_t i = 0; i < nkeys; i++)
+            keys[i] &= mask;
+        for (uint64_t i = 0; i < nkeys / 64; i++)
+            keys[i] |= mask & ~(mask >> 4);
+
+        qf_init(&qf, q, r);
+        qf_init(&expected, q, r);
+        for (uint64_t i = 0; i < nkeys; i++) {
+            qf_insert(&qf, keys[i]);
+            qf_insert(&expected, keys[i]);
+        }
+        // Every third key, some twice, plus absent and too long hashes
+        uint64_t nvictims = 0;
+        for (uint64_t i = 0; i < nkeys; i += 3)
+            victims[nvictims++] = keys[i];
+        for (uint64_t i = 0; i < nvictims / 10; i++)
+            victims[nvictims + i] = victims[i] ^ (i & 1 ? 1 : mask + 1);
+        nvictims += nvictims / 10;
+
+        printf("Testing QF batched removal of %lu of %lu entries (r = %u) ",
+               nvictims, qf.entries, r);
+        uint64_t entries = expected.entries;
+        for (uint64_t i = 0; i < nvictims; i++)
+            qf_remove(&expected, victims[i]);
+        size_t removed = qf_remove_batch(&qf, victims, nvictims);
+        if (removed != entries - expected.entries ||
+            qf.entries != expected.entries || !qf_is_consistent(&qf) ||
+            memcmp(qf.table, expected.table, qf_table_size(q, r))) {
+            fprintf(stderr, "QF batched removal built a different table.\n");
+            abort();
+        }
+
+        // Removing everything leaves an empty table
+        entries = qf.entries;
+        if (qf_remove_batch(&qf, keys, nkeys) != entries || qf.entries) {
+            fprintf(stderr, "QF batched removal left entries behind.\n");
+            abort();
+        }
+        qf_clear(&expected);
+        if (memcmp(qf.table, expected.table, qf_table_size(q, r))) {
+            fprintf(stderr, "QF batched removal left a dirty table.\n");
+            abort();
+        }
+        printf("validated\n");
+        qf_destroy(&qf);
+        qf_destroy(&expected);
+    }
+    free(keys);
+    free(victims);
+}
+
+void qf_sparse_test()
+{
+    quotient_filter qf, expected;
+
+    // Iterate sparse filters (through qf_expand()) for every slot width,
+    // with a cluster that wraps around the end of the table
+    uint32_t q = 18;
+    uint32_t rs[] = {5, 13, 29, 10};
+    uint64_t nkeys = (1 << q) / 100;
+    uint64_t nwrap = 64;
+    uint64_t *keys = calloc(nkeys + nwrap, sizeof(uint64_t));
+    for (int t = 0; t < 4; t++) {
+        uint32_t r = rs[t];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        RAND_bytes((unsigned char *) keys, sizeof(*keys) * (nkeys + nwrap));
+        for (uint64_t i = 0; i < nkeys; i++)
+            keys[i] &= mask;
+        // The last keys go to the last four home slots
+        uint64_t low = mask >> (q - 2);
+        for (uint64_t i = nkeys; i < nkeys + nwrap; i++)
+            keys[i] = (keys[i] & low) | (mask & ~low);
+
+        qf_init(&qf, q, r);
+        printf("Testing sparse QF iteration with %lu keys (r = %u) ",
+               nkeys + nwrap, r);
+        for (uint64_t i = 0; i < nkeys + nwrap; i++)
+            qf_insert(&qf, keys[i]);
+        if (!qf_expand(&qf)) {
+            fprintf(stderr, "QF failed to expand.\n");
+            abort();
+        }
+        qsort(keys, nkeys + nwrap, sizeof(uint64_t), cmp_u64);
+        qf_init(&expected, q + 1, r - 1);
+        for (uint64_t i = 0; i < nkeys + nwrap; i++)
+            qf_insert(&expected, keys[i]);
+        if (qf.entries != expected.entries ||
+            memcmp(qf.table, expected.table, qf_table_size(q + 1, r - 1))) {
+            fprintf(stderr, "QF iteration missed fingerprints.\n");
+            abort();
+        }
+        printf("validated\n");
+        qf_destroy(&qf);
+        qf_destroy(&expected);
+    }
+    free(keys);
+
+    // A cluster right behind the wrapped part of another one
+    uint64_t wrapped[] = {0xf1, 0xf2, 0x13, 0x24, 0x65};
+    qf_iterator qfi;
+    uint64_t last = 0;
+    qf_init(&qf, 4, 4);
+    for (int i = 0; i < 5; i++)
+        qf_insert(&qf, wrapped[i]);
+    qfi_start(&qf, &qfi);
+    while (!qfi_done(&qf, &qfi)) {
+        uint64_t hash = qfi_next(&qf, &qfi);
+        if (hash < last) {
+            fprintf(stderr, "QF iteration is out of order.\n");
+            abort();
+        }
+        last = hash;
+    }
+    qf_destroy(&qf);
+}
+
+void qf_verify_test()
+{
+    quotient_filter qf;
+    qf_verify_report report;
+
+    // A healthy filter passes, whatever the number of threads
+    uint32_t q = 16;
+    uint32_t r = 5;
+    uint64_t nkeys = 4 * (1 << q) / 5;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    qf_init(&qf, q, r);
+    for (uint64_t i = 0; i < nkeys; i++)
+        qf_insert(&qf, keys[i] & ((1ULL << (q + r)) - 1));
+    printf("Testing QF verification of %lu entries ", qf.entries);
+    uint64_t occupieds = 0;
+    uint8_t *slots = (uint8_t *) qf.table;
+    for (uint64_t i = 0; i < qf.max_size; i++)
+        occupieds += slots[i] & 1;
+    int nthreads[] = {-1, 0, 1, 3, 8};
+    for (int t = 0; t < 5; t++) {
+        if (!qf_verify(&qf, nthreads[t], &report) ||
+            report.entries != qf.entries || report.runs != occupieds) {
+            fprintf(stderr, "QF verification failed on a healthy filter.\n");
+            abort();
+        }
+    }
+
+    // Swapped remainders in a run
+    uint64_t s = 1;
+    while (!(slots[s] & 2))
+        s++;
+    uint8_t saved = slots[s];
+    slots[s] = (slots[s - 1] & ~7) | (slots[s] & 7);
+    if (qf_verify(&qf, 4, &report) || report.error_slot != s) {
+        fprintf(stderr, "QF verification missed a disordered run.\n");
+        abort();
+    }
+    slots[s] = saved;
+
+    // A home slot that lost its occupied bit
+    s = 0;
+    while ((slots[s] & 7) != 1)
+        s++;
+    slots[s] &= ~1;
+    if (qf_verify(&qf, 4, &report)) {
+        fprintf(stderr, "QF verification missed an occupied bit.\n");
+        abort();
+    }
+    slots[s] |= 1;
+
+    // A wrong entry count
+    qf.entries++;
+    if (qf_verify(&qf, 4, &report) || report.error_slot != qf.max_size) {
+        fprintf(stderr, "QF verification missed the entry count.\n");
+        abort();
+    }
+    qf.entries--;
+    if (!qf_verify(&qf, 4, NULL)) {
+        fprintf(stderr, "QF verification failed after restoring.\n");
+        abort();
+    }
+    printf("validated\n");
+    qf_destroy(&qf);
+    free(keys);
+}
+
+void qf_stats_test()
+{
+    quotient_filter qf;
+    qf_stats_report stats;
+
+    // A cluster wrapping around the end of the table, next to three others
+    uint64_t keys[] = {0xf1, 0xf2, 0x13, 0x24, 0x65};
+    printf("Testing QF statistics ");
+    qf_init(&qf, 4, 4);
+    qf_stats(&qf, &stats);
+    if (stats.entries || stats.clusters || stats.load_factor != 0 ||
+        stats.observed_miss_probes != 1 || stats.expected_miss_probes != 1) {
+        fprintf(stderr, "QF statistics of an empty filter are wrong.\n");
+        abort();
+    }
+    for (int i = 0; i < 5; i++)
+        qf_insert(&qf, keys[i]);
+    qf_stats(&qf, &stats);
+    if (stats.entries != 5 || stats.clusters != 4 || stats.runs != 4 ||
+        stats.cluster_length[1] != 3 || stats.cluster_length[2] != 1 ||
+        stats.run_length[1] != 3 || stats.run_length[2] != 1 ||
+        stats.shift[0] != 4 || stats.shift[1] != 1 ||
+        stats.max_cluster_length != 2 || stats.max_shift != 1 ||
+        stats.observed_hit_probes != 6.0 / 5 ||
+        stats.observed_miss_probes != 17.0 / 16) {
+        fprintf(stderr, "QF statistics of a small filter are wrong.\n");
+        abort();
+    }
+    qf_destroy(&qf);
+
+    // A uniform hash costs what the model predicts
+    uint32_t q = 18;
+    uint32_t r = 8;
+    uint64_t nkeys = 3 * (1 << q) / 4;
+    uint64_t *hashes = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) hashes, sizeof(*hashes) * nkeys);
+    qf_init(&qf, q, r);
+    for (uint64_t i = 0; i < nkeys; i++)
+        qf_insert(&qf, hashes[i]);
+    qf_stats(&qf, &stats);
+    uint64_t clusters = 0, runs = 0, entries = 0;
+    for (int i = 0; i < QF_STATS_BUCKETS; i++) {
+        clusters += stats.cluster_length[i];
+        runs += stats.run_length[i];
+        entries += stats.shift[i];
+    }
+    if (stats.entries != qf.entries || clusters != stats.clusters ||
+        runs != stats.runs || entries != stats.entries ||
+        stats.load_factor != (double) qf.entries / (1 << q) ||
+        stats.observed_hit_probes < 0.9 * stats.expected_hit_probes ||
+        stats.observed_hit_probes > 1.1 * stats.expected_hit_probes ||
+        stats.observed_miss_probes < 0.9 * stats.expected_miss_probes ||
+        stats.observed_miss_probes > 1.1 * stats.expected_miss_probes) {
+        fprintf(stderr, "QF statistics of a random filter are wrong.\n");
+        abort();
+    }
+    printf("validated\n");
+    qf_destroy(&qf);
+    free(hashes);
+}
+
+void qf_concurrent_test()
+{
+    quotient_filter qf, expected;
+
+    // Build from several threads and compare with a sequential build
+    uint32_t q = 20;
+    uint32_t rs[] = {13, 7};
+    for (int k = 0; k < 2; k++) {
+        uint32_t r = rs[k];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        uint64_t nkeys = 3 * (1 << q) / 4;
+        uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+        uint64_t *sorted = calloc(nkeys, sizeof(uint64_t));
+        RAND_bytes((unsigned char *) sorted, sizeof(*sorted) * nkeys);
+        for (uint64_t i = 0; i < nkeys; i++)
+            sorted[i] &= mask;
+
+        // Distinct keys in random order, so that removals can't hit keys of
+        // the other half
+        qsort(sorted, nkeys, sizeof(uint64_t), cmp_u64);
+        uint64_t n = 0;
+        for (uint64_t i = 0; i < nkeys; i++) {
+            if (n == 0 || sorted[n - 1] != sorted[i])
+                sorted[n++] = sorted[i];
+        }
+        nkeys = n;
+        memcpy(keys, sorted, nkeys * sizeof(uint64_t));
+        for (uint64_t i = nkeys - 1; i > 0; i--) {
+            uint64_t j = rand64() % (i + 1);
+            uint64_t tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+
+        qf_init(&qf, q, r);
+        if (!qf_set_concurrent(&qf, true)) {
+            fprintf(stderr, "Can't allocate locks.\n");
+            abort();
+        }
+        printf("Testing concurrent QF with %lu insertion (r=%u) ", nkeys, r);
+        qf_run_workers(&qf, keys, nkeys, true);
+        for (uint64_t i = 0; i < nkeys; i++) {
+            if (!qf_may_contain(&qf, keys[i])) {
+                fprintf(stderr, "QF failed to lookup for key: %lx.\n",
+                        keys[i]);
+                abort();
+            }
+        }
+
+        qf_init(&expected, q, r);
+        qf_insert_sorted(&expected, sorted, nkeys);
+        if (qf.entries != expected.entries ||
+            memcmp(qf.table, expected.table, qf_table_size(q, r))) {
+            fprintf(stderr, "Concurrent inserts built a different table.\n");
+            abort();
+        }
+
+        // Remove the first half concurrently, the rest must stay
+        qf_run_workers(&qf, keys, nkeys / 2, false);
+        for (uint64_t i = nkeys / 2; i < nkeys; i++) {
+            if (!qf_may_contain(&qf, keys[i])) {
+                fprintf(stderr, "QF lost key: %lx.\n", keys[i]);
+                abort();
+            }
+        }
+        if (!qf_verify(&qf, 4, NULL)) {
+            fprintf(stderr, "QF is inconsistent after removal.\n");
+            abort();
+        }
+        printf("validated\n");
+        qf_destroy(&qf);
+        qf_destroy(&expected);
+        free(sorted);
+        free(keys);
+    }
+}
+
+void qf_convert_test()
+{
+    quotient_filter qf, back;
+    CQF cqf, expected;
+
+    // QF -> CQF lays out the same CQF as inserting the fingerprints
+    uint32_t q = 16;
+    uint32_t r = 11;
+    uint64_t mask = (1ULL << (q + r)) - 1;
+    uint64_t nkeys = 3 * (1 << q) / 4;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    qf_init(&qf, q, r);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        keys[i] &= mask;
+        qf_insert(&qf, keys[i]);
+    }
+    printf("Testing QF to CQF conversion with %lu fingerprints ", qf.entries);
+    if (!qf_to_cqf(&cqf, &qf)) {
+        fprintf(stderr, "QF to CQF conversion failed.\n");
+        abort();
+    }
+    cqf_malloc(&expected, 1ULL << q, q + r, 0, QF_HASH_NONE, 0);
+    cqf_reset(&expected);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!cqf_count_key_value(&expected, keys[i], 0, QF_KEY_IS_HASH))
+            cqf_insert(&expected, keys[i], 0, 1, QF_NO_LOCK | QF_KEY_IS_HASH);
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (cqf_count_key_value(&cqf, keys[i], 0, QF_KEY_IS_HASH) != 1) {
+            fprintf(stderr, "CQF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    if (cqf_get_num_distinct_key_value_pairs(&cqf) != qf.entries ||
+        cqf_get_num_occupied_slots(&cqf) !=
+            cqf_get_num_occupied_slots(&expected) ||
+        memcmp(cqf.blocks, expected.blocks,
+               cqf.metadata->total_size_in_bytes)) {
+        fprintf(stderr, "QF to CQF conversion built a different CQF.\n");
+        abort();
+    }
+    printf("validated\n");
+
+    // ... and back gives the QF it started from
+    printf("Testing CQF to QF conversion with %lu fingerprints ", qf.entries);
+    if (!cqf_to_qf(&back, &cqf) || back.qbits != q || back.rbits != r ||
+        back.entries != qf.entries ||
+        memcmp(back.table, qf.table, qf_table_size(q, r))) {
+        fprintf(stderr, "CQF to QF conversion built a different table.\n");
+        abort();
+    }
+    printf("validated\n");
+    qf_destroy(&back);
+    cqf_free(&cqf);
+    cqf_free(&expected);
+
+    // Values and counts: every key-value pair becomes one fingerprint
+    uint64_t value_bits = 3;
+    cqf_malloc(&cqf, 1ULL << q, q + r - value_bits, value_bits, QF_HASH_NONE,
+               0);
+    cqf_reset(&cqf);
+    nkeys /= 2;
+    for (uint64_t i = 0; i < nkeys; i++) {
+        uint64_t key = keys[i] >> value_bits, value = keys[i] & 7;
+        if (cqf_insert(&cqf, key, value, 1 + i % 5,
+                       QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+            fprintf(stderr, "failed insertion for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    printf("Testing CQF to QF conversion of counts and values ");
+    if (!cqf_to_qf(&back, &cqf) ||
+        back.entries != cqf_get_num_distinct_key_value_pairs(&cqf)) {
+        fprintf(stderr, "CQF to QF conversion failed.\n");
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!qf_may_contain(&back, keys[i])) {
+            fprintf(stderr, "QF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    printf("validated\n");
+    qf_destroy(&back);
+    cqf_free(&cqf);
+
+    // An empty filter converts to an empty filter
+    qf_clear(&qf);
+    if (!qf_to_cqf(&cqf, &qf) || cqf_get_num_distinct_key_value_pairs(&cqf) ||
+        !cqf_to_qf(&back, &cqf) || back.entries) {
+        fprintf(stderr, "Conversion of an empty filter failed.\n");
+        abort();
+    }
+    qf_destroy(&back);
+    cqf_free(&cqf);
+    qf_destroy(&qf);
+
+    free(keys);
+}
+
+void qf_file_test()
+{
+    quotient_filter qf, reopened;
+    const char *filename = "test.qf";
+
+    // Fill a file-backed filter, close it and open it again
+    uint32_t q = 16;
+    uint32_t r = 8;
+    uint64_t nkeys = (1 << q) / 2;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    printf("Testing file-backed QF with %lu insertion ", nkeys);
+    if (!qf_initfile(&qf, q, r, filename)) {
+        fprintf(stderr, "QF failed to create %s.\n", filename);
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys / 2; i++)
+        qf_insert(&qf, keys[i]);
+    uint64_t entries = qf.entries;
+    qf_closefile(&qf);
+
+    if (!qf_usefile(&qf, filename, QF_USEFILE_READ_WRITE) || qf.qbits != q ||
+        qf.rbits != r || qf.entries != entries) {
+        fprintf(stderr, "QF failed to reopen %s.\n", filename);
+        abort();
+    }
+    for (uint64_t i = nkeys / 2; i < nkeys; i++)
+        qf_insert(&qf, keys[i]);
+
+    // While it's open, the header doesn't know the entries
+    if (!qf_usefile(&reopened, filename, QF_USEFILE_READ_ONLY) ||
+        reopened.entries != qf.entries || !qf_is_consistent(&reopened)) {
+        fprintf(stderr, "QF miscounted the entries of %s.\n", filename);
+        abort();
+    }
+    qf_closefile(&reopened);
+    entries = qf.entries;
+    qf_closefile(&qf);
+
+    if (!qf_usefile(&qf, filename, QF_USEFILE_READ_ONLY) ||
+        qf.entries != entries) {
+        fprintf(stderr, "QF failed to reopen %s.\n", filename);
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!qf_may_contain(&qf, keys[i])) {
+            fprintf(stderr, "QF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    qf_closefile(&qf);
+
+    // Anything else is refused
+    FILE *f = fopen(filename, "w");
+    fwrite(keys, sizeof(uint64_t), nkeys, f);
+    fclose(f);
+    if (qf_usefile(&qf, filename, QF_USEFILE_READ_ONLY) ||
+        qf_usefile(&qf, "missing.qf", QF_USEFILE_READ_ONLY)) {
+        fprintf(stderr, "QF opened a file that is not a QF.\n");
+        abort();
+    }
+    remove(filename);
+    printf("validated\n");
+
+    free(keys);
+}
+
+void qf_wal_test()
+{
+    quotient_filter qf;
+    const char *filename = "test-wal.qf";
+
+    uint32_t q = 14;
+    uint32_t r = 10;
+    uint64_t nkeys = (1 << q) / 2;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    // Distinct fingerprints, so that removes match the inserts one to one
+    for (uint64_t i = 0; i < nkeys; i++)
+        keys[i] = (i * 0x9e3779b97f4a7c15ULL) & ((1ULL << (q + r)) - 1);
+    printf("Testing write-ahead logged QF with %lu insertion ", nkeys);
+
+    // A writer that dies without closing the file loses nothing it
+    // committed, and the file itself is only written at checkpoints
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!qf_initfile(&qf, q, r, filename) || !qf_wal_enable(&qf, 64))
+            _exit(1);
+        for (uint64_t i = 0; i < nkeys / 2; i++) {
+            if (!qf_wal_insert(&qf, keys[i]))
+                _exit(1);
+        }
+        if (!qf_checkpoint(&qf))
+            _exit(1);
+        for (uint64_t i = nkeys / 2; i < nkeys; i++) {
+            if (!qf_wal_insert(&qf, keys[i]))
+                _exit(1);
+        }
+        for (uint64_t i = 0; i < nkeys / 4; i++) {
+            if (!qf_wal_remove(&qf, keys[i]))
+                _exit(1);
+        }
+        if (!qf_wal_commit(&qf))
+            _exit(1);
+        _exit(0);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "QF failed to log to %s.\n", filename);
+        abort();
+    }
+
+    quotient_filter expected;
+    if (!qf_init(&expected, q, r)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    for (uint64_t i = nkeys / 4; i < nkeys; i++)
+        qf_insert(&expected, keys[i]);
+
+    struct stat before, after;
+    int flags[] = {QF_USEFILE_READ_ONLY, QF_USEFILE_READ_WRITE};
+    if (stat(filename, &before) < 0) {
+        fprintf(stderr, "QF failed to create %s.\n", filename);
+        abort();
+    }
+    for (int f = 0; f < 2; f++) {
+        if (!qf_usefile(&qf, filename, flags[f]) ||
+            qf.entries != expected.entries || !qf_is_consistent(&qf) ||
+            memcmp(qf.table, expected.table, qf_table_size(q, r)) != 0) {
+            fprintf(stderr, "QF failed to replay the log of %s.\n", filename);
+            abort();
+        }
+        qf_closefile(&qf);
+    }
+
+    // Closing folded the log into the file, in place
+    if (access("test-wal.qf.wal", F_OK) == 0 ||
+        access("test-wal.qf.ckpt", F_OK) == 0 || stat(filename, &after) < 0 ||
+        after.st_ino != before.st_ino ||
+        !qf_usefile(&qf, filename, QF_USEFILE_READ_ONLY) ||
+        qf.entries != expected.entries ||
+        memcmp(qf.table, expected.table, qf_table_size(q, r)) != 0) {
+        fprintf(stderr, "QF failed to checkpoint %s.\n", filename);
+        abort();
+    }
+    qf_closefile(&qf);
+
+    // Removing what isn't there logs nothing
+    if (!qf_usefile(&qf, filename, QF_USEFILE_READ_WRITE) ||
+        !qf_wal_enable(&qf, 0) || stat("test-wal.qf.wal", &before) < 0 ||
+        qf_wal_remove(&qf, keys[0]) || !qf_wal_commit(&qf) ||
+        stat("test-wal.qf.wal", &after) < 0 ||
+        after.st_size != before.st_size) {
+        fprintf(stderr, "QF logged a remove that missed in %s.\n", filename);
+        abort();
+    }
+    qf_closefile(&qf);
+    remove(filename);
+    printf("validated\n");
+
+    qf_destroy(&expected);
+    free(keys);
+}
+
+void qf_flush_test()
+{
+    quotient_filter qf;
+    const char *filename = "test-flush.qf";
+
+    uint32_t q = 20;
+    uint32_t r = 12;
+    uint64_t nkeys = (1 << q) / 2;
+    uint64_t table_size = qf_table_size(q, r);
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    printf("Testing incremental flush of QF with %lu insertion ", nkeys);
+    if (!qf_initfile(&qf, q, r, filename)) {
+        fprintf(stderr, "QF failed to create %s.\n", filename);
+        abort();
+    }
+
+    // Filling the table dirties all of it, the next flush has nothing left
+    for (uint64_t i = 0; i < nkeys - 16; i++)
+        qf_insert(&qf, keys[i]);
+    if (qf_flush_incremental(&qf, 4) != (int64_t) table_size ||
+        qf_flush_incremental(&qf, 4) != 0) {
+        fprintf(stderr, "QF failed to flush the whole table.\n");
+        abort();
+    }
+
+    // A few inserts only dirty the pages of their clusters
+    for (uint64_t i = nkeys - 16; i < nkeys; i++)
+        qf_insert(&qf, keys[i]);
+    int64_t bytes = qf_flush_incremental(&qf, 4);
+    if (bytes <= 0 || bytes > 32 * 4096 || qf_flush_incremental(&qf, 1) != 0) {
+        fprintf(stderr, "QF flushed %ld bytes for 16 inserts.\n", bytes);
+        abort();
+    }
+    qf_closefile(&qf);
+
+    if (!qf_usefile(&qf, filename, QF_USEFILE_READ_WRITE) ||
+        qf_flush_incremental(&qf, 1) != 0) {
+        fprintf(stderr, "QF failed to reopen %s.\n", filename);
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!qf_may_contain(&qf, keys[i])) {
+            fprintf(stderr, "QF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    qf_clear(&qf);
+    if (qf_flush_incremental(&qf, 2) != (int64_t) table_size) {
+        fprintf(stderr, "QF failed to flush a cleared table.\n");
+        abort();
+    }
+    qf_closefile(&qf);
+    remove(filename);
+    printf("validated\n");
+
+    free(keys);
+}
+
+void qf_expandfile_test()
+{
+    quotient_filter qf, expected;
+    const char *filename = "test-expand.qf";
+    struct stat sb;
+
+    // Grow file-backed filters of every slot width in place, with a cluster
+    // wrapping around the end of the table, and once more in WAL mode
+    uint32_t q = 12;
+    uint32_t rs[] = {6, 10, 14, 30};
+    uint64_t nkeys = 7 * (1 << q) / 8;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    printf("Testing in-place QF file expansion with %lu insertion ", nkeys);
+    for (int t = 0; t < 4; t++) {
+        uint32_t r = rs[t];
+        uint64_t mask = (1ULL << (q + r)) - 1;
+        RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+        for (uint64_t i = 0; i < nkeys; i++) {
+            keys[i] &= mask;
+            if (i % 64 == 0)
+                keys[i] |= ((1ULL << q) - 4) << r;
+        }
+        if (!qf_initfile(&qf, q, r, filename)) {
+            fprintf(stderr, "QF failed to create %s.\n", filename);
+            abort();
+        }
+        for (uint64_t i = 0; i < nkeys; i++)
+            qf_insert(&qf, keys[i]);
+        qsort(keys, nkeys, sizeof(uint64_t), cmp_u64);
+
+        for (uint32_t grow = 1; grow <= 2; grow++) {
+            if (grow == 2 && !qf_wal_enable(&qf, 0)) {
+                fprintf(stderr, "QF failed to log %s.\n", filename);
+                abort();
+            }
+            if (!qf_expandfile(&qf) || qf.qbits != q + grow) {
+                fprintf(stderr, "QF failed to expand %s.\n", filename);
+                abort();
+            }
+            qf_init(&expected, q + grow, r - grow);
+            qf_insert_sorted(&expected, keys, nkeys);
+            size_t size = qf_table_size(q + grow, r - grow);
+            if (qf.entries != expected.entries ||
+                memcmp(qf.table, expected.table, size)) {
+                fprintf(stderr, "QF expansion built a different table.\n");
+                abort();
+            }
+            qf_closefile(&qf);
+
+            if (stat(filename, &sb) < 0 || (size_t) sb.st_size != 4096 + size ||
+                !qf_usefile(&qf, filename, QF_USEFILE_READ_WRITE) ||
+                qf.qbits != q + grow || qf.entries != expected.entries ||
+                memcmp(qf.table, expected.table, size)) {
+                fprintf(stderr, "QF failed to reopen %s.\n", filename);
+                abort();
+            }
+            qf_destroy(&expected);
+        }
+        qf_closefile(&qf);
+    }
+    remove(filename);
+    printf("validated\n");
+
+    free(keys);
+}
+
+void qf_large_test()
+{
+    quotient_filter qf;
+
+    // Address a table of more than 2^32 slots; only touched pages are
+    // backed by memory
+    uint32_t q = 33;
+    uint32_t r = 3;
+    uint64_t quots[] = {0, (1ULL << 31) + 5, (1ULL << 32) + 7, (1ULL << q) - 1};
+    if (!qf_init(&qf, q, r)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    printf("Testing QF with %lu slots ", qf.max_size);
+    if (qf.max_size != (1ULL << q) ||
+        qf_table_size(q, r) != (1ULL << q) * (r + 3) / 8) {
+        fprintf(stderr, "QF has a wrong size.\n");
+        abort();
+    }
+    for (int i = 0; i < 4; i++) {
+        // Several remainders per quotient; the last run wraps around
+        for (uint64_t rem = 0; rem < 4; rem++) {
+            if (!qf_insert(&qf, (quots[i] << r) | rem)) {
+                fprintf(stderr, "QF failed to insert for quotient: %lx.\n",
+                        quots[i]);
+                abort();
+            }
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        for (uint64_t rem = 0; rem < 8; rem++) {
+            if (qf_may_contain(&qf, (quots[i] << r) | rem) != (rem < 4) ||
+                qf_may_contain(&qf, ((quots[i] + 2) << r) | rem)) {
+                fprintf(stderr, "QF failed to lookup for quotient: %lx.\n",
+                        quots[i]);
+                abort();
+            }
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        for (uint64_t rem = 0; rem < 4; rem++)
+            qf_remove(&qf, (quots[i] << r) | rem);
+    }
+    if (qf.entries) {
+        fprintf(stderr, "QF still holds %lu entries.\n", qf.entries);
+        abort();
+    }
+    printf("validated\n");
     qf_destroy(&qf);
+}
 
-    printf("\n");
+void bqf_test()
+{
+    blocked_quotient_filter bqf;
+    quotient_filter qf;
 
-    // Test sequential insert & lookup
-    q = 16;
-    r = 64 - q;
-    nkeys = (3 * (1 << q) / 4);
-    qf_init(&qf, q, r);
-    printf("Testing QF with %lu sequential insertion and lookup ", nkeys);
-    uint64_t key = rand64();
-    for (uint32_t i = 0; i < nkeys; i++) {
-        if (!qf_insert(&qf, key + i)) {
-            fprintf(stderr, "QF failed to insert for key: %lx.\n", key + i);
+    // Test random insert & lookup
+    uint32_t q = 24;
+    uint32_t r = 64 - q;
+    uint64_t nkeys = (3 * (1 << q) / 4);
+    if (!bqf_init(&bqf, q, r)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    printf("Testing BQF with %lu random insertion and lookup ", nkeys);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!bqf_insert(&bqf, keys[i])) {
+            fprintf(stderr, "BQF failed to insert for key: %lx.\n", keys[i]);
             abort();
         }
-        if (!qf_may_contain(&qf, key + i)) {
-            fprintf(stderr, "QF failed to lookup for key: %lx.\n", key + i);
+        if (!bqf_may_contain(&bqf, keys[i])) {
+            fprintf(stderr, "BQF failed to lookup for key: %lx.\n", keys[i]);
             abort();
         }
 
-        if (i % 2000 == 0)
+        if (i % 1000000 == 0)
             printf(".");
     }
     printf(" validated\n");
 
-    // Check QF consistency
-    if (qf_is_consistent(&qf)) {
-        printf("QF is consistent.\n");
-    } else {
-        printf("QF consistency check failed.\n");
+    // Test remove
+    printf("Testing BQF with %lu removal of inserted elements ", nkeys);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!bqf_remove(&bqf, keys[i])) {
+            fprintf(stderr, "BQF failed to remove for key: %lx.\n", keys[i]);
+            abort();
+        }
+
+        if (i % 1000000 == 0)
+            printf(".");
+    }
+    if (bqf.entries) {
+        fprintf(stderr, "BQF still holds %lu entries.\n", bqf.entries);
         abort();
     }
+    printf(" validated\n");
+    bqf_destroy(&bqf);
+    free(keys);
 
-    // Test sequential remove
-    printf("Testing QF with %lu removal of inserted elements ", nkeys);
-    for (uint64_t i = 0; i < nkeys; i++) {
-        if (!qf_remove(&qf, key + i)) {
-            fprintf(stderr, "QF failed to remove for key: %lx.\n", keys[i]);
+    printf("\n");
+
+    // Compare against quotient_filter on a small, crowded table
+    q = 12;
+    r = 4;
+    uint64_t mask = (1ULL << (q + r)) - 1;
+    qf_init(&qf, q, r);
+    bqf_init(&bqf, q, r);
+    printf("Testing BQF against QF with mixed operations ");
+    for (uint32_t i = 0; i < (1 << 20); i++) {
+        uint64_t key = rand64() & mask;
+        if (rand() % 2 && qf.entries < qf.max_size * 9 / 10) {
+            if (qf_insert(&qf, key) != bqf_insert(&bqf, key)) {
+                fprintf(stderr, "BQF insert differs for key: %lx.\n", key);
+                abort();
+            }
+        } else {
+            qf_remove(&qf, key);
+            bqf_remove(&bqf, key);
+        }
+        key = rand64() & mask;
+        if (qf_may_contain(&qf, key) != bqf_may_contain(&bqf, key) ||
+            qf.entries != bqf.entries) {
+            fprintf(stderr, "BQF lookup differs for key: %lx.\n", key);
             abort();
         }
 
-        if (i % 2000 == 0)
+        if (i % 100000 == 0)
             printf(".");
     }
     printf(" validated\n");
+    bqf_destroy(&bqf);
     qf_destroy(&qf);
-
-    free(keys);
 }
 
 void cqf_test()
@@ -186,12 +1618,702 @@ void cqf_test()
     free(keys);
 }
 
+void cqf_flush_test()
+{
+    CQF cqf;
+    const char *filename = "test-flush.cqf";
+
+    uint32_t q = 20;
+    uint64_t nslots = 1ULL << q;
+    uint64_t nkeys = 1000;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    for (uint64_t i = 0; i < nkeys; i++)
+        keys[i] &= (1ULL << (q + 8)) - 1;
+    printf("Testing incremental flush of CQF with %lu insertion ", nkeys);
+    if (!cqf_initfile(&cqf, nslots, q + 8, 0, QF_HASH_NONE, 0, filename)) {
+        fprintf(stderr, "CQF failed to create %s.\n", filename);
+        abort();
+    }
+    uint64_t size =
+        sizeof(qfmetadata) + cqf_get_total_size_in_bytes(&cqf);
+    if (cqf_flush_incremental(&cqf, 4) != (int64_t) size) {
+        fprintf(stderr, "CQF failed to flush the new file.\n");
+        abort();
+    }
+
+    // Each insert dirties the blocks from its home to the slot it freed up,
+    // and every flush writes the counters back
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (cqf_insert(&cqf, keys[i], 0, 1, QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+            fprintf(stderr, "failed insertion for key: %lx.\n", keys[i]);
+            abort();
+        }
+        int64_t bytes = cqf_flush_incremental(&cqf, 2);
+        if (bytes <= 0 || bytes > 4 * 4096) {
+            fprintf(stderr, "CQF flushed %ld bytes for one insert.\n", bytes);
+            abort();
+        }
+    }
+    if (cqf_flush_incremental(&cqf, 1) != 4096) {
+        fprintf(stderr, "CQF flushed more than its counters.\n");
+        abort();
+    }
+    cqf_closefile(&cqf);
+
+    if (!cqf_usefile(&cqf, filename, QF_USEFILE_READ_WRITE) ||
+        cqf_get_num_distinct_key_value_pairs(&cqf) > nkeys) {
+        fprintf(stderr, "CQF failed to reopen %s.\n", filename);
+        abort();
+    }
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (!cqf_count_key_value(&cqf, keys[i], 0, QF_KEY_IS_HASH) ||
+            cqf_delete_key_value(&cqf, keys[i], 0,
+                                 QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+            fprintf(stderr, "CQF failed to lookup for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    int64_t bytes = cqf_flush_incremental(&cqf, 4);
+    if (bytes <= 0 || bytes > (int64_t) (nkeys * 4 * 4096)) {
+        fprintf(stderr, "CQF flushed %ld bytes for %lu removes.\n", bytes,
+                nkeys);
+        abort();
+    }
+    cqf_deletefile(&cqf);
+    printf("validated\n");
+
+    free(keys);
+}
+
+void cqf_resize_file_test()
+{
+    CQF cqf, expected;
+    const char *filename = "test-resize.cqf";
+    char resized[64];
+    struct stat sb;
+
+    // Fill a file-backed CQF with counted keys until it grows in place
+    uint32_t q = 14;
+    uint64_t nslots = 1ULL << q;
+    uint64_t nkeys = 2 * nslots;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    RAND_bytes((unsigned char *) keys, sizeof(*keys) * nkeys);
+    for (uint64_t i = 0; i < nkeys; i++)
+        keys[i] &= (1ULL << (q + 12)) - 1;
+    printf("Testing in-place CQF file resize with %lu insertion ", nkeys);
+    if (!cqf_initfile(&cqf, nslots, q + 12, 4, QF_HASH_NONE, 0, filename) ||
+        !cqf_malloc(&expected, 4 * nslots, q + 12, 4, QF_HASH_NONE, 0)) {
+        fprintf(stderr, "CQF failed to create %s.\n", filename);
+        abort();
+    }
+    cqf_reset(&expected);
+    cqf_set_auto_resize(&cqf, true);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        uint64_t value = keys[i] % 16, count = 1 + keys[i] % 3 / 2 * 300;
+        if (cqf_insert(&cqf, keys[i], value, count,
+                       QF_NO_LOCK | QF_KEY_IS_HASH) < 0 ||
+            cqf_insert(&expected, keys[i], value, count,
+                       QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+            fprintf(stderr, "failed insertion for key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    uint64_t final_nslots = cqf.metadata->nslots;
+    if (final_nslots < 4 * nslots) {
+        fprintf(stderr, "CQF resized to a wrong size.\n");
+        abort();
+    }
+    cqf_closefile(&cqf);
+
+    // The file holds just the bigger CQF, with the same contents
+    for (uint64_t n = 2 * nslots; n <= final_nslots; n *= 2) {
+        snprintf(resized, sizeof(resized), "%s_%lu", filename, n);
+        if (stat(resized, &sb) == 0) {
+            fprintf(stderr, "CQF resize left %s behind.\n", resized);
+            abort();
+        }
+    }
+    if (stat(filename, &sb) < 0 ||
+        (uint64_t) sb.st_size != cqf_usefile(&cqf, filename,
+                                             QF_USEFILE_READ_WRITE)) {
+        fprintf(stderr, "CQF failed to resize %s in place.\n", filename);
+        abort();
+    }
+    if (cqf_get_num_distinct_key_value_pairs(&cqf) !=
+            cqf_get_num_distinct_key_value_pairs(&expected) ||
+        cqf_get_num_occupied_slots(&cqf) >
+            cqf_get_num_occupied_slots(&expected)) {
+        fprintf(stderr, "CQF miscounted after resizing.\n");
+        abort();
+    }
+    QFi qfi, efi;
+    cqf_iterator_from_position(&cqf, &qfi, 0);
+    cqf_iterator_from_position(&expected, &efi, 0);
+    do {
+        uint64_t key, value, count, ekey, evalue, ecount;
+        cqfi_get_hash(&qfi, &key, &value, &count);
+        cqfi_get_hash(&efi, &ekey, &evalue, &ecount);
+        if (key != ekey || value != evalue || count != ecount) {
+            fprintf(stderr, "CQF resize lost key: %lx.\n", ekey);
+            abort();
+        }
+        cqfi_next(&efi);
+    } while (!cqfi_next(&qfi) && !cqfi_end(&efi));
+    if (!cqfi_end(&qfi) || !cqfi_end(&efi)) {
+        fprintf(stderr, "CQF resize changed the number of keys.\n");
+        abort();
+    }
+
+    // A file left behind by a resize that was cut short is refused
+    cqf.metadata->reserved = CQF_RESIZING;
+    cqf_closefile(&cqf);
+    if (cqf_usefile(&cqf, filename, QF_USEFILE_READ_ONLY) != 0) {
+        fprintf(stderr, "CQF opened the half resized %s.\n", filename);
+        abort();
+    }
+    cqf_free(&expected);
+    remove(filename);
+    printf("validated\n");
+
+    free(keys);
+}
+
+typedef struct {
+    CQF *cqf;
+    const uint64_t *keys;
+    uint64_t n;
+    const uint64_t *hot;
+    uint64_t nhot;
+} cqf_buffer_worker_args;
+
+static void *cqf_buffer_worker(void *arg)
+{
+    cqf_buffer_worker_args *args = arg;
+    cqf_insert_buffer buf;
+
+    if (!cqf_insert_buffer_init(args->cqf, &buf, 1024)) {
+        fprintf(stderr, "Can't allocate insert buffer.\n");
+        abort();
+    }
+    for (uint64_t i = 0; i < args->n; i++) {
+        uint8_t flags = QF_WAIT_FOR_LOCK | QF_KEY_IS_HASH;
+        if (cqf_buffered_insert(&buf, args->keys[i], 0, 1, flags) < 0 ||
+            (i < args->nhot &&
+             cqf_buffered_insert(&buf, args->hot[i], 0, 2, flags) < 0)) {
+            fprintf(stderr, "failed buffered insertion.\n");
+            abort();
+        }
+    }
+    if (cqf_insert_buffer_flush(&buf, QF_WAIT_FOR_LOCK) != 0) {
+        fprintf(stderr, "CQF failed to drain an insert buffer.\n");
+        abort();
+    }
+    cqf_insert_buffer_destroy(&buf);
+    return NULL;
+}
+
+void cqf_buffer_test()
+{
+    CQF cqf;
+    const int nthreads = 8;
+    pthread_t threads[nthreads];
+    cqf_buffer_worker_args args[nthreads];
+
+    // Threads insert distinct keys through buffers of their own, and all of
+    // them a few hot keys, which are combined in the buffers
+    uint32_t q = 20;
+    uint64_t nslots = 1ULL << q;
+    uint64_t nkeys = 3 * nslots / 4;
+    uint64_t nhot = 100;
+    uint64_t mask = (1ULL << (q + 8)) - 1;
+    uint64_t *keys = calloc(nkeys + nhot, sizeof(uint64_t));
+    for (uint64_t i = 0; i < nkeys + nhot; i++)
+        keys[i] = (i * 0x9e3779b97f4a7c15ULL) & mask;
+    if (!cqf_malloc(&cqf, nslots, q + 8, 0, QF_HASH_NONE, 0)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    cqf_reset(&cqf);
+    printf("Testing CQF insert buffers with %lu insertion ", nkeys);
+    for (int t = 0; t < nthreads; t++) {
+        uint64_t begin = nkeys * t / nthreads;
+        uint64_t end = nkeys * (t + 1) / nthreads;
+        args[t] = (cqf_buffer_worker_args){&cqf, keys + begin, end - begin,
+                                           keys + nkeys, nhot};
+        pthread_create(&threads[t], NULL, cqf_buffer_worker, &args[t]);
+    }
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    for (uint64_t i = 0; i < nkeys + nhot; i++) {
+        uint64_t expected = i < nkeys ? 1 : 2 * nthreads;
+        if (cqf_count_key_value(&cqf, keys[i], 0, QF_KEY_IS_HASH) !=
+            expected) {
+            fprintf(stderr, "CQF miscounted buffered key: %lx.\n", keys[i]);
+            abort();
+        }
+    }
+    if (cqf_get_num_distinct_key_value_pairs(&cqf) != nkeys + nhot ||
+        cqf_get_sum_of_counts(&cqf) != nkeys + 2 * nthreads * nhot) {
+        fprintf(stderr, "CQF miscounted buffered inserts.\n");
+        abort();
+    }
+    cqf_free(&cqf);
+
+    // A buffer in front of a full CQF keeps what didn't fit
+    cqf_insert_buffer buf;
+    cqf_malloc(&cqf, 1 << 10, 18, 0, QF_HASH_NONE, 0);
+    cqf_reset(&cqf);
+    cqf_insert_buffer_init(&cqf, &buf, 2048);
+    uint64_t nbuffered = 0;
+    while (nbuffered < 4096 &&
+           cqf_buffered_insert(&buf, keys[nbuffered] & ((1 << 18) - 1), 0, 1,
+                               QF_NO_LOCK) == 0)
+        nbuffered++;
+    if (nbuffered != cqf_get_num_distinct_key_value_pairs(&cqf) + 2048 ||
+        cqf_insert_buffer_flush(&buf, QF_NO_LOCK) != QF_NO_SPACE ||
+        buf.nitems != 2048) {
+        fprintf(stderr, "CQF buffer overflowed a full CQF.\n");
+        abort();
+    }
+    cqf_insert_buffer_destroy(&buf);
+    cqf_free(&cqf);
+    printf("validated\n");
+
+    free(keys);
+}
+
+typedef struct {
+    CQF *cqf;
+    const uint64_t *keys;
+    const uint64_t *values;
+    const uint64_t *counts;
+    uint64_t n;
+} cqf_batch_worker_args;
+
+static void *cqf_batch_worker(void *arg)
+{
+    cqf_batch_worker_args *args = arg;
+    if (cqf_insert_batch(args->cqf, args->keys, args->values, args->counts,
+                         args->n, QF_WAIT_FOR_LOCK | QF_KEY_IS_HASH) < 0) {
+        fprintf(stderr, "CQF failed a locked batch insert.\n");
+        abort();
+    }
+    return NULL;
+}
+
+void cqf_insert_batch_test()
+{
+    CQF cqf, expected;
+    const int nthreads = 2;
+    pthread_t threads[nthreads];
+    cqf_batch_worker_args args[nthreads];
+
+    // Batches, with repeated keys and large counts, must leave the same
+    // table behind as inserting the keys one at a time
+    printf("Testing CQF batch insertion ");
+    for (uint32_t q = 10; q <= 18; q += 8) {
+        uint64_t nslots = 1ULL << q;
+        uint64_t nkeys = 3 * nslots / 4;
+        uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+        uint64_t *values = calloc(nkeys, sizeof(uint64_t));
+        uint64_t *counts = calloc(nkeys, sizeof(uint64_t));
+        for (uint64_t i = 0; i < nkeys; i++) {
+            keys[i] = i > 0 && rand() % 8 == 0
+                          ? keys[rand() % i]
+                          : (((uint64_t) rand() << 31) | rand()) &
+                                ((1ULL << (q + 8)) - 1);
+            values[i] = rand() % 4;
+            counts[i] = rand() % 16 == 0 ? rand() % 100000 : 1;
+        }
+
+        for (int locked = 0; locked <= 1; locked++) {
+            if (!cqf_malloc(&cqf, nslots, q + 8, 2, QF_HASH_NONE, 0) ||
+                !cqf_malloc(&expected, nslots, q + 8, 2, QF_HASH_NONE, 0)) {
+                fprintf(stderr, "Can't allocate set.\n");
+                abort();
+            }
+            cqf_reset(&cqf);
+            cqf_reset(&expected);
+            for (uint64_t i = 0; i < nkeys; i++)
+                cqf_insert(&expected, keys[i], values[i], counts[i],
+                           QF_NO_LOCK | QF_KEY_IS_HASH);
+
+            if (locked) {
+                for (int t = 0; t < nthreads; t++) {
+                    uint64_t begin = nkeys * t / nthreads;
+                    uint64_t end = nkeys * (t + 1) / nthreads;
+                    args[t] = (cqf_batch_worker_args){
+                        &cqf, keys + begin, values + begin, counts + begin,
+                        end - begin};
+                    pthread_create(&threads[t], NULL, cqf_batch_worker,
+                                   &args[t]);
+                }
+                for (int t = 0; t < nthreads; t++)
+                    pthread_join(threads[t], NULL);
+            } else {
+                // Half the keys in one dense batch, the rest in sparse ones
+                for (uint64_t i = 0, n = nkeys / 2; i < nkeys; i += n) {
+                    if (i > 0)
+                        n = nkeys - i < nkeys / 16 ? nkeys - i : nkeys / 16;
+                    if (cqf_insert_batch(&cqf, keys + i, values + i,
+                                         counts + i, n,
+                                         QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+                        fprintf(stderr, "CQF failed a batch insert.\n");
+                        abort();
+                    }
+                }
+            }
+
+            if (memcmp(cqf.blocks, expected.blocks,
+                       cqf.metadata->total_size_in_bytes) != 0 ||
+                cqf_get_sum_of_counts(&cqf) !=
+                    cqf_get_sum_of_counts(&expected) ||
+                cqf_get_num_distinct_key_value_pairs(&cqf) !=
+                    cqf_get_num_distinct_key_value_pairs(&expected) ||
+                cqf_get_num_occupied_slots(&cqf) !=
+                    cqf_get_num_occupied_slots(&expected)) {
+                fprintf(stderr, "CQF batch insert differs (q=%u).\n", q);
+                abort();
+            }
+            cqf_free(&cqf);
+            cqf_free(&expected);
+            printf(".");
+        }
+        free(keys);
+        free(values);
+        free(counts);
+    }
+
+    // Overfilling stops with QF_NO_SPACE, each item in or out whole
+    const uint32_t q = 18;
+    const uint64_t nslots = 1ULL << q;
+    const uint64_t nkeys = 6 * nslots / 5;
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *counts = calloc(nkeys, sizeof(uint64_t));
+    for (uint64_t i = 0; i < nkeys; i++) {
+        // An odd multiplier keeps the keys distinct
+        keys[i] = (i * 0x9e3779b97f4a7c15ULL) & ((1ULL << (q + 8)) - 1);
+        counts[i] = rand() % 16 == 0 ? rand() % 100000 + 1 : 1;
+    }
+    for (int locked = 0; locked <= 1; locked++) {
+        if (!cqf_malloc(&cqf, nslots, q + 8, 0, QF_HASH_NONE, 0)) {
+            fprintf(stderr, "Can't allocate set.\n");
+            abort();
+        }
+        cqf_reset(&cqf);
+        uint8_t flags = locked ? QF_WAIT_FOR_LOCK : QF_NO_LOCK;
+        if (cqf_insert_batch(&cqf, keys, NULL, counts, nkeys,
+                             flags | QF_KEY_IS_HASH) != QF_NO_SPACE) {
+            fprintf(stderr, "CQF batch overfilled without QF_NO_SPACE.\n");
+            abort();
+        }
+        uint64_t present = 0, sum = 0;
+        for (uint64_t i = 0; i < nkeys; i++) {
+            uint64_t count =
+                cqf_count_key_value(&cqf, keys[i], 0, QF_KEY_IS_HASH);
+            if (count != 0 && count != counts[i]) {
+                fprintf(stderr, "CQF overfilled batch miscounted %lx.\n",
+                        keys[i]);
+                abort();
+            }
+            present += count != 0;
+            sum += count;
+        }
+        if (present < nslots / 2 ||
+            present != cqf_get_num_distinct_key_value_pairs(&cqf) ||
+            sum != cqf_get_sum_of_counts(&cqf)) {
+            fprintf(stderr, "CQF overfilled batch lost track of keys.\n");
+            abort();
+        }
+        cqf_free(&cqf);
+        printf(".");
+    }
+    free(keys);
+    free(counts);
+    printf(" validated\n");
+}
+
+static void cqf_check_same(const CQF *cqf, const CQF *expected, const char *op)
+{
+    if (memcmp(cqf->blocks, expected->blocks,
+               cqf->metadata->total_size_in_bytes) != 0 ||
+        cqf_get_sum_of_counts(cqf) != cqf_get_sum_of_counts(expected) ||
+        cqf_get_num_distinct_key_value_pairs(cqf) !=
+            cqf_get_num_distinct_key_value_pairs(expected) ||
+        cqf_get_num_occupied_slots(cqf) !=
+            cqf_get_num_occupied_slots(expected)) {
+        fprintf(stderr, "CQF %s differs from inserting.\n", op);
+        abort();
+    }
+}
+
+void cqf_build_from_sorted_test()
+{
+    CQF cqf, expected, parts[3];
+    const uint32_t q = 16;
+    const uint64_t nslots = 1ULL << q;
+    const uint64_t nkeys = 3 * nslots / 4;
+
+    printf("Testing CQF bulk build ");
+    uint64_t *hashes = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *counts = calloc(nkeys, sizeof(uint64_t));
+    for (uint64_t i = 0; i < nkeys; i++) {
+        hashes[i] = i > 0 && rand() % 8 == 0
+                        ? hashes[rand() % i]
+                        : (((uint64_t) rand() << 31) | rand()) &
+                              ((1ULL << (q + 8)) - 1);
+        counts[i] = rand() % 16 == 0 ? rand() % 100000 : 1;
+    }
+    qsort(hashes, nkeys, sizeof(uint64_t), cmp_u64);
+
+    if (!cqf_malloc(&cqf, nslots, q + 8, 0, QF_HASH_NONE, 0) ||
+        !cqf_malloc(&expected, nslots, q + 8, 0, QF_HASH_NONE, 0)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    cqf_reset(&cqf);
+    cqf_reset(&expected);
+    for (uint64_t i = 0; i < nkeys; i++)
+        cqf_insert(&expected, hashes[i], 0, counts[i],
+                   QF_NO_LOCK | QF_KEY_IS_HASH);
+
+    // The build replaces whatever the CQF held
+    cqf_insert(&cqf, 1, 0, 1, QF_NO_LOCK | QF_KEY_IS_HASH);
+    if (cqf_build_from_sorted(&cqf, hashes, NULL, counts, nkeys) != 0) {
+        fprintf(stderr, "CQF failed a bulk build.\n");
+        abort();
+    }
+    cqf_check_same(&cqf, &expected, "bulk build");
+    printf(".");
+
+    // Merging into an empty CQF goes through the same path
+    for (int i = 0; i < 3; i++) {
+        if (!cqf_malloc(&parts[i], nslots, q + 8, 0, QF_HASH_NONE, 0)) {
+            fprintf(stderr, "Can't allocate set.\n");
+            abort();
+        }
+        cqf_reset(&parts[i]);
+    }
+    for (uint64_t i = 0; i < nkeys; i++)
+        cqf_insert(&parts[rand() % 3], hashes[i], 0, counts[i],
+                   QF_NO_LOCK | QF_KEY_IS_HASH);
+    cqf_reset(&cqf);
+    const CQF *arr[3] = {&parts[0], &parts[1], &parts[2]};
+    cqf_multi_merge(arr, 3, &cqf);
+    cqf_check_same(&cqf, &expected, "multi merge");
+    cqf_reset(&cqf);
+    cqf_merge(&parts[0], &parts[1], &cqf);
+    cqf_reset(&parts[0]);
+    cqf_merge(&cqf, &parts[2], &parts[0]);
+    cqf_check_same(&parts[0], &expected, "merge");
+    for (int i = 0; i < 3; i++)
+        cqf_free(&parts[i]);
+    printf(".");
+
+    // Unsorted input and a stream that doesn't fit leave the CQF empty
+    uint64_t unsorted[2] = {hashes[1], hashes[0]};
+    if (hashes[0] == hashes[1] ||
+        cqf_build_from_sorted(&cqf, unsorted, NULL, NULL, 2) != QF_INVALID ||
+        cqf_get_num_distinct_key_value_pairs(&cqf) != 0) {
+        fprintf(stderr, "CQF accepted unsorted hashes.\n");
+        abort();
+    }
+    cqf_free(&cqf);
+    if (!cqf_malloc(&cqf, nslots / 2, q + 7, 0, QF_HASH_NONE, 0)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    cqf_reset(&cqf);
+    for (uint64_t i = 0; i < nkeys; i++)
+        hashes[i] >>= 1;
+    if (cqf_build_from_sorted(&cqf, hashes, NULL, counts, nkeys) !=
+            QF_NO_SPACE ||
+        cqf_get_num_distinct_key_value_pairs(&cqf) != 0) {
+        fprintf(stderr, "CQF built past its capacity.\n");
+        abort();
+    }
+    printf(".");
+
+    cqf_free(&cqf);
+    cqf_free(&expected);
+    free(hashes);
+    free(counts);
+    printf(" validated\n");
+}
+
+void cqf_query_batch_test()
+{
+    CQF cqf;
+    const uint32_t q = 16;
+    const uint64_t nslots = 1ULL << q;
+    const uint64_t nkeys = 3 * nslots / 4 + 5;
+
+    printf("Testing CQF batch lookups with %lu keys ", nkeys);
+    if (!cqf_malloc(&cqf, nslots, q + 8, 4, QF_HASH_DEFAULT, 0)) {
+        fprintf(stderr, "Can't allocate set.\n");
+        abort();
+    }
+    cqf_reset(&cqf);
+    uint64_t *keys = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *values = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *counts = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *found = calloc(nkeys, sizeof(uint64_t));
+    // Insert half the keys, the other half mostly misses
+    for (uint64_t i = 0; i < nkeys; i++) {
+        keys[i] = ((uint64_t) rand() << 31) | rand();
+        values[i] = rand() % 16;
+        if (i % 2 == 0 &&
+            cqf_insert(&cqf, keys[i], values[i],
+                       rand() % 16 == 0 ? 1 + rand() % 1000 : 1,
+                       QF_NO_LOCK) < 0) {
+            fprintf(stderr, "CQF is full.\n");
+            abort();
+        }
+    }
+
+    cqf_count_key_value_batch(&cqf, keys, values, counts, nkeys, 0);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        if (counts[i] != cqf_count_key_value(&cqf, keys[i], values[i], 0) ||
+            (i % 2 == 0 && counts[i] == 0)) {
+            fprintf(stderr, "CQF batch count differs for key %lu.\n", i);
+            abort();
+        }
+    }
+    printf(".");
+
+    cqf_query_batch(&cqf, keys, found, counts, nkeys, 0);
+    for (uint64_t i = 0; i < nkeys; i++) {
+        uint64_t value;
+        uint64_t count = cqf_query(&cqf, keys[i], &value, 0);
+        if (counts[i] != count || (count && found[i] != value)) {
+            fprintf(stderr, "CQF batch query differs for key %lu.\n", i);
+            abort();
+        }
+    }
+    printf(".");
+
+    cqf_free(&cqf);
+    free(keys);
+    free(values);
+    free(counts);
+    free(found);
+    printf(" validated\n");
+}
+
+void cqf_count_simd_test()
+{
+    CQF cqf;
+    const uint32_t q = 12;
+    const uint64_t nslots = 1ULL << q;
+    const uint64_t nkeys = nslots / 4;
+    uint64_t *hashes = calloc(nkeys, sizeof(uint64_t));
+    uint64_t *counts = calloc(nkeys, sizeof(uint64_t));
+
+    // Counts of every slot width the runs are scanned with, checked
+    // against the iterator.  Probing each bucket with the slots near it
+    // also probes remainders that only appear as counter digits.
+    printf("Testing CQF counts with byte-aligned slots ");
+    for (uint64_t width = 8; width <= 32; width *= 2) {
+        if (QF_BITS_PER_SLOT && width != QF_BITS_PER_SLOT)
+            continue;
+        if (!cqf_malloc(&cqf, nslots, q + width, 0, QF_HASH_NONE, 0)) {
+            fprintf(stderr, "Can't allocate set.\n");
+            abort();
+        }
+        cqf_reset(&cqf);
+        // An eighth of the keys crowd into a few buckets to make long runs
+        for (uint64_t i = 0; i < nkeys; i++) {
+            uint64_t bucket = rand() % 8 == 0 ? rand() % 16 : rand() % nslots;
+            uint64_t remainder = (((uint64_t) rand() << 31) | rand()) &
+                                 ((1ULL << width) - 1);
+            uint64_t count =
+                rand() % 4 == 0 ? 1 + rand() % 1000000 : 1 + rand() % 3;
+            if (cqf_insert(&cqf, (bucket << width) | remainder, 0, count,
+                           QF_NO_LOCK | QF_KEY_IS_HASH) < 0) {
+                fprintf(stderr, "CQF is full.\n");
+                abort();
+            }
+        }
+
+        uint64_t n = 0;
+        QFi qfi;
+        cqf_iterator_from_position(&cqf, &qfi, 0);
+        do {
+            uint64_t value;
+            cqfi_get_hash(&qfi, &hashes[n], &value, &counts[n]);
+            n++;
+        } while (!cqfi_next(&qfi));
+
+        for (uint64_t bucket = 0; bucket < nslots; bucket++) {
+            uint64_t nprobes = width == 8 ? 256 : 33;
+            for (uint64_t p = 0; p < nprobes; p++) {
+                uint64_t remainder = p;
+                uint64_t index = bucket + p;
+                if (width > 8 && p < 32 && index < cqf.metadata->xnslots) {
+                    remainder = 0;
+                    memcpy(&remainder,
+                           (const uint8_t *) get_block(
+                               &cqf, index / QF_SLOTS_PER_BLOCK)
+                                   ->slots +
+                               (index % QF_SLOTS_PER_BLOCK) * width / 8,
+                           width / 8);
+                }
+                uint64_t hash = (bucket << width) | remainder;
+                uint64_t *found =
+                    bsearch(&hash, hashes, n, sizeof(uint64_t), cmp_u64);
+                uint64_t expected = found ? counts[found - hashes] : 0;
+                if (cqf_count_key_value(&cqf, hash, 0, QF_KEY_IS_HASH) !=
+                    expected) {
+                    fprintf(stderr,
+                            "CQF count of %lx differs (width %lu).\n", hash,
+                            width);
+                    abort();
+                }
+            }
+        }
+        cqf_free(&cqf);
+        printf(".");
+    }
+    free(hashes);
+    free(counts);
+    printf(" validated\n");
+}
+
 int main()
 {
     srand(0);
     qf_test();
+    qf_width_test();
+    qf_sorted_test();
+    qf_merge_test();
+    qf_setop_test();
+    qf_subset_test();
+    qf_expand_test();
+    qf_sparse_test();
+    qf_run_test();
+    qf_remove_batch_test();
+    qf_verify_test();
+    qf_stats_test();
+    qf_concurrent_test();
+    qf_convert_test();
+    qf_file_test();
+    qf_wal_test();
+    qf_flush_test();
+    qf_expandfile_test();
+    qf_large_test();
+    printf("\n------------------------------------------------\n\n");
+    bqf_test();
     printf("\n------------------------------------------------\n\n");
     cqf_test();
+    cqf_flush_test();
+    cqf_resize_file_test();
+    cqf_buffer_test();
+    cqf_insert_batch_test();
+    cqf_build_from_sorted_test();
+    cqf_query_batch_test();
+    cqf_count_simd_test();
 
     return 0;
 }
\ No newline at end of file